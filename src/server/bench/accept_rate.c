@@ -0,0 +1,96 @@
+/* Connection setup rate: client threads each open a connection, send
+ * one frame, wait for the echo and reset the connection, over and over.
+ * Every connection has to be accepted, registered and read by a reactor
+ * before its echo comes back, so this is accepts per second end to end.
+ *
+ * Usage: accept_rate [-p port] [-t reactors] [-c clients] [-n conns_per_client] [-u]
+ * The server logs every reset connection to stderr, send it to /dev/null.
+ * An exiting io_uring run keeps its listener until the kernel has torn
+ * its ring down, so leave a second between runs on the same port.
+ */
+#include "../test/harness.h"
+
+static struct sockaddr_in server_addr;
+static int conns_per_client = 5000;
+
+static void echo(int sockfd, char *msg, size_t msg_sz)
+{
+	struct iovec iov = { msg, msg_sz };
+
+	net_send_frame(sockfd, &iov, 1);
+}
+
+static void *client(void *arg)
+{
+	struct linger lg = { 1, 0 };
+	char buf[16];
+	int idx, fd, one = 1;
+
+	for(idx = 0; idx < conns_per_client; ++idx) {
+		CHECK((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+		CHECK(connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		send_frame(fd, "x", 1);
+		CHECK(read_frame(fd, buf, sizeof(buf), 5000) == 1);
+		// Reset rather than close so no TIME_WAIT eats the ports
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		close(fd);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct net_config conf = {
+		.port = "51601",
+		.num_reactors = 1,
+		.backend = NET_BACKEND_EPOLL,
+	};
+	pthread_t *tids;
+	int num_clients = 4, idx, opt;
+	double start, secs;
+
+	while((opt = getopt(argc, argv, "p:t:c:n:u")) != -1) {
+		switch(opt) {
+		case 'p':
+			conf.port = optarg;
+			break;
+		case 't':
+			conf.num_reactors = atoi(optarg);
+			break;
+		case 'c':
+			num_clients = atoi(optarg);
+			break;
+		case 'n':
+			conns_per_client = atoi(optarg);
+			break;
+		case 'u':
+			conf.backend = NET_BACKEND_URING;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-t reactors] [-c clients]"
+				" [-n conns_per_client] [-u]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	start_server(&conf, echo);
+	close(connect_to(conf.port));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(atoi(conf.port));
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	CHECK((tids = malloc(num_clients * sizeof(pthread_t))) != NULL);
+	start = now_sec();
+	for(idx = 0; idx < num_clients; ++idx)
+		CHECK(pthread_create(&tids[idx], NULL, client, NULL) == 0);
+	for(idx = 0; idx < num_clients; ++idx)
+		pthread_join(tids[idx], NULL);
+	secs = now_sec() - start;
+
+	printf("%s, %d reactors, %d clients: %d connections in %.2fs, %.0f/s\n",
+		conf.backend == NET_BACKEND_URING ? "io_uring" : "epoll",
+		conf.num_reactors, num_clients, num_clients * conns_per_client,
+		secs, num_clients * conns_per_client / secs);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/* Broadcast throughput against fan-out width. One publisher floods a
+ * group with fixed size broadcasts while W subscriber connections, read
+ * by a handful of threads, drain them; the publisher stays at most a
+ * window of broadcasts ahead of the slowest reader so nobody overflows.
+ * Each width gets as many broadcasts as it takes to make -n deliveries.
+ * Runs ./smoke, so start it from src/server.
+ *
+ * Usage: fanout [-p port] [-t reactors] [-n deliveries] [-s msg_size] [-u] [width...]
+ */
+#include <errno.h>
+#include <sys/epoll.h>
+#include <stdatomic.h>
+#include "../test/harness.h"
+
+#define READERS 4
+#define WINDOW 64
+
+struct reader {
+	pthread_t tid;
+	int epfd;
+	int num_fds;
+};
+
+static atomic_ulong received; // bytes, over every subscriber
+static atomic_int stop;
+
+static void *reader(void *arg)
+{
+	struct reader *rd = arg;
+	struct epoll_event evs[64];
+	char buf[1 << 16];
+	int n, idx;
+	ssize_t len;
+
+	while(!atomic_load(&stop)) {
+		n = epoll_wait(rd->epfd, evs, 64, 10);
+		for(idx = 0; idx < n; ++idx) {
+			while((len = read(evs[idx].data.fd, buf, sizeof(buf))) > 0)
+				atomic_fetch_add(&received, len);
+			CHECK(len == -1 && errno == EAGAIN); // EOF: we were evicted
+		}
+	}
+	return NULL;
+}
+
+/* width subscribers of group, each confirmed by a LISTMEMBERS round trip
+ * so the subscription is in place before anything is published.
+ */
+static int *subscribe_all(const char *port, const char *group, int width, struct reader *rds)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	char reply[512];
+	int *fds, idx;
+
+	CHECK((fds = malloc(width * sizeof(int))) != NULL);
+	for(idx = 0; idx < width; ++idx) {
+		fds[idx] = connect_to(port);
+		send_msg(fds[idx], SUBGROUP, group, NULL, 0);
+		send_msg(fds[idx], LISTMEMBERS, group, NULL, 0);
+		CHECK(read_frame(fds[idx], reply, sizeof(reply), 5000) > 0);
+		CHECK(fcntl(fds[idx], F_SETFL, O_NONBLOCK) == 0);
+		ev.data.fd = fds[idx];
+		CHECK(epoll_ctl(rds[idx % READERS].epfd, EPOLL_CTL_ADD, fds[idx], &ev) == 0);
+	}
+	return fds;
+}
+
+static void run(const char *port, int width, long deliveries, size_t msg_size)
+{
+	struct reader rds[READERS];
+	char group[32], body[65535], msg[2 + 32 + 2 + 65535];
+	size_t msg_len, frame_len;
+	unsigned long expected;
+	double start, secs;
+	int pub, *fds, idx, sent, count;
+
+	count = deliveries / width > WINDOW ? deliveries / width : WINDOW;
+	snprintf(group, sizeof(group), "fanout.%d", width);
+	memset(body, 'x', msg_size);
+	pub = connect_to(port);
+	send_msg(pub, JOINGROUP, group, "10.0.0.1:1", 10);
+
+	atomic_store(&received, 0);
+	atomic_store(&stop, 0);
+	for(idx = 0; idx < READERS; ++idx)
+		CHECK((rds[idx].epfd = epoll_create1(0)) != -1);
+	fds = subscribe_all(port, group, width, rds);
+	for(idx = 0; idx < READERS; ++idx)
+		CHECK(pthread_create(&rds[idx].tid, NULL, reader, &rds[idx]) == 0);
+
+	msg_len = build_msg(msg, BROADCAST, group, body, msg_size);
+	frame_len = 8 + msg_len; // what each subscriber gets back is the same shape
+	expected = (unsigned long)count * width * frame_len;
+	start = now_sec();
+	for(sent = 0; sent < count; ++sent) {
+		while(sent > WINDOW &&
+		      (unsigned long)(sent - WINDOW) * width * frame_len > atomic_load(&received))
+			sched_yield();
+		send_frame(pub, msg, msg_len);
+	}
+	while(atomic_load(&received) < expected)
+		sched_yield();
+	secs = now_sec() - start;
+
+	atomic_store(&stop, 1);
+	for(idx = 0; idx < READERS; ++idx) {
+		pthread_join(rds[idx].tid, NULL);
+		close(rds[idx].epfd);
+	}
+	for(idx = 0; idx < width; ++idx)
+		close(fds[idx]);
+	free(fds);
+	close(pub);
+
+	printf("width %6d: %8.0f broadcasts/s %10.0f deliveries/s %8.1f MB/s\n", width,
+		count / secs, (double)count * width / secs, expected / secs / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int default_widths[] = { 1, 10, 100, 1000 };
+	const char *port = "51611", *args[8] = { NULL };
+	long deliveries = 1000000;
+	int nargs = 0, idx, opt;
+	size_t msg_size = 64;
+
+	while((opt = getopt(argc, argv, "p:t:n:s:u")) != -1) {
+		switch(opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 't':
+			args[nargs++] = "-t";
+			args[nargs++] = optarg;
+			break;
+		case 'n':
+			deliveries = atol(optarg);
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			args[nargs++] = "-u";
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-t reactors] [-n deliveries]"
+				" [-s msg_size] [-u] [width...]\n", argv[0]);
+			return 1;
+		}
+	}
+	CHECK(msg_size <= 65535);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	raise_fd_limit();
+	spawn_smoke(port, args);
+	if(optind == argc) {
+		for(idx = 0; idx < 4; ++idx)
+			run(port, default_widths[idx], deliveries, msg_size);
+	}
+	for(idx = optind; idx < argc; ++idx)
+		run(port, atoi(argv[idx]), deliveries, msg_size);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/* hashmap.c against the chained map it replaced (bench/old_hashmap.c):
+ * ns per insert, hit, miss and remove for n group-name-like keys, the
+ * lookups in random order and repeated until there have been at least
+ * a few million of them, so small tables are measured warm.
+ *
+ * Usage: hashmap [-n keys]
+ */
+#include "../test/harness.h"
+#include "hashmap.h"
+#include "old_hashmap.c"
+
+struct ops {
+	const char *name;
+	void *(*create)();
+	int (*put)(void *map, const char *key, void *data);
+	void *(*get)(void *map, const char *key);
+	void *(*remove)(void *map, const char *key);
+};
+
+static void *new_create() { return initialize_map(); }
+static int new_put(void *map, const char *key, void *data) { return map_put(map, (char *)key, data); }
+static void *new_get(void *map, const char *key) { return map_get(map, (char *)key); }
+static void *new_remove(void *map, const char *key) { return map_remove(map, (char *)key); }
+
+static void *old_create() { return old_initialize_map(); }
+static int old_put(void *map, const char *key, void *data) { return old_map_put(map, key, data); }
+static void *old_get(void *map, const char *key) { return old_map_get(map, key); }
+static void *old_remove(void *map, const char *key) { return old_map_remove(map, key); }
+
+static const struct ops impls[] = {
+	{ "hashmap.c", new_create, new_put, new_get, new_remove },
+	{ "chained", old_create, old_put, old_get, old_remove },
+};
+
+static char **make_keys(long n, const char *prefix)
+{
+	char **keys, buf[64];
+	long idx;
+
+	CHECK((keys = malloc(n * sizeof(char *))) != NULL);
+	for(idx = 0; idx < n; ++idx) {
+		snprintf(buf, sizeof(buf), "%s.%ld.members", prefix, idx);
+		CHECK((keys[idx] = strdup(buf)) != NULL);
+	}
+	return keys;
+}
+
+static long *shuffled(long n)
+{
+	long *order, idx, j, tmp;
+
+	CHECK((order = malloc(n * sizeof(long))) != NULL);
+	for(idx = 0; idx < n; ++idx)
+		order[idx] = idx;
+	srandom(1);
+	for(idx = n - 1; idx > 0; --idx) {
+		j = random() % (idx + 1);
+		tmp = order[idx];
+		order[idx] = order[j];
+		order[j] = tmp;
+	}
+	return order;
+}
+
+static void run(const struct ops *ops, char **keys, char **misses, long *order, long n)
+{
+	double start, put, hit, miss, rem;
+	long idx, round, rounds = n < 4000000 ? 4000000 / n : 1;
+	void *map;
+
+	CHECK((map = ops->create()) != NULL);
+	start = now_sec();
+	for(idx = 0; idx < n; ++idx)
+		CHECK(ops->put(map, keys[idx], keys[idx]) == 0);
+	put = now_sec() - start;
+
+	start = now_sec();
+	for(round = 0; round < rounds; ++round) {
+		for(idx = 0; idx < n; ++idx)
+			CHECK(ops->get(map, keys[order[idx]]) == keys[order[idx]]);
+	}
+	hit = (now_sec() - start) / rounds;
+
+	start = now_sec();
+	for(round = 0; round < rounds; ++round) {
+		for(idx = 0; idx < n; ++idx)
+			CHECK(ops->get(map, misses[order[idx]]) == NULL);
+	}
+	miss = (now_sec() - start) / rounds;
+
+	start = now_sec();
+	for(idx = 0; idx < n; ++idx)
+		CHECK(ops->remove(map, keys[order[idx]]) == keys[order[idx]]);
+	rem = now_sec() - start;
+
+	printf("%-10s %8ld keys: put %6.1f  hit %6.1f  miss %6.1f  remove %6.1f ns\n",
+		ops->name, n, put * 1e9 / n, hit * 1e9 / n, miss * 1e9 / n, rem * 1e9 / n);
+}
+
+int main(int argc, char *argv[])
+{
+	long n = 1000000, *order;
+	char **keys, **misses;
+	int opt, idx;
+
+	while((opt = getopt(argc, argv, "n:")) != -1) {
+		switch(opt) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n keys]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	keys = make_keys(n, "group");
+	misses = make_keys(n, "absent");
+	order = shuffled(n);
+	for(idx = 0; idx < 2; ++idx)
+		run(&impls[idx], keys, misses, order, n);
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* The chained hashmap hashmap.c replaced, kept for bench/hashmap to
+ * compare against: a malloc'd entry and a strdup'd key per put, djb2,
+ * and a doubling of the bucket array whenever one bucket passes
+ * BUCKET_LIMIT. Two bugs are fixed so it can be measured at all: put
+ * never advanced a bucket's tail, and growth freed the map it was
+ * called on and handed the new one to nobody. It now grows in place.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_BUCKETS 64
+#define BUCKET_LIMIT 8
+
+struct old_entry {
+	char *key;
+	void *data;
+	struct old_entry *next_entry;
+};
+
+struct old_bucket {
+	int num_entries;
+	struct old_entry *head;
+	struct old_entry *tail;
+};
+
+struct old_map {
+	int num_buckets;
+	struct old_bucket *buckets;
+};
+
+static unsigned long djb2_hash(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash;
+}
+
+static struct old_map *old_initialize_map()
+{
+	struct old_map *map;
+
+	if((map = malloc(sizeof(struct old_map))) == NULL)
+		return NULL;
+	if((map->buckets = calloc(DEFAULT_BUCKETS, sizeof(struct old_bucket))) == NULL) {
+		free(map);
+		return NULL;
+	}
+	map->num_buckets = DEFAULT_BUCKETS;
+	return map;
+}
+
+static void append_entry(struct old_bucket *bucket, struct old_entry *entry)
+{
+	entry->next_entry = NULL;
+	if(bucket->num_entries == 0)
+		bucket->head = entry;
+	else
+		bucket->tail->next_entry = entry;
+	bucket->tail = entry;
+	bucket->num_entries++;
+}
+
+// Everything moves to a bucket array twice the size, all in one call
+static void old_realloc_map(struct old_map *map)
+{
+	struct old_bucket *buckets;
+	struct old_entry *entry, *next;
+	int idx, new_count = map->num_buckets * 2;
+
+	if((buckets = calloc(new_count, sizeof(struct old_bucket))) == NULL)
+		return;
+	for(idx = 0; idx < map->num_buckets; ++idx) {
+		for(entry = map->buckets[idx].head; entry != NULL; entry = next) {
+			next = entry->next_entry;
+			append_entry(&buckets[djb2_hash(entry->key) % new_count], entry);
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->num_buckets = new_count;
+}
+
+static int old_map_put(struct old_map *map, const char *key, void *data)
+{
+	struct old_bucket *bucket;
+	struct old_entry *entry;
+
+	if((entry = malloc(sizeof(struct old_entry))) == NULL)
+		return -1;
+	if((entry->key = strdup(key)) == NULL) {
+		free(entry);
+		return -1;
+	}
+	entry->data = data;
+
+	bucket = &map->buckets[djb2_hash(key) % map->num_buckets];
+	append_entry(bucket, entry);
+	if(bucket->num_entries > BUCKET_LIMIT)
+		old_realloc_map(map);
+	return 0;
+}
+
+static void *old_map_get(struct old_map *map, const char *key)
+{
+	struct old_entry *entry;
+
+	entry = map->buckets[djb2_hash(key) % map->num_buckets].head;
+	while(entry != NULL && strcmp(key, entry->key) != 0)
+		entry = entry->next_entry;
+	return entry ? entry->data : NULL;
+}
+
+static void *old_map_remove(struct old_map *map, const char *key)
+{
+	struct old_bucket *bucket;
+	struct old_entry *entry, *prev = NULL;
+	void *data;
+
+	bucket = &map->buckets[djb2_hash(key) % map->num_buckets];
+	for(entry = bucket->head; entry != NULL && strcmp(key, entry->key) != 0; entry = entry->next_entry)
+		prev = entry;
+	if(entry == NULL)
+		return NULL;
+
+	if(prev == NULL)
+		bucket->head = entry->next_entry;
+	else
+		prev->next_entry = entry->next_entry;
+	if(bucket->tail == entry)
+		bucket->tail = prev;
+	bucket->num_entries--;
+
+	data = entry->data;
+	free(entry->key);
+	free(entry);
+	return data;
+}
@@ -0,0 +1,58 @@
+/* Parser microbenchmark: smoke.c's parse_msg over a mix of frame bodies
+ * as they sit in a receive buffer, without calling the handlers. Also
+ * reports how much the heap grew across the run, which should be
+ * nothing since every field is a view into the frame.
+ *
+ * Usage: parse [-n iterations]
+ */
+#include <malloc.h>
+#include "../test/harness.h"
+
+// parse_msg and the dispatch table are private to smoke.c
+#define main smoke_main
+#include "../smoke.c"
+#undef main
+
+int main(int argc, char *argv[])
+{
+	char msgs[4][512], payload[64];
+	size_t lens[4];
+	struct msg_view mv;
+	struct mallinfo2 before, after;
+	long iterations = 10000000, idx;
+	double start, secs;
+	size_t total = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:")) != -1) {
+		switch(opt) {
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(payload, 'x', sizeof(payload));
+	lens[0] = build_msg(msgs[0], JOINGROUP, "payments.eu", "10.1.2.3:8080", 13);
+	lens[1] = build_msg(msgs[1], HEALTHCHECK, "payments.eu", "10.1.2.3:8080", 13);
+	lens[2] = build_msg(msgs[2], BROADCAST, "payments.eu", payload, sizeof(payload));
+	lens[3] = build_msg(msgs[3], SUBGROUP, "payments.eu", NULL, 0);
+
+	before = mallinfo2();
+	start = now_sec();
+	for(idx = 0; idx < iterations; ++idx) {
+		CHECK(parse_msg(msgs[idx & 3], lens[idx & 3], &mv) == 0);
+		// Keep the compiler from dropping the views
+		total += mv.group_len + mv.body_len;
+	}
+	secs = now_sec() - start;
+	after = mallinfo2();
+
+	printf("%ld messages in %.3fs: %.1f ns/msg, %.0f msgs/s, heap grew %zu bytes (%zu)\n",
+		iterations, secs, secs * 1e9 / iterations, iterations / secs,
+		after.uordblks - before.uordblks, total);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* Broadcasts against wildcard subscriptions, through the group_manager
+ * API: for each thread count, every thread broadcasts to a group of its
+ * own with no subscribers by name, first with no patterns subscribed at
+ * all, then with 100k patterns none of which match, then with a few that
+ * do on top. Without patterns a broadcast does not touch pattern_lock;
+ * with them the cost should follow the depth of the group name, not the
+ * number of patterns. Subscribing and dropping the patterns is timed too.
+ * Subscribers are fake fds with no connection, so nothing is sent.
+ *
+ * Usage: patterns [-s seconds per run] [-n patterns]
+ */
+#include <stdatomic.h>
+#include "../test/harness.h"
+#include "group_manager.h"
+
+#define FIRST_FD 100000
+#define MATCHING 16
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+
+static atomic_int running;
+static atomic_long broadcasts;
+
+static void *worker(void *arg)
+{
+	char name[32], msg[64];
+	long n = 0;
+
+	snprintf(name, sizeof(name), "bench.%d", (int)(uintptr_t)arg);
+	memset(msg, 'x', sizeof(msg));
+	while(atomic_load_explicit(&running, memory_order_relaxed)) {
+		broadcast_group_n(name, strlen(name), msg, sizeof(msg));
+		n++;
+	}
+	atomic_fetch_add(&broadcasts, n);
+	return NULL;
+}
+
+static void run(const char *what, int threads, double seconds)
+{
+	pthread_t tids[threads];
+	double start, secs;
+	int idx;
+
+	atomic_store(&running, 1);
+	atomic_store(&broadcasts, 0);
+	start = now_sec();
+	for(idx = 0; idx < threads; ++idx)
+		CHECK(pthread_create(&tids[idx], NULL, worker, (void *)(uintptr_t)idx) == 0);
+	usleep(seconds * 1e6);
+	atomic_store(&running, 0);
+	for(idx = 0; idx < threads; ++idx)
+		pthread_join(tids[idx], NULL);
+	secs = now_sec() - start;
+
+	printf("%-28s %2d threads: %10.0f broadcasts/s\n", what, threads, atomic_load(&broadcasts) / secs);
+}
+
+static void run_all(const char *what, double seconds)
+{
+	int t;
+
+	for(t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); ++t)
+		run(what, thread_counts[t], seconds);
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32], what[64], addr[] = "10.0.0.1:8000";
+	double seconds = 1, start;
+	int opt, idx, patterns = 100000;
+
+	while((opt = getopt(argc, argv, "s:n:")) != -1) {
+		switch(opt) {
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'n':
+			patterns = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds per run] [-n patterns]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	set_group_dir(test_group_dir());
+	CHECK(initialize_group_manager() == 0);
+	for(idx = 0; idx < thread_counts[sizeof(thread_counts) / sizeof(thread_counts[0]) - 1]; ++idx) {
+		snprintf(name, sizeof(name), "bench.%d", idx);
+		CHECK(join_group(name, addr) == 0);
+	}
+	commit_group_changes();
+
+	run_all("no patterns", seconds);
+
+	start = now_sec();
+	for(idx = 0; idx < patterns; ++idx) {
+		snprintf(name, sizeof(name), "svc.%d.*", idx);
+		CHECK(sub_group(name, FIRST_FD + idx) == 0);
+	}
+	printf("subscribed %d patterns in %.1f ms\n", patterns, (now_sec() - start) * 1e3);
+	snprintf(what, sizeof(what), "%d patterns, none match", patterns);
+	run_all(what, seconds);
+
+	for(idx = 0; idx < MATCHING; ++idx)
+		CHECK(sub_group(idx % 2 ? "bench.*" : "#", FIRST_FD + patterns + idx) == 0);
+	snprintf(what, sizeof(what), "%d patterns, %d match", patterns + MATCHING, MATCHING);
+	run_all(what, seconds);
+
+	start = now_sec();
+	for(idx = 0; idx < patterns + MATCHING; ++idx)
+		unsub_all_groups(FIRST_FD + idx);
+	printf("dropped them in %.1f ms\n", (now_sec() - start) * 1e3);
+	run_all("patterns all dropped", seconds);
+	return 0;
+}
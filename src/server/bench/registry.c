@@ -0,0 +1,120 @@
+/* Group lookups against group creation and deletion, through the
+ * group_manager API: for each thread count and share of writes, every
+ * thread picks a random group and either looks it up (group_exists_n and
+ * a HEALTHCHECK, which only take the group's read lock) or deletes and
+ * recreates it. Lookups go through the registry without locks, so their
+ * rate should scale with threads and hold up as writes are mixed in.
+ *
+ * Usage: registry [-s seconds per run] [-g groups]
+ */
+#include <stdatomic.h>
+#include "../test/harness.h"
+#include "group_manager.h"
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+static const int write_pcts[] = { 0, 1, 10, 50 };
+
+static int groups = 1024;
+static int write_pct;
+static atomic_int running;
+static atomic_long reads, writes;
+
+static void group_name(char *buf, unsigned int idx)
+{
+	sprintf(buf, "bench.%u", idx % groups);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	char name[32], addr[] = "10.0.0.1:8000";
+	long r = 0, w = 0;
+
+	while(atomic_load_explicit(&running, memory_order_relaxed)) {
+		group_name(name, rand_r(&seed));
+		if((int)(rand_r(&seed) % 100) < write_pct) {
+			delete_group(name);
+			join_group(name, addr);
+			w++;
+		} else {
+			group_exists_n(name, strlen(name));
+			healthcheck_group_n(name, strlen(name), addr, strlen(addr));
+			r++;
+		}
+	}
+	atomic_fetch_add(&reads, r);
+	atomic_fetch_add(&writes, w);
+	return NULL;
+}
+
+// Writes are journaled; commit them as a reactor would
+static void *committer(void *arg)
+{
+	struct timespec pause = { 0, 1000000 };
+
+	while(atomic_load(&running)) {
+		commit_group_changes();
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+static void run(int threads, double seconds)
+{
+	pthread_t tids[threads], commit_tid;
+	double start, secs;
+	int idx;
+
+	atomic_store(&running, 1);
+	atomic_store(&reads, 0);
+	atomic_store(&writes, 0);
+	CHECK(pthread_create(&commit_tid, NULL, committer, NULL) == 0);
+	start = now_sec();
+	for(idx = 0; idx < threads; ++idx)
+		CHECK(pthread_create(&tids[idx], NULL, worker, (void *)(uintptr_t)(idx + 1)) == 0);
+	usleep(seconds * 1e6);
+	atomic_store(&running, 0);
+	for(idx = 0; idx < threads; ++idx)
+		pthread_join(tids[idx], NULL);
+	secs = now_sec() - start;
+	pthread_join(commit_tid, NULL);
+
+	printf("%2d threads %3d%% writes: %10.0f lookups/s %9.0f writes/s\n", threads, write_pct,
+		atomic_load(&reads) / secs, atomic_load(&writes) / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32], addr[] = "10.0.0.1:8000";
+	double seconds = 1;
+	int opt, t, w, idx;
+
+	while((opt = getopt(argc, argv, "s:g:")) != -1) {
+		switch(opt) {
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'g':
+			groups = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds per run] [-g groups]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	set_group_dir(test_group_dir());
+	CHECK(initialize_group_manager() == 0);
+	for(idx = 0; idx < groups; ++idx) {
+		group_name(name, idx);
+		CHECK(join_group(name, addr) == 0);
+	}
+	commit_group_changes();
+
+	for(w = 0; w < (int)(sizeof(write_pcts) / sizeof(write_pcts[0])); ++w) {
+		write_pct = write_pcts[w];
+		for(t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); ++t)
+			run(thread_counts[t], seconds);
+	}
+	return 0;
+}
@@ -0,0 +1,118 @@
+/* Startup time against the number of groups: ./smoke is filled with
+ * groups of a few members each, killed like a crash and timed from
+ * fork until it accepts a connection, which it only does once the
+ * snapshot is mapped and the journal replayed. Groups are added in
+ * steps (1k, 10k, 100k, ...) on the same directory, so each step restarts
+ * over everything before it. Members are only indexed on first use, so
+ * the time for a LISTMEMBERS on every group after the restart is shown
+ * too.
+ *
+ * Usage: startup [-n max groups] [-m members per group] [-p port]
+ */
+#include <sys/stat.h>
+#include "../test/harness.h"
+
+#define RESTARTS 3
+
+static const char *port = "51671";
+
+static double file_mb(const char *name)
+{
+	char path[256];
+	struct stat statb;
+
+	snprintf(path, sizeof(path), "%s/%s", test_group_dir(), name);
+	return stat(path, &statb) == 0 ? statb.st_size / 1e6 : 0;
+}
+
+/* Pipelined joins for groups [from, to). Joins are committed after the
+ * reactor iteration that handled them, so wait for two round trips: the
+ * second request is only read once the first one's iteration is over.
+ */
+static void add_groups(long from, long to, int members)
+{
+	char name[32], addr[32], reply[65536];
+	long idx;
+	int fd, m, len, trip;
+
+	fd = connect_to(port);
+	for(idx = from; idx < to; ++idx) {
+		snprintf(name, sizeof(name), "group.%ld", idx);
+		for(m = 0; m < members; ++m) {
+			len = snprintf(addr, sizeof(addr), "10.%ld.%ld.%d:%d",
+				idx >> 16 & 0xff, idx >> 8 & 0xff, (int)(idx & 0xff), 1000 + m);
+			send_msg(fd, JOINGROUP, name, addr, len);
+		}
+	}
+	for(trip = 0; trip < 2; ++trip) {
+		send_msg(fd, LISTMEMBERS, name, NULL, 0);
+		CHECK(read_frame(fd, reply, sizeof(reply), 60000) > 0);
+	}
+	close(fd);
+}
+
+// LISTMEMBERS on every group, a window of requests in flight
+static double touch_groups(long groups)
+{
+	char name[32], reply[65536];
+	double start = now_sec();
+	long sent = 0, received = 0;
+	int fd;
+
+	fd = connect_to(port);
+	while(received < groups) {
+		for(; sent < groups && sent - received < 256; ++sent) {
+			snprintf(name, sizeof(name), "group.%ld", sent);
+			send_msg(fd, LISTMEMBERS, name, NULL, 0);
+		}
+		CHECK(read_frame(fd, reply, sizeof(reply), 60000) > 0);
+		received++;
+	}
+	close(fd);
+	return now_sec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	long max_groups = 100000, groups = 0, step;
+	double start, secs, best, touch;
+	int opt, members = 4, run;
+
+	while((opt = getopt(argc, argv, "n:m:p:")) != -1) {
+		switch(opt) {
+		case 'n':
+			max_groups = atol(optarg);
+			break;
+		case 'm':
+			members = atoi(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n max groups] [-m members per group] [-p port]\n", argv[0]);
+			return 1;
+		}
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	spawn_smoke(port, NULL);
+	for(step = 1000; step <= max_groups; step *= 10) {
+		add_groups(groups, step, members);
+		groups = step;
+
+		best = 1e9;
+		for(run = 0; run < RESTARTS; ++run) {
+			kill_smoke();
+			start = now_sec();
+			spawn_smoke(port, NULL);
+			if((secs = now_sec() - start) < best)
+				best = secs;
+		}
+		touch = touch_groups(groups);
+		printf("%8ld groups: startup %8.1f ms, first LISTMEMBERS of all %8.1f ms"
+			" (snapshot %.1f MB, journal %.1f MB)\n", groups, best * 1e3, touch * 1e3,
+			file_mb("snapshot"), file_mb("journal"));
+	}
+	return 0;
+}
@@ -0,0 +1,124 @@
+/* Epoch based reclamation, see epoch.h.
+ *
+ * There is one global epoch. A thread entering a read section publishes
+ * the epoch it saw in its slot, and clears the slot on the way out. The
+ * global epoch only moves on once every active slot has caught up with
+ * it, so anything retired in epoch e is unreachable by everyone once the
+ * global epoch reaches e + 2.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "epoch.h"
+
+#define EPOCH_MAX_THREADS 256 // Threads that ever enter a read section
+#define CACHE_LINE 64
+
+// 0 means not in a read section; epochs start at 1
+struct epoch_slot {
+	atomic_uint_fast64_t epoch;
+	char pad[CACHE_LINE - sizeof(atomic_uint_fast64_t)];
+};
+
+struct retired {
+	void *ptr;
+	void (*free_fn)(void *);
+	uint64_t epoch;
+	struct retired *next;
+};
+
+static atomic_uint_fast64_t global_epoch = 1;
+static struct epoch_slot slots[EPOCH_MAX_THREADS];
+static atomic_int num_slots = 0;
+
+static _Thread_local int my_slot = -1;
+static _Thread_local int nesting = 0;
+
+// Retired objects, oldest last. Only writers touch this.
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *limbo = NULL;
+
+void epoch_enter()
+{
+	if(nesting++)
+		return;
+
+	if(my_slot == -1) {
+		if((my_slot = atomic_fetch_add(&num_slots, 1)) >= EPOCH_MAX_THREADS) {
+			fprintf(stderr, "epoch: more than %d threads\n", EPOCH_MAX_THREADS);
+			abort();
+		}
+	}
+
+	atomic_store_explicit(&slots[my_slot].epoch,
+		atomic_load_explicit(&global_epoch, memory_order_relaxed), memory_order_relaxed);
+	// Publish the slot before reading anything it protects
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit()
+{
+	if(--nesting)
+		return;
+	atomic_store_explicit(&slots[my_slot].epoch, 0, memory_order_release);
+}
+
+/* Move the global epoch on if every active reader has seen it. Called
+ * with limbo_lock held.
+ */
+static uint64_t try_advance()
+{
+	uint64_t global, seen;
+	int idx, count;
+
+	// Order the caller's unlink before the scan of reader slots
+	atomic_thread_fence(memory_order_seq_cst);
+	global = atomic_load(&global_epoch);
+	count = atomic_load(&num_slots);
+
+	if(count > EPOCH_MAX_THREADS)
+		count = EPOCH_MAX_THREADS;
+	for(idx = 0; idx < count; ++idx) {
+		seen = atomic_load(&slots[idx].epoch);
+		if(seen != 0 && seen != global)
+			return global;
+	}
+	atomic_store(&global_epoch, global + 1);
+	return global + 1;
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+	struct retired *r, **link, *reclaim;
+	uint64_t global;
+
+	if((r = malloc(sizeof(struct retired))) == NULL) {
+		// Nowhere to park it, so leak it rather than free it early
+		return;
+	}
+	r->ptr = ptr;
+	r->free_fn = free_fn;
+
+	pthread_mutex_lock(&limbo_lock);
+	r->epoch = atomic_load(&global_epoch);
+	r->next = limbo;
+	limbo = r;
+
+	// The list is ordered newest first, so everything old enough is a
+	// suffix
+	global = try_advance();
+	for(link = &limbo; *link && (*link)->epoch + 2 > global; link = &(*link)->next)
+		;
+	reclaim = *link;
+	*link = NULL;
+	pthread_mutex_unlock(&limbo_lock);
+
+	while(reclaim) {
+		r = reclaim;
+		reclaim = r->next;
+		r->free_fn(r->ptr);
+		free(r);
+	}
+}
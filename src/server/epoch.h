@@ -0,0 +1,15 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+/* Epoch based reclamation for structures that are read without locks.
+ *
+ * Readers bracket every access with epoch_enter()/epoch_exit() (they
+ * nest). A writer that unlinks an object hands it to epoch_retire()
+ * instead of freeing it; the free function runs once every thread that
+ * was inside a read section at the time has left it.
+ */
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+#endif /* _EPOCH_H */
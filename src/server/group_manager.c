@@ -1,39 +1,193 @@
+#define _GNU_SOURCE // memrchr
 #include <stdlib.h>
+#include <endian.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include <dirent.h>
 #include <time.h>
 #include <string.h>
 #include <utime.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
 #include "group_manager.h"
 #include "hashmap.h"
+#include "registry.h"
+#include "epoch.h"
+#include "journal.h"
+#include "timer_wheel.h"
+#include "topic_trie.h"
+#include "msgproto.h"
+#include "networking.h"
 
 #define RESET_TIME 300 //5 minutes
 #define DEFAULT_MAX_LISTENERS 128
-#define MAX_IP4_STRING_SIZE 21 // xxx.xxx.xxx.xxx:ppppp -> 21 characters, we only support IPv4 atm
+#define DEFAULT_SUBS_TABLE_SIZE 1024
+#define DEFAULT_MAX_SUBS 4
+#define MAX_IP4_STRING_SIZE 21 // xxx.xxx.xxx.xxx:ppppp -> 21 characters
+#define MAX_MEMBER_STRING_SIZE 54 // [v6 address]:ppppp, -> 45 + 9 characters
+#define MAX_VIEW_SIZE 256 // Group names off the wire
+
+#define DEFAULT_MEMBER_CAPACITY 64 // Always a multiple of 64, see bitmap
+#define DEFAULT_RETAIN_MSGS 1024 // When retention is bounded by bytes alone
+
+#define MEMBER_INET4 4
+#define MEMBER_INET6 6
+
+#define LEGACY_MAGIC 0x474b4d53 // "SMKG", group files from before the journal
+#define LEGACY_VERSION 1
+
+struct member_record {
+	int64_t last_seen;	// updated in place by joins and healthchecks
+	// addr through family doubles as the member's key in the index
+	uint8_t addr[16];	// IPv4 uses the first 4 bytes
+	uint16_t port;		// network order
+	uint8_t family;		// MEMBER_INET4 or MEMBER_INET6
+	uint8_t pad[5];
+};
+
+#define MEMBER_KEY_SIZE (sizeof(((struct member_record *)0)->addr) + sizeof(uint16_t) + 1)
+
+// Heads a legacy group file, see import_legacy_records
+struct legacy_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;	// records the file has room for
+	uint32_t count;		// records in use
+	uint8_t reserved[48];
+};
+
+#define LOAD_SLOT UINT32_MAX
+
+/* A member's entry in the expiry wheel. The wheel links these in place,
+ * so they live in chunks of 64 that never move rather than in records.
+ */
+struct member_timer {
+	struct wheel_entry entry; // first, so an entry is its timer
+	struct group_file *gfile;
+	uint32_t slot; // or LOAD_SLOT for a group's load_timer
+};
 
 struct group_file {
-	int fd;
-	void *mmap_addr;
-	size_t mapped_size;
-	char group_name[256]; /* linux max file name size */
+	// Guards everything in here but the name and the counters. Writers
+	// on one group never wait on another group.
+	pthread_rwlock_t lock;
+	char group_name[256];
 	int num_listeners;
 	int max_listeners;
 	int *listener_fd_array;
+	uint8_t *listener_numbered; /* parallel to it, set for SUBGROUP_FROM */
+	void *listener_slots; /* fd -> index in listener_fd_array + 1 */
+	// The listeners that also get each join and leave pushed to them
+	// (SUBGROUP_WATCH). Few per group, so a plain array.
+	int *watcher_fds;
+	int num_watchers;
+	int max_watchers;
+	// Members live in fixed size record slots, one bitmap bit per slot
+	// set while it is in use. members indexes them by address so
+	// lookups never scan; freed slots are reused off the stack.
+	struct member_record *records;
+	uint64_t *bitmap;
+	uint32_t capacity;
+	uint32_t count;
+	void *members; /* record key -> slot + 1 */
+	uint32_t *free_slots; /* stack of unused record slots */
+	uint32_t num_free;
+	// Set up on first use, see ensure_loaded. Until then a group from
+	// the snapshot only has a pointer to its member keys in the mapping.
+	atomic_int loaded;
+	const char *snap_keys;
+	uint32_t snap_count;
+	// Bumped by every join or leave that changes the member list. The
+	// encoded LISTMEMBERS reply is cached until the generation moves on;
+	// readers share it under the read lock, serialized by cache_lock.
+	uint64_t generation;
+	pthread_mutex_t cache_lock;
+	struct net_buf *members_buf;
+	uint64_t members_buf_gen;
+	// Only with member expiry on: a timer per record slot, one chunk
+	// per 64 slots, and one that loads a group from the snapshot nobody
+	// has touched so its members can lapse as well
+	struct member_timer **timers;
+	struct member_timer load_timer;
+	int deleted; /* unregistered, set under the lock */
+	// Recent broadcasts for SUBGROUP_FROM, when retention is on: a ring
+	// of retain_msgs BROADCAST_SEQ frame refs, the oldest numbered
+	// ring_first_seq. Only numbered listeners are sent those live.
+	// Broadcasts number, retain and send a frame under the read lock and
+	// ring_lock, so every subscriber sees the numbers in order.
+	pthread_mutex_t ring_lock;
+	struct net_buf **ring;
+	uint32_t ring_head;
+	uint32_t ring_count;
+	size_t ring_bytes;
+	uint64_t ring_first_seq;
+	uint64_t last_seq; /* of the latest broadcast, numbered from 1 */
+	// Broadcast overflow accounting, bumped under the read lock
+	atomic_ulong dropped; /* frames discarded by a subscriber's overflow policy */
+	atomic_ulong evicted; /* subscribers disconnected for falling behind */
+};
+
+// Group lookups take no lock (see registry.h); every access to a group
+// happens inside an epoch so a concurrent delete cannot free it early.
+static struct registry *group_map = NULL;
+
+/* The groups a socket is subscribed to, so they can all be dropped when
+ * its connection closes. Names are kept rather than group pointers since
+ * a group may be deleted (and even recreated) while still listed here.
+ */
+struct fd_subs {
+	int count;
+	int max;
+	char **names;
+	void *index; /* name -> index in names + 1 */
 };
 
-static void *group_map = NULL;
-static void *health_map = NULL;
-static char *DEFAULT_DIR = "/tmp/.groups";
+// Indexed by fd. Subscriptions change rarely next to broadcasts, so one
+// lock for the whole table will do.
+static struct fd_subs **subs_table = NULL;
+static int subs_table_size = 0;
+static pthread_mutex_t subs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Members not heard from (joined or healthchecked) for member_timeout
+ * seconds are dropped. Each has an entry in one timing wheel, due at
+ * last_seen + member_timeout. A heartbeat only stamps last_seen; when an
+ * entry comes due for a member seen since, it is put back in for the
+ * new deadline. Lock order is group lock, then wheel_lock.
+ */
+static int member_timeout = 0;
+static struct timer_wheel expiry_wheel;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t start_time;
+
+/* Wildcard subscriptions ("payments.*", see topic_trie.h), matched
+ * against the group name of every broadcast. Like the subs table they
+ * change rarely, so one lock covers them; broadcasts only read. Lock
+ * order is group lock, then pattern_lock. num_patterns mirrors the
+ * trie's size, so broadcasts skip the lock while nobody uses patterns.
+ */
+static struct topic_trie *pattern_subs = NULL;
+static pthread_rwlock_t pattern_lock = PTHREAD_RWLOCK_INITIALIZER;
+static atomic_size_t num_patterns;
+
+// Broadcasts kept per group for replay, 0 messages for none
+static unsigned int retain_msgs = 0;
+static size_t retain_bytes = 0; // 0 for no bound on bytes
+
+// Holds the membership journal and snapshot (see journal.h)
+#define DEFAULT_DIR "/tmp/.groups"
+static const char *group_dir = DEFAULT_DIR;
 static char *TIMESTAMP_FILE = ".lasttime";
 
 /* Local functions */
-static char *build_path(char *p1, char *p2) {
+static char *build_path(const char *p1, const char *p2) {
 	char *new_path;
 
 	// +2 for '/' + null term
@@ -45,134 +199,584 @@ static char *build_path(char *p1, char *p2) {
 	return new_path;
 }
 
-static void realloc_listener_array(struct group_file *gfile) {
+/* Names and addresses arrive as length-delimited views into a receive
+ * buffer and are looked up as they are. Only a group name that is being
+ * created needs to be a C string, so bounce it through a caller-provided
+ * (stack) buffer of MAX_VIEW_SIZE.
+ */
+static int view_to_str(char *dst, const char *src, size_t len)
+{
+	if(len >= MAX_VIEW_SIZE)
+		return -1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	return 0;
+}
+
+static int realloc_listener_array(struct group_file *gfile) {
 	int *new_array;
-	int new_max_listeners = 2 * gfile->max_listeners;
+	uint8_t *new_numbered;
+	int new_max_listeners = gfile->max_listeners ? 2 * gfile->max_listeners : DEFAULT_MAX_LISTENERS;
 
-	new_array = malloc(new_max_listeners * sizeof(int));
-	memcpy(new_array, gfile->listener_fd_array, gfile->num_listeners * sizeof(int));
+	if((new_array = malloc(new_max_listeners * sizeof(int))) == NULL)
+		return -1;
+	if((new_numbered = malloc(new_max_listeners)) == NULL) {
+		free(new_array);
+		return -1;
+	}
+	if(gfile->num_listeners) {
+		memcpy(new_array, gfile->listener_fd_array, gfile->num_listeners * sizeof(int));
+		memcpy(new_numbered, gfile->listener_numbered, gfile->num_listeners);
+	}
 
 	free(gfile->listener_fd_array);
+	free(gfile->listener_numbered);
 	gfile->listener_fd_array = new_array;
+	gfile->listener_numbered = new_numbered;
 	gfile->max_listeners = new_max_listeners; 
+	return 0;
+}
+
+/* Note that sockfd is subscribed to name. Called with the lock of the
+ * group (or pattern_lock, for a pattern) held.
+ */
+static int record_sub(int sockfd, const char *name, size_t name_len)
+{
+	struct fd_subs *subs, **new_table;
+	char **new_names, *copy;
+	int new_size, ret = -1;
+
+	pthread_mutex_lock(&subs_lock);
+	if(sockfd >= subs_table_size) {
+		new_size = subs_table_size ? subs_table_size : DEFAULT_SUBS_TABLE_SIZE;
+		while(new_size <= sockfd)
+			new_size *= 2;
+		if((new_table = realloc(subs_table, new_size * sizeof(struct fd_subs *))) == NULL)
+			goto out;
+		memset(new_table + subs_table_size, 0, (new_size - subs_table_size) * sizeof(struct fd_subs *));
+		subs_table = new_table;
+		subs_table_size = new_size;
+	}
+	if((subs = subs_table[sockfd]) == NULL) {
+		if((subs = calloc(1, sizeof(struct fd_subs))) == NULL)
+			goto out;
+		if((subs->index = initialize_map()) == NULL) {
+			free(subs);
+			goto out;
+		}
+		subs_table[sockfd] = subs;
+	}
+
+	if(map_get_n(subs->index, name, name_len) != NULL) {
+		ret = 0;
+		goto out;
+	}
+	if(subs->count == subs->max) {
+		new_size = subs->max ? 2 * subs->max : DEFAULT_MAX_SUBS;
+		if((new_names = realloc(subs->names, new_size * sizeof(char *))) == NULL)
+			goto out;
+		subs->names = new_names;
+		subs->max = new_size;
+	}
+	if((copy = malloc(name_len + 1)) == NULL)
+		goto out;
+	memcpy(copy, name, name_len);
+	copy[name_len] = '\0';
+	if(map_put_n(subs->index, copy, name_len, (void *)(uintptr_t)(subs->count + 1)) == -1) {
+		free(copy);
+		goto out;
+	}
+	subs->names[subs->count++] = copy;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&subs_lock);
+	return ret;
 }
 
-static void extend_mapped_file(struct group_file *gfile)
+/* Undo record_sub, swapping the last name into the hole */
+static void forget_sub(int sockfd, const char *name, size_t name_len)
 {
-	size_t new_size = gfile->mapped_size * 2;
-	// We know gfile->mapped_size is a page multiple.
-	// So we're just going to double it.
-	ftruncate(gfile->fd, new_size);
-	munmap(gfile->mmap_addr, gfile->mapped_size);
-	gfile->mmap_addr = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, gfile->fd, 0);
-	gfile->mapped_size = new_size;
+	struct fd_subs *subs;
+	uintptr_t idx;
+	void *found;
+
+	pthread_mutex_lock(&subs_lock);
+	if(sockfd >= 0 && sockfd < subs_table_size && (subs = subs_table[sockfd]) != NULL &&
+	   (found = map_remove_n(subs->index, name, name_len)) != NULL) {
+		idx = (uintptr_t)found - 1;
+		free(subs->names[idx]);
+		if(idx != (uintptr_t)--subs->count) {
+			subs->names[idx] = subs->names[subs->count];
+			map_put_n(subs->index, subs->names[idx], strlen(subs->names[idx]),
+				(void *)(idx + 1));
+		}
+	}
+	pthread_mutex_unlock(&subs_lock);
 }
-	
-static struct group_file *create_or_open_group_file(char *file_path)
+
+/* Parse "a.b.c.d:port" or "[v6]:port" into the address fields of rec.
+ * Only literal addresses fit a record.
+ */
+static int parse_member(const char *text, size_t len, struct member_record *rec)
 {
-	struct stat statb;
-	struct group_file *gfile;
-	char *file_name, *memptr;
+	char host[INET6_ADDRSTRLEN];
+	const char *colon, *digit;
+	size_t host_len;
+	unsigned long port = 0;
 
-	if(stat(file_path, &statb) == -1) {
-		if(errno == ENOENT) {
-			// TODO: Fix this to not open fd, close fd, and reopen fd
-			// that's just silly.
-			int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-			ftruncate(fd, getpagesize());
-			close(fd);
-			stat(file_path, &statb);
-		}else {
-			return NULL;
+	if((colon = memrchr(text, ':', len)) == NULL || colon == text + len - 1)
+		return -1;
+	for(digit = colon + 1; digit < text + len; ++digit) {
+		if(*digit < '0' || *digit > '9' || (port = port * 10 + (*digit - '0')) > 65535)
+			return -1;
+	}
+	if(port == 0)
+		return -1;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->port = htons(port);
+	host_len = colon - text;
+	if(host_len >= 2 && text[0] == '[' && text[host_len - 1] == ']') {
+		rec->family = MEMBER_INET6;
+		text++;
+		host_len -= 2;
+	} else {
+		rec->family = MEMBER_INET4;
+	}
+	if(host_len == 0 || host_len >= sizeof(host))
+		return -1;
+	memcpy(host, text, host_len);
+	host[host_len] = '\0';
+	return inet_pton(rec->family == MEMBER_INET6 ? AF_INET6 : AF_INET, host, rec->addr) == 1 ? 0 : -1;
+}
+
+/* The text form LISTMEMBERS hands out, "ip:port," per member */
+static size_t format_member(const struct member_record *rec, char *out)
+{
+	char host[INET6_ADDRSTRLEN];
+
+	if(rec->family == MEMBER_INET6) {
+		inet_ntop(AF_INET6, rec->addr, host, sizeof(host));
+		return sprintf(out, "[%s]:%u,", host, ntohs(rec->port));
+	}
+	inet_ntop(AF_INET, rec->addr, host, sizeof(host));
+	return sprintf(out, "%s:%u,", host, ntohs(rec->port));
+}
+
+/* Render every member into out, which must hold count *
+ * MAX_MEMBER_STRING_SIZE bytes. Returns the length (no terminator).
+ */
+static size_t render_members(struct group_file *gfile, char *out)
+{
+	uint32_t idx, words = gfile->capacity / 64;
+	uint64_t word;
+	size_t len = 0;
+
+	for(idx = 0; idx < words; ++idx) {
+		for(word = gfile->bitmap[idx]; word; word &= word - 1)
+			len += format_member(&gfile->records[idx * 64 + __builtin_ctzll(word)], out + len);
+	}
+	return len;
+}
+
+/* Push slots [from, to) onto the free stack, lowest on top */
+static void push_free_slots(struct group_file *gfile, uint32_t from, uint32_t to)
+{
+	while(to-- > from)
+		gfile->free_slots[gfile->num_free++] = to;
+}
+
+#define MEMBER_TIMER(gfile, slot) (&(gfile)->timers[(slot) / 64][(slot) % 64])
+
+static void arm_timer(struct member_timer *timer, int64_t deadline)
+{
+	pthread_mutex_lock(&wheel_lock);
+	wheel_del(&timer->entry);
+	wheel_add(&expiry_wheel, &timer->entry, deadline);
+	pthread_mutex_unlock(&wheel_lock);
+}
+
+static void disarm_timer(struct member_timer *timer)
+{
+	pthread_mutex_lock(&wheel_lock);
+	wheel_del(&timer->entry);
+	pthread_mutex_unlock(&wheel_lock);
+}
+
+/* Add timer chunks for the slots [old_capacity, new_capacity) */
+static int grow_timers(struct group_file *gfile, uint32_t old_capacity, uint32_t new_capacity)
+{
+	struct member_timer **timers;
+	uint32_t chunk, idx;
+
+	if((timers = realloc(gfile->timers, new_capacity / 64 * sizeof(struct member_timer *))) == NULL)
+		return -1;
+	gfile->timers = timers;
+	for(chunk = old_capacity / 64; chunk < new_capacity / 64; ++chunk) {
+		if((timers[chunk] = calloc(64, sizeof(struct member_timer))) == NULL) {
+			while(chunk-- > old_capacity / 64)
+				free(timers[chunk]);
+			return -1;
+		}
+		for(idx = 0; idx < 64; ++idx) {
+			timers[chunk][idx].gfile = gfile;
+			timers[chunk][idx].slot = chunk * 64 + idx;
 		}
 	}
+	return 0;
+}
+
+/* Double the record capacity (or allocate the first slots) */
+static int grow_members(struct group_file *gfile)
+{
+	uint32_t old_capacity = gfile->capacity;
+	uint32_t new_capacity = old_capacity ? old_capacity * 2 : DEFAULT_MEMBER_CAPACITY;
+	struct member_record *records;
+	uint32_t *free_slots;
+	uint64_t *bitmap;
+
+	if((records = realloc(gfile->records, new_capacity * sizeof(struct member_record))) == NULL)
+		return -1;
+	gfile->records = records;
+	if((bitmap = realloc(gfile->bitmap, new_capacity / 8)) == NULL)
+		return -1;
+	gfile->bitmap = bitmap;
+	if((free_slots = realloc(gfile->free_slots, new_capacity * sizeof(uint32_t))) == NULL)
+		return -1;
+	gfile->free_slots = free_slots;
+	if(member_timeout && grow_timers(gfile, old_capacity, new_capacity) == -1)
+		return -1;
+
+	memset(bitmap + old_capacity / 64, 0, (new_capacity - old_capacity) / 8);
+	gfile->capacity = new_capacity;
+	push_free_slots(gfile, old_capacity, new_capacity);
+	return 0;
+}
+
+/* Claim a free slot for rec and index it */
+static int add_member(struct group_file *gfile, const struct member_record *rec)
+{
+	uint32_t slot;
+
+	if(gfile->num_free == 0 && grow_members(gfile) == -1)
+		return -1;
+	slot = gfile->free_slots[gfile->num_free - 1];
+	if(map_put_n(gfile->members, (const char *)rec->addr, MEMBER_KEY_SIZE,
+			(void *)(uintptr_t)(slot + 1)) == -1)
+		return -1;
+	gfile->num_free--;
+
+	gfile->records[slot] = *rec;
+	gfile->bitmap[slot / 64] |= 1ULL << (slot % 64);
+	gfile->count++;
+	gfile->generation++;
+	if(member_timeout && !gfile->deleted)
+		arm_timer(MEMBER_TIMER(gfile, slot), rec->last_seen + member_timeout);
+	return 0;
+}
+
+/* Release the slot of a member already dropped from the index */
+static void remove_member(struct group_file *gfile, uint32_t slot)
+{
+	if(member_timeout)
+		disarm_timer(MEMBER_TIMER(gfile, slot));
+	gfile->bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+	memset(&gfile->records[slot], 0, sizeof(struct member_record));
+	gfile->count--;
+	gfile->free_slots[gfile->num_free++] = slot;
+	gfile->generation++;
+}
+
+/* Queue a change to a group for the journal. Everything that changes
+ * the persisted state goes through here with the lock that guards the
+ * change still held, so the journal sees changes in the order they
+ * were made.
+ */
+static void log_change(uint8_t op, const char *name, const void *data, size_t data_len)
+{
+	struct journal_event ev;
+
+	ev.op = op;
+	ev.name_len = strlen(name);
+	ev.data_len = data_len;
+	ev.name = name;
+	ev.data = data;
+	if(journal_append(&ev) == -1)
+		fprintf(stderr, "Could not journal a change to group %s\n", name);
+}
+
+/* Tears down a group no other thread can reach. Deleted groups go
+ * through retire_group_file instead.
+ */
+static void free_group_file(void *arg)
+{
+	struct group_file *gfile = arg;
+	uint32_t chunk;
+
+	free(gfile->listener_fd_array);
+	free(gfile->listener_numbered);
+	free(gfile->watcher_fds);
+	if(gfile->listener_slots)
+		map_destroy(gfile->listener_slots, NULL);
+	if(gfile->snap_keys)
+		journal_snapshot_put();
+	free(gfile->records);
+	free(gfile->bitmap);
+	free(gfile->free_slots);
+	if(gfile->timers) {
+		for(chunk = 0; chunk < gfile->capacity / 64; ++chunk)
+			free(gfile->timers[chunk]);
+		free(gfile->timers);
+	}
+	if(gfile->members)
+		map_destroy(gfile->members, NULL);
+	if(gfile->members_buf)
+		net_buf_put(gfile->members_buf);
+	for(; gfile->ring_count; gfile->ring_count--) {
+		net_buf_put(gfile->ring[gfile->ring_head]);
+		gfile->ring_head = (gfile->ring_head + 1) % retain_msgs;
+	}
+	free(gfile->ring);
+	free(gfile);
+}
+
+/* Runs once no reader can still hold gfile (see epoch.h) */
+static void retire_group_file(void *arg)
+{
+	struct group_file *gfile = arg;
+
+	pthread_rwlock_destroy(&gfile->lock);
+	pthread_mutex_destroy(&gfile->cache_lock);
+	pthread_mutex_destroy(&gfile->ring_lock);
+	free_group_file(gfile);
+}
+
+static struct group_file *new_group_file(char *name)
+{
+	struct group_file *gfile;
 
-	// Locate the last '/' and copy the file name
-	file_name = strrchr(file_path, '/') + 1;	
-	
-	// Open the file, mmap it and set up struct
-	gfile = malloc(sizeof(struct group_file));
-	gfile->fd = open(file_path, O_RDWR);
-	gfile->mmap_addr = mmap(NULL, statb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, gfile->fd, 0);
-	gfile->mapped_size = statb.st_size;
-	strcpy(gfile->group_name, file_name);
+	if((gfile = calloc(1, sizeof(struct group_file))) == NULL)
+		return NULL;
+	strcpy(gfile->group_name, name);
 	// Unfortunately we can't reconstruct listeners
-	// so we'll have to just deal with that
+	// so we'll have to just deal with that. Like the member slots and
+	// index, they are only allocated once the group is used, which
+	// keeps a restart with many groups cheap.
 	gfile->num_listeners = 0;
-	gfile->max_listeners = DEFAULT_MAX_LISTENERS;
-	gfile->listener_fd_array = malloc(sizeof(int) * DEFAULT_MAX_LISTENERS);
+	gfile->max_listeners = 0;
+	atomic_init(&gfile->dropped, 0);
+	atomic_init(&gfile->evicted, 0);
+	atomic_init(&gfile->loaded, 0);
+	gfile->load_timer.gfile = gfile;
+	gfile->load_timer.slot = LOAD_SLOT;
+	pthread_rwlock_init(&gfile->lock, NULL);
+	pthread_mutex_init(&gfile->cache_lock, NULL);
+	pthread_mutex_init(&gfile->ring_lock, NULL);
 
 	return gfile;
 }
 
-static int open_existing_groups(DIR *dir)
+/* Set up the member index of a group, indexing whatever members it
+ * still has in the snapshot. Called before taking the group's lock by
+ * anything that needs its members; everything else (a restart that
+ * registers every group, a broadcast) never pays for it.
+ */
+static int ensure_loaded(struct group_file *gfile)
+{
+	struct member_record rec;
+	uint32_t idx;
+	int ret = 0;
+
+	if(atomic_load_explicit(&gfile->loaded, memory_order_acquire))
+		return 0;
+
+	pthread_rwlock_wrlock(&gfile->lock);
+	if(atomic_load_explicit(&gfile->loaded, memory_order_relaxed)) {
+		// Someone else got here first
+	} else if((gfile->members = initialize_map()) == NULL) {
+		ret = -1;
+	} else {
+		// Members found on disk were last seen as of startup
+		memset(&rec, 0, sizeof(rec));
+		for(idx = 0; idx < gfile->snap_count; ++idx) {
+			memcpy(rec.addr, gfile->snap_keys + idx * MEMBER_KEY_SIZE, MEMBER_KEY_SIZE);
+			rec.last_seen = start_time;
+			if(map_get_n(gfile->members, (const char *)rec.addr, MEMBER_KEY_SIZE) == NULL)
+				add_member(gfile, &rec);
+		}
+		if(gfile->snap_keys)
+			journal_snapshot_put();
+		gfile->snap_keys = NULL;
+		gfile->snap_count = 0;
+		if(member_timeout)
+			disarm_timer(&gfile->load_timer);
+		atomic_store_explicit(&gfile->loaded, 1, memory_order_release);
+	}
+	pthread_rwlock_unlock(&gfile->lock);
+	return ret;
+}
+
+/* Groups are only kept across a quick restart. If the last start was
+ * more than RESET_TIME ago, throw the old state away and return 1.
+ */
+static int reset_if_stale()
 {
-	struct dirent *entry;
 	struct stat statb;
-	int delete_all = 0;
 	char *time_file_path;
 
-	time_file_path = build_path(DEFAULT_DIR, TIMESTAMP_FILE);
+	time_file_path = build_path(group_dir, TIMESTAMP_FILE);
 	// Check timestamp if we want to delete everything
 	if(stat(time_file_path, &statb) == -1) {
 		perror("time check, stat");
+		free(time_file_path);
 		return -1;
 	}
 	utime(time_file_path, NULL);
 	free(time_file_path);
 
-	if(time(NULL) - statb.st_atime > RESET_TIME)
-		delete_all = 1;
+	if(time(NULL) - statb.st_atime <= RESET_TIME)
+		return 0;
+	journal_discard(group_dir);
+	return 1;
+}
 
-	while((entry = readdir(dir)) != NULL) {
-		char *file_path;
-		int fd;
+/* Join a member to a group being imported, logging one we cannot keep */
+static int import_member(const char *name, const char *member, size_t len, const char *path)
+{
+	if(join_group_n(name, strlen(name), member, len) == -1) {
+		fprintf(stderr, "%s: dropping member %.*s, not a literal address\n", path, (int)len, member);
+		return -1;
+	}
+	return 0;
+}
 
-		if(strcmp(entry->d_name, TIMESTAMP_FILE) == 0)
-			continue;
+/* A group file in the record format, as written before the journal:
+ * a header, a bitmap of the slots in use and then the records.
+ */
+static int import_legacy_records(const char *name, const char *data, size_t size, const char *path)
+{
+	struct legacy_header hdr;
+	struct member_record rec;
+	const uint64_t *bitmap = (const uint64_t *)(data + sizeof(hdr));
+	const char *records;
+	char member[MAX_MEMBER_STRING_SIZE];
+	uint32_t slot;
 
-		file_path = build_path(DEFAULT_DIR, entry->d_name);
-		if(delete_all) {
-			remove(file_path);
-		} else {
-			struct group_file *gfile = create_or_open_group_file(file_path);
-			if(gfile)
-				map_put(group_map, gfile->group_name, (void*)gfile);
-		}
-		free(file_path);
-	}
+	memcpy(&hdr, data, sizeof(hdr));
+	if(hdr.version != LEGACY_VERSION || hdr.record_size != sizeof(struct member_record) ||
+	   hdr.capacity == 0 || hdr.capacity % 64 ||
+	   sizeof(hdr) + hdr.capacity / 8 + (size_t)hdr.capacity * sizeof(rec) > size)
+		return -1;
 
+	records = data + sizeof(hdr) + hdr.capacity / 8;
+	for(slot = 0; slot < hdr.capacity; ++slot) {
+		if(!(bitmap[slot / 64] & (1ULL << (slot % 64))))
+			continue;
+		memcpy(&rec, records + (size_t)slot * sizeof(rec), sizeof(rec));
+		if(rec.family != MEMBER_INET4 && rec.family != MEMBER_INET6)
+			return -1;
+		// format_member leaves a trailing comma
+		import_member(name, member, format_member(&rec, member) - 1, path);
+	}
 	return 0;
 }
 
-static int already_member(struct group_file *gfile, char *member)
+/* Move one legacy group file into the journal. Older still, files held
+ * "ip:port," text, where host names were allowed; those members are
+ * dropped with a message. Returns -1 for a file we cannot read.
+ */
+static int import_legacy_file(const char *path, char *name)
 {
-	const char *memptr = (const char *)gfile->mmap_addr;
-	if(strstr(memptr, member) != NULL)
-		return 1;
-	return 0;
+	struct stat statb;
+	const char *data, *entry, *comma, *end;
+	uint32_t magic = 0;
+	void *addr = MAP_FAILED;
+	int fd, ret = -1;
+
+	if((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	// Empty or not, the group itself carries over
+	if(fstat(fd, &statb) == 0 && S_ISREG(statb.st_mode) && create_group(name) == 0)
+		addr = statb.st_size ? mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if(addr == NULL)
+		return 0;
+	if(addr == MAP_FAILED)
+		return -1;
+
+	data = addr;
+	end = data + statb.st_size;
+	if((size_t)statb.st_size >= sizeof(struct legacy_header))
+		memcpy(&magic, data, sizeof(magic));
+	if(magic == LEGACY_MAGIC) {
+		ret = import_legacy_records(name, data, statb.st_size, path);
+	} else if(memchr(data, '\0', statb.st_size) == NULL) {
+		for(entry = data; entry < end && (comma = memchr(entry, ',', end - entry)) != NULL; entry = comma + 1)
+			import_member(name, entry, comma - entry, path);
+		ret = 0;
+	}
+	munmap(addr, statb.st_size);
+	return ret;
 }
 
+/* Before the journal every group was a file of its own in group_dir.
+ * Move whatever is left of those into the journal, deleting each file
+ * once its members are committed, and refuse to start over one we
+ * cannot read rather than silently lose it. A stale directory's files
+ * are deleted, as they always were.
+ */
+static int import_legacy_groups(int stale)
+{
+	struct dirent *entry;
+	char *path;
+	DIR *dir;
+	int ret = 0;
+
+	if((dir = opendir(group_dir)) == NULL)
+		return -1;
+	while(ret == 0 && (entry = readdir(dir)) != NULL) {
+		// TIMESTAMP_FILE, "." and ".." (no group name starts with '.')
+		if(entry->d_name[0] == '.' || journal_file(entry->d_name))
+			continue;
+		path = build_path(group_dir, entry->d_name);
+		if(!stale && (ret = import_legacy_file(path, entry->d_name)) == -1)
+			fprintf(stderr, "%s: cannot read this group file; move it out of %s to start without it\n",
+				path, group_dir);
+		else if(!stale && (ret = journal_commit()) == -1)
+			fprintf(stderr, "%s: could not journal the imported group\n", path);
+		else
+			unlink(path);
+		free(path);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static void apply_event(const struct journal_event *ev);
+static void load_group(const char *name, size_t name_len,
+	const void *keys, size_t key_size, uint32_t count);
+static int dump_groups(struct journal_dump *dump);
+
 /* Exposed Functions */
 int initialize_group_manager()
 {
-	DIR *groups_dir;
-	int fd;
-	if((group_map = initialize_map()) == NULL) {
+	struct stat statb;
+	int fd, stale = 0;
+	if((group_map = registry_create()) == NULL ||
+	   (pattern_subs = trie_create()) == NULL) {
 		return -1;
 	}
+	start_time = time(NULL);
+	if(member_timeout)
+		wheel_init(&expiry_wheel, start_time);
 
-    if((health_map = initialize_map()) == NULL) {
-        return -1;
-    }
-
-	if((groups_dir = opendir(DEFAULT_DIR)) == NULL) {
+	if(stat(group_dir, &statb) == -1) {
 		if(errno == ENOENT) {
 			char *time_path;
-			if(mkdir(DEFAULT_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1)
+			if(mkdir(group_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1)
 				return -1;
 			// Create timestamp file
-			time_path = build_path(DEFAULT_DIR, TIMESTAMP_FILE);
+			time_path = build_path(group_dir, TIMESTAMP_FILE);
 			if((fd = open(time_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1){
 				free(time_path);
 				return -1;
@@ -183,182 +787,1257 @@ int initialize_group_manager()
 			return -1;
 		}
 	}else{
-		if(open_existing_groups(groups_dir) == -1)
+		if((stale = reset_if_stale()) == -1)
 			return -1;
 	}
 
-	return 0;
+	// Rebuilds every group from the snapshot and journal
+	if(journal_open(group_dir, apply_event, load_group, dump_groups) == -1)
+		return -1;
+	return import_legacy_groups(stale);
 }
-int group_exists(char *name)
+
+/* Make the changes of the last batch of requests durable. Meant to run
+ * once per reactor iteration (net_config.on_iteration).
+ */
+void commit_group_changes()
 {
-	if(map_get(group_map, name) != NULL)
-		return 1;
-	return 0;
+	journal_commit();
 }
 
-const char *retrieve_group_members(char *name)
+/* Expire members after this many seconds without a join or
+ * healthcheck. Has to be set before the groups are loaded.
+ */
+void set_member_timeout(int seconds)
 {
-	struct group_file *gfile;
-	if((gfile = (struct group_file *)map_get(group_map, name)) == NULL)
-		return NULL;
+	member_timeout = seconds > 0 ? seconds : 0;
+}
+
+/* Keep the last max_msgs broadcasts of every group, up to max_bytes of
+ * frames (0 for any amount), for SUBGROUP_FROM to replay. Has to be set
+ * before anything is broadcast.
+ */
+void set_group_dir(const char *dir)
+{
+	group_dir = dir;
+}
 
-	return (const char *)gfile->mmap_addr;
+void set_broadcast_retention(unsigned int max_msgs, size_t max_bytes)
+{
+	retain_msgs = max_msgs;
+	retain_bytes = max_bytes;
+	if(retain_msgs == 0 && retain_bytes)
+		retain_msgs = DEFAULT_RETAIN_MSGS;
 }
 
-int create_group(char *name)
+int group_exists(char *name)
 {
-	char *file_path = build_path(DEFAULT_DIR, name);
-	struct group_file *gfile = create_or_open_group_file(file_path);
-	if(gfile)
-		return map_put(group_map, gfile->group_name, (void *)gfile);
-	return -1;
+	return group_exists_n(name, strlen(name));
 }
-// Should this delete the underlying file?
-// for now we are
-int delete_group(char *name)
+
+int group_exists_n(const char *name, size_t name_len)
+{
+	int exists;
+
+	epoch_enter();
+	exists = registry_get(group_map, name, name_len) != NULL;
+	epoch_exit();
+	return exists;
+}
+
+/* The member list in its "ip:port," text form. The string is malloc'd
+ * and the caller's to free.
+ */
+char *retrieve_group_members(char *name)
 {
 	struct group_file *gfile;
-	gfile = map_remove(group_map, name);
-	if(gfile) {
-		char *file_path = build_path(DEFAULT_DIR, gfile->group_name);
-		munmap(gfile->mmap_addr, gfile->mapped_size);
-		close(gfile->fd);
-		if(file_path) {
-			unlink(file_path);
-			free(file_path);
+	char *members = NULL;
+	size_t len;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, strlen(name))) != NULL &&
+	   ensure_loaded(gfile) == 0) {
+		pthread_rwlock_rdlock(&gfile->lock);
+		if((members = malloc((size_t)gfile->count * MAX_MEMBER_STRING_SIZE + 1)) != NULL) {
+			len = render_members(gfile, members);
+			members[len] = '\0';
 		}
-		free(gfile);
+		pthread_rwlock_unlock(&gfile->lock);
 	}
-	return 0;
+	epoch_exit();
+	return members;
 }
 
-/* For now we're putting it on the user to compose the ip:port string
- * and to have to call in a single ip/port at a time, if they have 
- * multiple they need to deal with it by making multiple calls.
- * This simplifies things on our end and satisfies the typical use case.
+/* Returns the group, creating it if needed. Called with the registry
+ * locked.
  */
-int join_group(char *name, char *ip_addr)
+static struct group_file *create_group_locked(char *name)
 {
-	// ip_addr should be form "x.x.x.x:port"
-	char buf[256];
 	struct group_file *gfile;
-	int current_offset;
-    time_t *time_ptr;
-
-	if((gfile = map_get(group_map, name)) == NULL)
-		return -1;
-
-	// Set the buf, add comma, perhaps do sanitization later.
-	if(strlen(ip_addr) > 254)
-		return -1;
-
-    // Add to health map
-    time_ptr = malloc(sizeof(*time_ptr));
-    time(time_ptr);
-    map_put(health_map, ip_addr, (void*)time_ptr);
-
-	snprintf(buf, 256, "%s,", ip_addr);
-
-	if(already_member(gfile, buf))
-		return 0;
-	current_offset = strlen((char*)gfile->mmap_addr);
 
-	// The -1 is to maintain a single null terminator at the end
-	// of the mmap so we can pass it as a string
-	if(current_offset + strlen(buf) > gfile->mapped_size - 1)
-		extend_mapped_file(gfile);
+	if(name[0] == '\0' || strlen(name) >= MAX_VIEW_SIZE)
+		return NULL;
+	if((gfile = registry_get(group_map, name, strlen(name))) != NULL)
+		return gfile;
 
-	strcpy((char*)gfile->mmap_addr + current_offset, buf);
-	current_offset += strlen(buf);
-	return 0;
+	gfile = new_group_file(name);
+	if(gfile && registry_insert(group_map, gfile->group_name,
+			strlen(gfile->group_name), gfile) == -1) {
+		retire_group_file(gfile);
+		gfile = NULL;
+	}
+	if(gfile)
+		log_change(JOURNAL_CREATE, gfile->group_name, NULL, 0);
+	return gfile;
 }
 
-int healthcheck_group(char *name, char *ip_addr)
+int create_group(char *name)
 {
-    time_t *time_ptr;
-    struct group_file *gfile;
-
-    if((gfile = map_get(group_map, name)) == NULL)
-        return -1;
-
-    if(!already_member(gfile, ip_addr))
-        return -1;
+	struct group_file *gfile;
 
-    if((time_ptr = map_get(health_map, ip_addr)) == NULL)
-        return -1;
+	registry_lock(group_map);
+	gfile = create_group_locked(name);
+	registry_unlock(group_map);
+	return gfile ? 0 : -1;
+}
 
-    time(time_ptr);
+/* Take every timer of a group being deleted out of the wheel. Anyone
+ * still holding the group sees it is deleted and arms no more.
+ */
+static void disarm_group(struct group_file *gfile)
+{
+	uint32_t idx, words;
+	uint64_t word;
 
-    return 0;
+	pthread_rwlock_wrlock(&gfile->lock);
+	gfile->deleted = 1;
+	pthread_mutex_lock(&wheel_lock);
+	wheel_del(&gfile->load_timer.entry);
+	words = gfile->capacity / 64;
+	for(idx = 0; idx < words; ++idx) {
+		for(word = gfile->bitmap[idx]; word; word &= word - 1)
+			wheel_del(&MEMBER_TIMER(gfile, idx * 64 + __builtin_ctzll(word))->entry);
+	}
+	pthread_mutex_unlock(&wheel_lock);
+	pthread_rwlock_unlock(&gfile->lock);
 }
 
-int leave_group(char *name, char *ip_addr)
+/* Called with the registry locked */
+static void delete_group_locked(const char *name, size_t name_len)
 {
 	struct group_file *gfile;
-	char *memptr, *start_del, *end_del, *end_file;
-	size_t bytes_to_move, bytes_to_clear;
-	
-	if((gfile = map_get(group_map, name)) == NULL)
-		return -1;
-
-	if(!already_member(gfile, ip_addr))
-		return 0;
 
-	memptr = (char *)gfile->mmap_addr;
-	end_file = memptr + strlen(memptr);
-	start_del = strstr(memptr, ip_addr);
-	end_del = start_del + strlen(ip_addr);  
-	bytes_to_move = end_file - end_del;
-	bytes_to_clear = strlen(ip_addr);
-	
-	memcpy(start_del, end_del + 1, bytes_to_move); 
-	memset(end_file - bytes_to_clear, 0, bytes_to_clear);
+	if((gfile = registry_remove(group_map, name, name_len)) != NULL) {
+		log_change(JOURNAL_DELETE, gfile->group_name, NULL, 0);
+		if(member_timeout)
+			disarm_group(gfile);
+		// Broadcasts and lookups may still be using it
+		epoch_retire(gfile, retire_group_file);
+	}
+}
 
+int delete_group(char *name)
+{
+	registry_lock(group_map);
+	delete_group_locked(name, strlen(name));
+	registry_unlock(group_map);
 	return 0;
 }
 
-int sub_group(char *name, int sockfd)
+/* Push a join or leave to the group's watchers as a MEMBER_DELTA. The
+ * generation has already moved on for it, by exactly one.
+ */
+static void push_delta_locked(struct group_file *gfile, uint8_t op, const struct member_record *rec)
 {
-	struct group_file *gfile;
+	char member[MAX_MEMBER_STRING_SIZE];
+	struct net_buf *buf;
+	struct iovec iov[7];
+	uint8_t type = MEMBER_DELTA, glen;
+	uint64_t wire_gen;
+	uint16_t wire_len;
+	size_t member_len;
 	int idx;
-	if((gfile = map_get(group_map, name)) == NULL)
+
+	if(gfile->num_watchers == 0)
+		return;
+	// Without the separator LISTMEMBERS puts after each member
+	member_len = format_member(rec, member) - 1;
+	glen = strlen(gfile->group_name);
+	wire_gen = htobe64(gfile->generation);
+	wire_len = htons(member_len);
+
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = &glen;
+	iov[1].iov_len = 1;
+	iov[2].iov_base = gfile->group_name;
+	iov[2].iov_len = glen;
+	iov[3].iov_base = &wire_gen;
+	iov[3].iov_len = sizeof(wire_gen);
+	iov[4].iov_base = &op;
+	iov[4].iov_len = 1;
+	iov[5].iov_base = &wire_len;
+	iov[5].iov_len = sizeof(wire_len);
+	iov[6].iov_base = member;
+	iov[6].iov_len = member_len;
+	if((buf = net_buf_frame(iov, 7)) == NULL)
+		return;
+
+	for(idx = 0; idx < gfile->num_watchers; ++idx)
+		net_send_buf(gfile->watcher_fds[idx], buf);
+	net_buf_put(buf);
+}
+
+/* The journal identifies a member by its record key. Joins, leaves and
+ * expiry all come through these two, so watchers hear of every change.
+ */
+static int join_member_locked(struct group_file *gfile, const struct member_record *rec)
+{
+	void *slot;
+
+	// A re-join just counts as being seen
+	if((slot = map_get_n(gfile->members, (const char *)rec->addr, MEMBER_KEY_SIZE)) != NULL) {
+		gfile->records[(uintptr_t)slot - 1].last_seen = rec->last_seen;
+		return 0;
+	}
+	if(add_member(gfile, rec) == -1)
 		return -1;
+	log_change(JOURNAL_JOIN, gfile->group_name, rec->addr, MEMBER_KEY_SIZE);
+	push_delta_locked(gfile, JOINGROUP, rec);
+	return 0;
+}
 
-	if(gfile->num_listeners == gfile->max_listeners)
-		realloc_listener_array(gfile);
+static void leave_member_locked(struct group_file *gfile, const struct member_record *rec)
+{
+	void *found;
 
-	// Unfortunately we should make certain the socket fd
-	// isn't already on the sub list
-	// this is linear, but then again I've been dropping
-	// syscalls like I'm making it rain up in this file.
-	for(idx = 0; idx < gfile->num_listeners; ++idx) {
-		if(gfile->listener_fd_array[idx] == sockfd)
-			return 0;
+	if((found = map_remove_n(gfile->members, (const char *)rec->addr, MEMBER_KEY_SIZE)) != NULL) {
+		remove_member(gfile, (uintptr_t)found - 1);
+		log_change(JOURNAL_LEAVE, gfile->group_name, rec->addr, MEMBER_KEY_SIZE);
+		push_delta_locked(gfile, LEAVEGROUP, rec);
+	}
+}
+
+/* For now we're putting it on the user to compose the ip:port string
+ * and to have to call in a single ip/port at a time, if they have 
+ * multiple they need to deal with it by making multiple calls.
+ * This simplifies things on our end and satisfies the typical use case.
+ */
+int join_group(char *name, char *ip_addr)
+{
+	return join_group_n(name, strlen(name), ip_addr, strlen(ip_addr));
+}
+
+/* The address is checked before the group is looked up or created, so
+ * a join that is refused for it leaves no empty group behind
+ */
+int join_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len)
+{
+	char key[MAX_VIEW_SIZE];
+	struct group_file *gfile;
+	struct member_record rec;
+	int ret = -1;
+
+	// ip_addr should be form "x.x.x.x:port" (or "[v6]:port")
+	if(parse_member(ip_addr, ip_len, &rec) == -1)
+		return JOIN_BAD_MEMBER;
+	rec.last_seen = time(NULL);
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) == NULL &&
+	   view_to_str(key, name, name_len) == 0) {
+		// Joining is what brings a group into existence. Only then
+		// does the name need to be a C string.
+		registry_lock(group_map);
+		gfile = create_group_locked(key);
+		registry_unlock(group_map);
+	}
+	if(gfile && ensure_loaded(gfile) == 0) {
+		pthread_rwlock_wrlock(&gfile->lock);
+		ret = join_member_locked(gfile, &rec);
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+	return ret;
+}
+
+/* Only reads the group's structure, so a shared lock will do */
+static int stamp_member_locked(struct group_file *gfile, const struct member_record *rec, int64_t now)
+{
+    void *slot;
+
+    if((slot = map_get_n(gfile->members, (const char *)rec->addr, MEMBER_KEY_SIZE)) == NULL)
+        return -1;
+
+    // Other healthchecks may be stamping it under the same shared lock
+    __atomic_store_n(&gfile->records[(uintptr_t)slot - 1].last_seen, now, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int healthcheck_group_locked(struct group_file *gfile, const char *ip_addr, size_t ip_len)
+{
+    struct member_record rec;
+
+    if(parse_member(ip_addr, ip_len, &rec) == -1)
+        return -1;
+    return stamp_member_locked(gfile, &rec, time(NULL));
+}
+
+int healthcheck_group(char *name, char *ip_addr)
+{
+	return healthcheck_group_n(name, strlen(name), ip_addr, strlen(ip_addr));
+}
+
+int healthcheck_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len)
+{
+	struct group_file *gfile;
+	int ret = -1;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL &&
+	   ensure_loaded(gfile) == 0) {
+		pthread_rwlock_rdlock(&gfile->lock);
+		ret = healthcheck_group_locked(gfile, ip_addr, ip_len);
+		pthread_rwlock_unlock(&gfile->lock);
 	}
+	epoch_exit();
+	return ret;
+}
+
+/* Batched heartbeats (see HEALTHCHECK_GROUPS in msgproto.h): one member
+ * in a list of GLEN|GROUPNAME entries. The member is parsed once and the
+ * whole list is checked in one epoch. Returns how many of the groups
+ * have the member, or -1 if the list is malformed.
+ */
+int healthcheck_groups_n(const char *ip_addr, size_t ip_len, const char *groups, size_t groups_len)
+{
+	const unsigned char *p = (const unsigned char *)groups;
+	struct member_record rec;
+	struct group_file *gfile;
+	int64_t now;
+	size_t off, name_len;
+	int found = 0;
 
+	if(parse_member(ip_addr, ip_len, &rec) == -1)
+		return -1;
+	now = time(NULL);
+
+	epoch_enter();
+	for(off = 0; off < groups_len; off += 1 + name_len) {
+		name_len = p[off];
+		if(name_len == 0 || off + 1 + name_len > groups_len) {
+			found = -1;
+			break;
+		}
+		if((gfile = registry_get(group_map, groups + off + 1, name_len)) != NULL &&
+		   ensure_loaded(gfile) == 0) {
+			pthread_rwlock_rdlock(&gfile->lock);
+			if(stamp_member_locked(gfile, &rec, now) == 0)
+				found++;
+			pthread_rwlock_unlock(&gfile->lock);
+		}
+	}
+	epoch_exit();
+	return found;
+}
+
+/* Batched heartbeats (see HEALTHCHECK_MEMBERS in msgproto.h): many
+ * members of one group, in the "ip:port," form LISTMEMBERS hands out.
+ * The group is looked up and locked once for all of them. Returns how
+ * many are members, or -1 if the group is missing or a member malformed.
+ */
+int healthcheck_members_n(const char *name, size_t name_len, const char *members, size_t members_len)
+{
+	struct member_record rec;
+	struct group_file *gfile;
+	const char *member, *end = members + members_len, *comma;
+	int64_t now = time(NULL);
+	int found = -1;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL &&
+	   ensure_loaded(gfile) == 0) {
+		pthread_rwlock_rdlock(&gfile->lock);
+		found = 0;
+		for(member = members; member < end; member = comma + 1) {
+			if((comma = memchr(member, ',', end - member)) == NULL)
+				comma = end;
+			if(parse_member(member, comma - member, &rec) == -1) {
+				found = -1;
+				break;
+			}
+			if(stamp_member_locked(gfile, &rec, now) == 0)
+				found++;
+		}
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+	return found;
+}
+
+static int leave_group_locked(struct group_file *gfile, const char *ip_addr, size_t ip_len)
+{
+	struct member_record rec;
+
+	if(parse_member(ip_addr, ip_len, &rec) == -1)
+		return -1;
+	leave_member_locked(gfile, &rec);
+	return 0;
+}
+
+int leave_group(char *name, char *ip_addr)
+{
+	return leave_group_n(name, strlen(name), ip_addr, strlen(ip_addr));
+}
+
+int leave_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len)
+{
+	struct group_file *gfile;
+	int ret = -1;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL &&
+	   ensure_loaded(gfile) == 0) {
+		pthread_rwlock_wrlock(&gfile->lock);
+		ret = leave_group_locked(gfile, ip_addr, ip_len);
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+	return ret;
+}
+
+struct due_timers {
+	struct member_timer **timers;
+	size_t count;
+	size_t max;
+};
+
+static void collect_due(struct wheel_entry *entry, void *arg)
+{
+	struct due_timers *due = arg;
+	struct member_timer **new_timers;
+	size_t new_max;
+
+	if(due->count == due->max) {
+		new_max = due->max ? 2 * due->max : 64;
+		if((new_timers = realloc(due->timers, new_max * sizeof(struct member_timer *))) == NULL) {
+			// Leave it for the next tick
+			wheel_add(&expiry_wheel, entry, expiry_wheel.now + 1);
+			return;
+		}
+		due->timers = new_timers;
+		due->max = new_max;
+	}
+	due->timers[due->count++] = (struct member_timer *)entry;
+}
+
+static int by_group(const void *a, const void *b)
+{
+	uintptr_t ga = (uintptr_t)(*(struct member_timer * const *)a)->gfile;
+	uintptr_t gb = (uintptr_t)(*(struct member_timer * const *)b)->gfile;
+
+	return ga < gb ? -1 : ga > gb;
+}
+
+/* Check a member whose timer came due. Called with the group's lock
+ * held for writing.
+ */
+static void expire_member_locked(struct group_file *gfile, struct member_timer *timer, time_t now)
+{
+	struct member_record rec;
+
+	// Gone already, or left and its slot taken by a new member who has
+	// a timer of their own
+	if(gfile->deleted || !(gfile->bitmap[timer->slot / 64] & (1ULL << (timer->slot % 64))) ||
+	   wheel_armed(&timer->entry))
+		return;
+
+	rec = gfile->records[timer->slot];
+	if(rec.last_seen + member_timeout > now)
+		arm_timer(timer, rec.last_seen + member_timeout);
+	else
+		leave_member_locked(gfile, &rec);
+}
+
+/* Advance the expiry wheel to now and drop every member that has lapsed.
+ * Due timers are sorted by group so each group is locked once a tick, and
+ * the leaves are journaled like any other.
+ */
+void expire_members()
+{
+	struct due_timers due = { NULL, 0, 0 };
+	struct member_timer *timer;
+	struct group_file *gfile = NULL;
+	time_t now = time(NULL);
+	size_t idx;
+
+	if(member_timeout == 0)
+		return;
+
+	// Keeps the groups of collected timers around until we are done
+	epoch_enter();
+	pthread_mutex_lock(&wheel_lock);
+	wheel_advance(&expiry_wheel, now, collect_due, &due);
+	pthread_mutex_unlock(&wheel_lock);
+	if(due.count == 0) {
+		epoch_exit();
+		return;
+	}
+
+	// Snapshot groups come due once everyone in them has lapsed. Loading
+	// one arms its members with deadlines already past.
+	for(idx = 0; idx < due.count; ++idx) {
+		if(due.timers[idx]->slot == LOAD_SLOT)
+			ensure_loaded(due.timers[idx]->gfile);
+	}
+
+	qsort(due.timers, due.count, sizeof(struct member_timer *), by_group);
+	for(idx = 0; idx < due.count; ++idx) {
+		timer = due.timers[idx];
+		if(timer->slot == LOAD_SLOT)
+			continue;
+		if(timer->gfile != gfile) {
+			if(gfile)
+				pthread_rwlock_unlock(&gfile->lock);
+			gfile = timer->gfile;
+			pthread_rwlock_wrlock(&gfile->lock);
+		}
+		expire_member_locked(gfile, timer, now);
+	}
+	if(gfile)
+		pthread_rwlock_unlock(&gfile->lock);
+	epoch_exit();
+	free(due.timers);
+}
+
+/* numbered listeners get BROADCAST_SEQ frames while retention is on.
+ * Subscribing again only changes that.
+ */
+static int sub_group_locked(struct group_file *gfile, int sockfd, int numbered)
+{
+	void *found;
+
+	if(gfile->listener_slots == NULL && (gfile->listener_slots = initialize_map()) == NULL)
+		return -1;
+	if((found = map_get_n(gfile->listener_slots, (const char *)&sockfd, sizeof(sockfd))) != NULL) {
+		gfile->listener_numbered[(uintptr_t)found - 1] = numbered;
+		return 0;
+	}
+
+	if(gfile->num_listeners == gfile->max_listeners &&
+	   realloc_listener_array(gfile) == -1)
+		return -1;
+	if(map_put_n(gfile->listener_slots, (const char *)&sockfd, sizeof(sockfd),
+			(void *)(uintptr_t)(gfile->num_listeners + 1)) == -1)
+		return -1;
+	gfile->listener_numbered[gfile->num_listeners] = numbered;
 	gfile->listener_fd_array[gfile->num_listeners++] = sockfd;
 	return 0;
 }
 
+static void drop_watcher_locked(struct group_file *gfile, int sockfd)
+{
+	int idx;
+
+	for(idx = 0; idx < gfile->num_watchers; ++idx) {
+		if(gfile->watcher_fds[idx] == sockfd) {
+			gfile->watcher_fds[idx] = gfile->watcher_fds[--gfile->num_watchers];
+			return;
+		}
+	}
+}
+
+/* Broadcasts don't promise any order among listeners, so the last one
+ * is simply moved into the hole.
+ */
+static int unsub_group_locked(struct group_file *gfile, int sockfd)
+{
+	uintptr_t idx;
+	void *found;
+	int last;
+
+	if(gfile->listener_slots == NULL ||
+	   (found = map_remove_n(gfile->listener_slots, (const char *)&sockfd, sizeof(sockfd))) == NULL)
+		return -1;
+
+	drop_watcher_locked(gfile, sockfd);
+	idx = (uintptr_t)found - 1;
+	last = gfile->listener_fd_array[--gfile->num_listeners];
+	if(idx != (uintptr_t)gfile->num_listeners) {
+		gfile->listener_fd_array[idx] = last;
+		gfile->listener_numbered[idx] = gfile->listener_numbered[gfile->num_listeners];
+		map_put_n(gfile->listener_slots, (const char *)&last, sizeof(last), (void *)(idx + 1));
+	}
+	return 0;
+}
+
+int sub_group(char *name, int sockfd)
+{
+	return sub_group_n(name, strlen(name), sockfd);
+}
+
+/* A pattern subscribes sockfd to every group it matches, including
+ * ones that do not exist yet
+ */
+static int sub_pattern(const char *pattern, size_t len, int sockfd)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&pattern_lock);
+	ret = trie_insert(pattern_subs, pattern, len, sockfd);
+	if(ret == 0 && record_sub(sockfd, pattern, len) == -1) {
+		trie_remove(pattern_subs, pattern, len, sockfd);
+		ret = -1;
+	}
+	atomic_store_explicit(&num_patterns, trie_size(pattern_subs), memory_order_release);
+	pthread_rwlock_unlock(&pattern_lock);
+	return ret;
+}
+
+/* Queue the retained broadcasts numbered from on, oldest first. Called
+ * with the group's write lock held, so no broadcast can come between them
+ * and the subscription. Anything older than the ring is gone, which the
+ * subscriber sees as a gap in the numbers.
+ */
+static void replay_locked(struct group_file *gfile, int sockfd, uint64_t from)
+{
+	uint64_t idx;
+	int ret;
+
+	idx = from > gfile->ring_first_seq ? from - gfile->ring_first_seq : 0;
+	for(; idx < gfile->ring_count; ++idx) {
+		ret = net_send_buf(sockfd, gfile->ring[(gfile->ring_head + idx) % retain_msgs]);
+		if(ret == -1 || ret == NET_SEND_EVICTED)
+			break;
+	}
+}
+
+static struct net_buf *encode_members_locked(struct group_file *gfile, int with_gen);
+
+/* Make sockfd a watcher, starting it off with the members as of the
+ * current generation. Every delta after that comes from a change made
+ * under the write lock we hold, so none can be missed.
+ */
+static int watch_locked(struct group_file *gfile, int sockfd)
+{
+	struct net_buf *buf;
+	int idx, *new_fds, new_max;
+
+	for(idx = 0; idx < gfile->num_watchers && gfile->watcher_fds[idx] != sockfd; ++idx)
+		;
+	if(idx == gfile->num_watchers && gfile->num_watchers == gfile->max_watchers) {
+		new_max = gfile->max_watchers ? 2 * gfile->max_watchers : DEFAULT_MAX_SUBS;
+		if((new_fds = realloc(gfile->watcher_fds, new_max * sizeof(int))) == NULL)
+			return -1;
+		gfile->watcher_fds = new_fds;
+		gfile->max_watchers = new_max;
+	}
+	if((buf = encode_members_locked(gfile, 1)) == NULL)
+		return -1;
+	if(idx == gfile->num_watchers)
+		gfile->watcher_fds[gfile->num_watchers++] = sockfd;
+	net_send_buf(sockfd, buf);
+	net_buf_put(buf);
+	return 0;
+}
+
+/* With from, the retained broadcasts numbered from on are replayed
+ * first. With watch, the socket is pushed membership changes too.
+ */
+static int subscribe(const char *name, size_t name_len, int sockfd, const uint64_t *from, int watch)
+{
+	struct group_file *gfile;
+	int ret = -1;
+
+	if(topic_is_pattern(name, name_len))
+		return from || watch ? -1 : sub_pattern(name, name_len, sockfd);
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL &&
+	   (!watch || ensure_loaded(gfile) == 0)) {
+		pthread_rwlock_wrlock(&gfile->lock);
+		if(from)
+			replay_locked(gfile, sockfd, *from);
+		ret = watch ? watch_locked(gfile, sockfd) : 0;
+		if(ret == 0)
+			ret = sub_group_locked(gfile, sockfd, from != NULL);
+		// The socket remembers it too, for unsub_all_groups
+		if(ret == 0 && record_sub(sockfd, name, name_len) == -1) {
+			unsub_group_locked(gfile, sockfd);
+			ret = -1;
+		}
+		if(ret == -1 && watch)
+			drop_watcher_locked(gfile, sockfd);
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+	return ret;
+}
+
+int sub_group_n(const char *name, size_t name_len, int sockfd)
+{
+	return subscribe(name, name_len, sockfd, NULL, 0);
+}
+
+/* Subscribe after replaying the group's retained broadcasts numbered
+ * from on (see SUBGROUP_FROM). Only for group names, not patterns.
+ */
+int sub_group_from_n(const char *name, size_t name_len, int sockfd, uint64_t from)
+{
+	return subscribe(name, name_len, sockfd, &from, 0);
+}
+
+/* Subscribe and watch the group's membership (see SUBGROUP_WATCH): a
+ * MEMBERS_AT now, then a MEMBER_DELTA for every join, leave or expiry.
+ * Only for group names, not patterns.
+ */
+int sub_group_watch_n(const char *name, size_t name_len, int sockfd)
+{
+	return subscribe(name, name_len, sockfd, NULL, 1);
+}
+
 int unsub_group(char *name, int sockfd)
+{
+	return unsub_group_n(name, strlen(name), sockfd);
+}
+
+int unsub_group_n(const char *name, size_t name_len, int sockfd)
 {
 	struct group_file *gfile;
+	int ret = -1;
+
+	if(topic_is_pattern(name, name_len)) {
+		pthread_rwlock_wrlock(&pattern_lock);
+		if((ret = trie_remove(pattern_subs, name, name_len, sockfd)) == 0)
+			forget_sub(sockfd, name, name_len);
+		atomic_store_explicit(&num_patterns, trie_size(pattern_subs), memory_order_release);
+		pthread_rwlock_unlock(&pattern_lock);
+		return ret;
+	}
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL) {
+		pthread_rwlock_wrlock(&gfile->lock);
+		if((ret = unsub_group_locked(gfile, sockfd)) == 0)
+			forget_sub(sockfd, name, name_len);
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+	return ret;
+}
+
+/* Drop every subscription sockfd holds. Meant to be called as its
+ * connection closes, before the fd number can be reused by another.
+ */
+void unsub_all_groups(int sockfd)
+{
+	struct group_file *gfile;
+	struct fd_subs *subs = NULL;
+	size_t len;
 	int idx;
-	if((gfile = map_get(group_map, name)) == NULL)
-		return -1;
+
+	pthread_mutex_lock(&subs_lock);
+	if(sockfd >= 0 && sockfd < subs_table_size) {
+		subs = subs_table[sockfd];
+		subs_table[sockfd] = NULL;
+	}
+	pthread_mutex_unlock(&subs_lock);
+	if(subs == NULL)
+		return;
+
+	epoch_enter();
+	for(idx = 0; idx < subs->count; ++idx) {
+		len = strlen(subs->names[idx]);
+		if(topic_is_pattern(subs->names[idx], len)) {
+			pthread_rwlock_wrlock(&pattern_lock);
+			trie_remove(pattern_subs, subs->names[idx], len, sockfd);
+			atomic_store_explicit(&num_patterns, trie_size(pattern_subs), memory_order_release);
+			pthread_rwlock_unlock(&pattern_lock);
+			free(subs->names[idx]);
+			continue;
+		}
+		// The group may be gone, or be a new one under the same name
+		gfile = registry_get(group_map, subs->names[idx], len);
+		if(gfile) {
+			pthread_rwlock_wrlock(&gfile->lock);
+			unsub_group_locked(gfile, sockfd);
+			pthread_rwlock_unlock(&gfile->lock);
+		}
+		free(subs->names[idx]);
+	}
+	epoch_exit();
+
+	map_destroy(subs->index, NULL);
+	free(subs->names);
+	free(subs);
+}
+
+/* Queue a broadcast frame on one listener, keeping the group's overflow
+ * counts. Returns whether the frame counts as sent.
+ */
+static int queue_broadcast(struct group_file *gfile, int sockfd, struct net_buf *buf)
+{
+	int ret = net_send_buf(sockfd, buf);
+
+	if(ret == -1)
+		return 0;
+	if(ret == NET_SEND_EVICTED) {
+		atomic_fetch_add_explicit(&gfile->evicted, 1, memory_order_relaxed);
+		return 0;
+	}
+	// This frame, older ones, or both were discarded
+	if(ret > 0)
+		atomic_fetch_add_explicit(&gfile->dropped, ret, memory_order_relaxed);
+	return 1;
+}
+
+// Sockets subscribed to a broadcast's group through patterns
+struct pattern_match {
+	int *fds;
+	int count;
+	int max;
+	int overflow; // out of memory, some are missing
+};
+
+static void collect_match(int fd, void *arg)
+{
+	struct pattern_match *match = arg;
+	int *new_fds, new_max;
+
+	if(match->count == match->max) {
+		new_max = match->max ? 2 * match->max : DEFAULT_MAX_LISTENERS;
+		if((new_fds = realloc(match->fds, new_max * sizeof(int))) == NULL) {
+			match->overflow = 1;
+			return;
+		}
+		match->fds = new_fds;
+		match->max = new_max;
+	}
+	match->fds[match->count++] = fd;
+}
+
+static int by_fd(const void *a, const void *b)
+{
+	int fa = *(const int *)a, fb = *(const int *)b;
+
+	return fa < fb ? -1 : fa > fb;
+}
+
+/* Queue the frame on every pattern subscriber of the group, once each
+ * and skipping those already subscribed to it by name. Called with the
+ * group lock held.
+ */
+static int broadcast_patterns_locked(struct group_file *gfile, struct net_buf *buf)
+{
+	struct pattern_match match = { NULL, 0, 0, 0 };
+	int idx, sent = 0;
+
+	if(atomic_load_explicit(&num_patterns, memory_order_acquire) == 0)
+		return 0;
+	// Held until the frame is queued: unsub_all_groups drops a closing
+	// socket's patterns under the write lock, and only then is its fd
+	// closed and free for reuse
+	pthread_rwlock_rdlock(&pattern_lock);
+	trie_match(pattern_subs, gfile->group_name, strlen(gfile->group_name), collect_match, &match);
+	if(match.overflow)
+		fprintf(stderr, "Broadcast to %s missed pattern subscribers\n", gfile->group_name);
+
+	// Overlapping patterns match the same socket more than once
+	if(match.count)
+		qsort(match.fds, match.count, sizeof(int), by_fd);
+	for(idx = 0; idx < match.count; ++idx) {
+		if(idx > 0 && match.fds[idx] == match.fds[idx - 1])
+			continue;
+		if(gfile->listener_slots &&
+		   map_get_n(gfile->listener_slots, (const char *)&match.fds[idx], sizeof(int)) != NULL)
+			continue;
+		sent += queue_broadcast(gfile, match.fds[idx], buf);
+	}
+	pthread_rwlock_unlock(&pattern_lock);
+	free(match.fds);
+	return sent;
+}
+
+/* Fan a BROADCAST out to every listener of the group, by name or by
+ * pattern. The frame is encoded once into a shared net_buf and each
+ * listener's connection queues a reference to it, so the cost per
+ * subscriber is a pointer rather than a copy. Returns the number of
+ * listeners it was queued on.
+ */
+int broadcast_group(char *name, const char *msg, size_t msg_sz)
+{
+	return broadcast_group_n(name, strlen(name), msg, msg_sz);
+}
+
+/* Frame a BROADCAST, or a BROADCAST_SEQ numbered seq if seq is not 0 */
+static struct net_buf *encode_broadcast(const char *name, size_t name_len,
+	const char *msg, size_t msg_sz, uint64_t seq)
+{
+	struct iovec iov[6];
+	uint8_t type = seq ? BROADCAST_SEQ : BROADCAST, glen = name_len;
+	uint16_t wire_len = htons(msg_sz);
+	uint64_t wire_seq = htobe64(seq);
+	int cnt = 0;
+
+	iov[cnt].iov_base = &type;
+	iov[cnt++].iov_len = 1;
+	iov[cnt].iov_base = &glen;
+	iov[cnt++].iov_len = 1;
+	iov[cnt].iov_base = (void *)name;
+	iov[cnt++].iov_len = name_len;
+	if(seq) {
+		iov[cnt].iov_base = &wire_seq;
+		iov[cnt++].iov_len = sizeof(wire_seq);
+	}
+	iov[cnt].iov_base = &wire_len;
+	iov[cnt++].iov_len = sizeof(wire_len);
+	iov[cnt].iov_base = (void *)msg;
+	iov[cnt++].iov_len = msg_sz;
+
+	return net_buf_frame(iov, cnt);
+}
+
+/* Add a numbered frame to the ring, evicting the oldest to stay within
+ * bounds. A frame too big to keep at all empties the ring, since replays
+ * assume the numbers in it run without gaps. Called with the group's
+ * read lock and ring_lock held.
+ */
+static void retain_broadcast_locked(struct group_file *gfile, struct net_buf *buf, uint64_t seq)
+{
+	struct net_buf *old;
+	int fits = !retain_bytes || buf->len <= retain_bytes;
+
+	if(gfile->ring == NULL &&
+	   (gfile->ring = malloc(retain_msgs * sizeof(struct net_buf *))) == NULL)
+		fits = 0;
+	while(gfile->ring_count && (!fits || gfile->ring_count == retain_msgs ||
+	      (retain_bytes && gfile->ring_bytes + buf->len > retain_bytes))) {
+		old = gfile->ring[gfile->ring_head];
+		gfile->ring_head = (gfile->ring_head + 1) % retain_msgs;
+		gfile->ring_count--;
+		gfile->ring_bytes -= old->len;
+		gfile->ring_first_seq++;
+		net_buf_put(old);
+	}
+	if(!fits)
+		return;
+
+	if(gfile->ring_count == 0)
+		gfile->ring_first_seq = seq;
+	net_buf_get(buf);
+	gfile->ring[(gfile->ring_head + gfile->ring_count++) % retain_msgs] = buf;
+	gfile->ring_bytes += buf->len;
+}
+
+/* Numbered listeners get seq_buf if there is one, everyone else buf.
+ * Called with the group lock held.
+ */
+static int fan_out_locked(struct group_file *gfile, struct net_buf *buf, struct net_buf *seq_buf)
+{
+	int idx, sent = 0;
 
 	for(idx = 0; idx < gfile->num_listeners; ++idx) {
-		if(gfile->listener_fd_array[idx] == sockfd)
-			break;
+		sent += queue_broadcast(gfile, gfile->listener_fd_array[idx],
+			seq_buf && gfile->listener_numbered[idx] ? seq_buf : buf);
 	}
-	if(idx == gfile->num_listeners)
+	return sent + broadcast_patterns_locked(gfile, buf);
+}
+
+int broadcast_group_n(const char *name, size_t name_len, const char *msg, size_t msg_sz)
+{
+	struct group_file *gfile;
+	struct net_buf *buf, *seq_buf;
+	int sent = -1;
+
+	if(name_len > 255 || msg_sz > 65535)
+		return -1;
+	// Unnumbered frames can be built before finding the group
+	if((buf = encode_broadcast(name, name_len, msg, msg_sz, 0)) == NULL)
 		return -1;
 
-	// Check if we're the last in the list to avoid undefined behavor with
-	// memcpy(x, y, 0) where y could be invalid if num_listeners ==
-	// max_listeners
-	if(idx < gfile->num_listeners - 1)
-		memcpy(gfile->listener_fd_array + idx, gfile->listener_fd_array + idx + 1, gfile->num_listeners - idx - 1);
-	gfile->num_listeners--;
-	return 0;
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL) {
+		pthread_rwlock_rdlock(&gfile->lock);
+		if(!retain_msgs) {
+			sent = fan_out_locked(gfile, buf, NULL);
+		} else {
+			pthread_mutex_lock(&gfile->ring_lock);
+			seq_buf = encode_broadcast(name, name_len, msg, msg_sz, gfile->last_seq + 1);
+			if(seq_buf) {
+				retain_broadcast_locked(gfile, seq_buf, ++gfile->last_seq);
+				sent = fan_out_locked(gfile, buf, seq_buf);
+				net_buf_put(seq_buf);
+			}
+			pthread_mutex_unlock(&gfile->ring_lock);
+		}
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+
+	net_buf_put(buf);
+	return sent;
+}
+
+/* Frame one piece of a member list: TYPE|GLEN|GROUPNAME|STRLEN|members,
+ * with the generation ahead of STRLEN if gen is given.
+ */
+static struct net_buf *encode_members_frame(struct group_file *gfile, uint8_t type,
+	const uint64_t *gen, const char *members, size_t members_len)
+{
+	struct iovec iov[6];
+	uint8_t glen = strlen(gfile->group_name);
+	uint64_t wire_gen;
+	uint16_t wire_len = htons(members_len);
+	int cnt = 0;
+
+	iov[cnt].iov_base = &type;
+	iov[cnt++].iov_len = 1;
+	iov[cnt].iov_base = &glen;
+	iov[cnt++].iov_len = 1;
+	iov[cnt].iov_base = gfile->group_name;
+	iov[cnt++].iov_len = glen;
+	if(gen) {
+		wire_gen = htobe64(*gen);
+		iov[cnt].iov_base = &wire_gen;
+		iov[cnt++].iov_len = sizeof(wire_gen);
+	}
+	iov[cnt].iov_base = &wire_len;
+	iov[cnt++].iov_len = sizeof(wire_len);
+	iov[cnt].iov_base = (void *)members;
+	iov[cnt++].iov_len = members_len;
+	return net_buf_frame(iov, cnt);
+}
+
+// The longest run of whole "ip:port," entries that fits one STRLEN
+static size_t members_piece_len(const char *members, size_t len)
+{
+	if(len <= 65535)
+		return len;
+	return (const char *)memrchr(members, ',', 65535) - members + 1;
+}
+
+/* Frame a list longer than one STRLEN allows as LISTMEMBERS_PART (or
+ * MEMBERS_AT_PART) frames and a last one of type, all in one buffer so
+ * no other frame can be queued in between.
+ */
+static struct net_buf *encode_members_pieces(struct group_file *gfile, uint8_t type,
+	const uint64_t *gen, const char *members, size_t members_len)
+{
+	struct net_buf *buf = NULL, **pieces;
+	uint8_t part = type == MEMBERS_AT ? MEMBERS_AT_PART : LISTMEMBERS_PART;
+	size_t off, len, total = 0;
+	int idx, num_pieces = 0;
+
+	// Every piece but the last ends within a member of the limit
+	pieces = malloc((members_len / (65535 - MAX_MEMBER_STRING_SIZE) + 1) * sizeof(*pieces));
+	if(pieces == NULL)
+		return NULL;
+	for(off = 0; off < members_len; off += len) {
+		len = members_piece_len(members + off, members_len - off);
+		pieces[num_pieces] = encode_members_frame(gfile,
+			off + len < members_len ? part : type, gen, members + off, len);
+		if(pieces[num_pieces] == NULL)
+			break;
+		total += pieces[num_pieces++]->len;
+	}
+	if(off == members_len && (buf = net_buf_alloc(total)) != NULL) {
+		for(idx = 0, off = 0; idx < num_pieces; off += pieces[idx++]->len)
+			memcpy(buf->data + off, pieces[idx]->data, pieces[idx]->len);
+	}
+	for(idx = 0; idx < num_pieces; ++idx)
+		net_buf_put(pieces[idx]);
+	free(pieces);
+	return buf;
+}
+
+/* Encode the LISTMEMBERS reply for the group's current members, framed
+ * like a JOINGROUP, in pieces past 65535 bytes (see LISTMEMBERS_PART).
+ * With_gen makes it a MEMBERS_AT carrying the generation as well. Called
+ * with the group lock held.
+ */
+static struct net_buf *encode_members_locked(struct group_file *gfile, int with_gen)
+{
+	struct net_buf *buf = NULL;
+	const uint64_t *gen = with_gen ? &gfile->generation : NULL;
+	uint8_t type = with_gen ? MEMBERS_AT : LISTMEMBERS;
+	size_t members_len;
+	char *members;
+
+	members = malloc((size_t)gfile->count * MAX_MEMBER_STRING_SIZE + 1);
+	if(members == NULL)
+		return NULL;
+	members_len = render_members(gfile, members);
+
+	if(members_len <= 65535)
+		buf = encode_members_frame(gfile, type, gen, members, members_len);
+	else
+		buf = encode_members_pieces(gfile, type, gen, members, members_len);
+	free(members);
+	return buf;
+}
+
+/* Return a ref on the cached LISTMEMBERS reply, re-encoding it first if
+ * a join or leave has happened since it was built. Called with the group
+ * lock held, so the generation cannot move underneath us.
+ */
+static struct net_buf *get_members_buf_locked(struct group_file *gfile)
+{
+	struct net_buf *buf = NULL;
+
+	pthread_mutex_lock(&gfile->cache_lock);
+	if(gfile->members_buf && gfile->members_buf_gen != gfile->generation) {
+		net_buf_put(gfile->members_buf);
+		gfile->members_buf = NULL;
+	}
+	if(gfile->members_buf == NULL) {
+		gfile->members_buf = encode_members_locked(gfile, 0);
+		gfile->members_buf_gen = gfile->generation;
+	}
+	if((buf = gfile->members_buf) != NULL)
+		net_buf_get(buf);
+	pthread_mutex_unlock(&gfile->cache_lock);
+	return buf;
+}
+
+/* Answer a LISTMEMBERS request on sockfd. Pollers all share one encoded
+ * reply per generation of the group, so a request costs a lookup and a
+ * queued reference rather than a render and a copy.
+ */
+int send_group_members_n(const char *name, size_t name_len, int sockfd)
+{
+	struct group_file *gfile;
+	struct net_buf *buf = NULL;
+	int ret = -1;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, name_len)) != NULL &&
+	   ensure_loaded(gfile) == 0) {
+		pthread_rwlock_rdlock(&gfile->lock);
+		buf = get_members_buf_locked(gfile);
+		pthread_rwlock_unlock(&gfile->lock);
+	}
+	epoch_exit();
+
+	if(buf) {
+		ret = net_send_buf(sockfd, buf) == -1 ? -1 : 0;
+		net_buf_put(buf);
+	}
+	return ret;
+}
+
+/* Report how many broadcast frames subscribers of name have had dropped
+ * and how many subscribers were disconnected for falling too far behind.
+ */
+int group_overflow_stats(char *name, unsigned long *dropped, unsigned long *evicted)
+{
+	struct group_file *gfile;
+	int ret = -1;
+
+	epoch_enter();
+	if((gfile = registry_get(group_map, name, strlen(name))) != NULL) {
+		*dropped = atomic_load_explicit(&gfile->dropped, memory_order_relaxed);
+		*evicted = atomic_load_explicit(&gfile->evicted, memory_order_relaxed);
+		ret = 0;
+	}
+	epoch_exit();
+	return ret;
+}
+
+/* Replays one journal or snapshot event at startup */
+static void apply_event(const struct journal_event *ev)
+{
+	char name[MAX_VIEW_SIZE];
+	struct member_record rec;
+	struct group_file *gfile;
+
+	if(view_to_str(name, ev->name, ev->name_len) == -1)
+		return;
+
+	registry_lock(group_map);
+	switch(ev->op) {
+	case JOURNAL_CREATE:
+		create_group_locked(name);
+		break;
+	case JOURNAL_DELETE:
+		delete_group_locked(ev->name, ev->name_len);
+		break;
+	case JOURNAL_JOIN:
+	case JOURNAL_LEAVE:
+		if(ev->data_len != MEMBER_KEY_SIZE ||
+		   (gfile = registry_get(group_map, ev->name, ev->name_len)) == NULL ||
+		   ensure_loaded(gfile) == -1)
+			break;
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.addr, ev->data, MEMBER_KEY_SIZE);
+		// Members found on disk start out as freshly seen
+		rec.last_seen = time(NULL);
+		if(ev->op == JOURNAL_JOIN)
+			join_member_locked(gfile, &rec);
+		else
+			leave_member_locked(gfile, &rec);
+		break;
+	}
+	registry_unlock(group_map);
+}
+
+/* Registers a group found in the snapshot without touching its members */
+static void load_group(const char *name, size_t name_len,
+	const void *keys, size_t key_size, uint32_t count)
+{
+	char key[MAX_VIEW_SIZE];
+	struct group_file *gfile = NULL;
+
+	if(key_size == MEMBER_KEY_SIZE && view_to_str(key, name, name_len) == 0) {
+		registry_lock(group_map);
+		gfile = create_group_locked(key);
+		registry_unlock(group_map);
+	}
+	if(gfile == NULL || count == 0 || gfile->snap_keys) {
+		journal_snapshot_put();
+		return;
+	}
+	gfile->snap_keys = keys;
+	gfile->snap_count = count;
+	if(member_timeout)
+		arm_timer(&gfile->load_timer, start_time + member_timeout);
+}
+
+static int dump_group(void *value, void *arg)
+{
+	struct group_file *gfile = value;
+	struct journal_dump *dump = arg;
+	uint32_t idx, words;
+	uint64_t word;
+	int ret;
+
+	pthread_rwlock_rdlock(&gfile->lock);
+	ret = journal_dump_group(dump, gfile->group_name, strlen(gfile->group_name), MEMBER_KEY_SIZE);
+	// A group nobody has touched since startup is still in the old
+	// snapshot, which stays mapped until it is loaded
+	if(ret == 0 && gfile->snap_keys)
+		ret = journal_dump_members(dump, gfile->snap_keys, gfile->snap_count);
+
+	words = gfile->capacity / 64;
+	for(idx = 0; ret == 0 && idx < words; ++idx) {
+		for(word = gfile->bitmap[idx]; ret == 0 && word; word &= word - 1)
+			ret = journal_dump_members(dump, gfile->records[idx * 64 + __builtin_ctzll(word)].addr, 1);
+	}
+	pthread_rwlock_unlock(&gfile->lock);
+	return ret;
+}
+
+/* Copies every group and member out for a snapshot. The registry stays
+ * locked while that happens, which holds off creates and deletes, and
+ * each group is read locked while it is copied. The journal writes the
+ * copy out after we return, with neither held.
+ */
+static int dump_groups(struct journal_dump *dump)
+{
+	int ret;
+
+	registry_lock(group_map);
+	ret = registry_foreach(group_map, dump_group, dump);
+	registry_unlock(group_map);
+	return ret;
 }
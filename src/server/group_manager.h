@@ -3,12 +3,27 @@
 /* Author: Josh Tiras
  * Date: 2016-04-09
  * topic.h describes the data structures which store information
- * for groups and group subscribers. This includes the memorymapped
- * files containing IP/port information as well as structures containing
+ * for groups and group subscribers. This includes the journaled
+ * IP/port membership of each group as well as structures containing
  * filedescriptors for open sockets associated with these listeners
  */
+#include <stddef.h>
+#include <stdint.h>
 
+/* The *_n variants take names, addresses and payloads as
+ * length-delimited views (e.g. straight out of a receive buffer)
+ * rather than NUL-terminated strings. Joining a group that does not
+ * exist creates it.
+ */
 int initialize_group_manager();
+// Before initialize_group_manager; where the journal lives, /tmp/.groups by default
+void set_group_dir(const char *dir);
+void commit_group_changes(); // net_config.on_iteration, see journal.h
+// Before initialize_group_manager; 0 (the default) never expires anyone
+void set_member_timeout(int seconds);
+void expire_members(); // net_config.on_timer, about once a second
+// Before anything is broadcast; max_bytes 0 bounds only the count
+void set_broadcast_retention(unsigned int max_msgs, size_t max_bytes);
 int group_exists(char *name);
 int create_group(char *name);
 int delete_group(char *name);
@@ -17,5 +32,27 @@ int healthcheck_group(char *name, char *ip_addr);
 int leave_group(char *name, char *ip_addr);
 int sub_group(char *name, int sockfd);
 int unsub_group(char *name, int sockfd);
-const char *retrieve_group_members(char *name);
+void unsub_all_groups(int sockfd); // net_config.on_close for subscribers
+char *retrieve_group_members(char *name); // malloc'd, caller frees
+int broadcast_group(char *name, const char *msg, size_t msg_sz);
+
+int group_exists_n(const char *name, size_t name_len);
+/* join_group_n results besides 0 and -1 (the group could not be created
+ * or loaded, or out of memory)
+ */
+#define JOIN_BAD_MEMBER -2 // not a literal a.b.c.d:port or [v6]:port
+int join_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len);
+int healthcheck_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len);
+int leave_group_n(const char *name, size_t name_len, const char *ip_addr, size_t ip_len);
+// Batched heartbeats, see HEALTHCHECK_GROUPS and HEALTHCHECK_MEMBERS
+int healthcheck_groups_n(const char *ip_addr, size_t ip_len, const char *groups, size_t groups_len);
+int healthcheck_members_n(const char *name, size_t name_len, const char *members, size_t members_len);
+int sub_group_n(const char *name, size_t name_len, int sockfd);
+int sub_group_from_n(const char *name, size_t name_len, int sockfd, uint64_t from);
+int sub_group_watch_n(const char *name, size_t name_len, int sockfd);
+int unsub_group_n(const char *name, size_t name_len, int sockfd);
+int broadcast_group_n(const char *name, size_t name_len, const char *msg, size_t msg_sz);
+int send_group_members_n(const char *name, size_t name_len, int sockfd);
+
+int group_overflow_stats(char *name, unsigned long *dropped, unsigned long *evicted);
 #endif /* _GROUP_MANAGER_H */
@@ -1,205 +1,462 @@
 /* Author: Josh Tiras
  * Date: 2016-04-09
  * Yet another simple hashmap impl. I do this for fun, I swear.
- * This time I get to use linked lists as buckets though! Yay!
- * No dealing with shared memory and relative offsets!
+ *
+ * Group and health lookups happen on every message, so this is a flat
+ * open addressing table rather than chained buckets. Alongside the slots
+ * sits one control byte per slot: EMPTY, DELETED, or the low 7 bits of
+ * the key's hash when full. Probing looks at a group of 16 control bytes
+ * at once (one SSE2 compare), so most lookups touch a single cache line
+ * of control bytes and then exactly the slot holding the key. The full
+ * hash is stored in each slot for cheap rejects and for rehashing, and
+ * short keys are kept inline in the slot instead of strdup'd. Keys are
+ * plain byte strings of a given length (the map_*_n calls), so callers
+ * can look up straight out of a receive buffer.
+ *
+ * Growing never happens all at once: a resize allocates the new table
+ * and leaves the old one in place, and every map_put/map_remove then
+ * migrates a couple of groups across. Lookups check both tables until
+ * the old one is drained. map_get itself never migrates, so it stays a
+ * pure read and callers may keep running it under a shared lock.
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hashmap.h"
 
-#define DEFAULT_BUCKETS 64
-#define BUCKET_LIMIT 8
+#define GROUP_WIDTH 16 // Control bytes probed at once
+#define DEFAULT_CAPACITY 64 // Slots; always a power of two >= GROUP_WIDTH
+#define INLINE_KEY_SIZE 24 // Keys shorter than this live inside the slot
+#ifndef MIGRATE_GROUPS
+#define MIGRATE_GROUPS 2 // Old table groups moved per write while resizing
+#endif
 
-// Don't forget about strdup, so convenient!
-struct hash_entry {
-	char *key;
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+// A full slot's control byte is H2(hash), 0..127, so the sign bit alone
+// tells free from full.
+
+struct slot {
+	uint64_t hash;
 	void *data;
-	struct hash_entry *next_entry;
+	uint32_t key_len;
+	union {
+		char inline_key[INLINE_KEY_SIZE];
+		char *heap_key;
+	} key;
 };
 
-struct bucket {
-	int num_entries;
-	struct hash_entry *head;
-	struct hash_entry *tail;
+struct table {
+	int8_t *ctrl;	// capacity control bytes, 16 byte aligned
+	struct slot *slots;
+	size_t capacity;
+	size_t growth_left; // EMPTY slots we may still fill before resizing
 };
 
 struct hash_map {
-	int num_buckets;
-	struct bucket *buckets;
+	struct table cur;	// takes every insert
+	struct table old;	// being drained into cur; ctrl is NULL when not resizing
+	size_t migrate_pos;	// first old slot not yet migrated
+	size_t size;		// entries across both tables
+	uint64_t seed;		// random per map, so names off the wire can't be
+				// picked to collide
 };
 
-unsigned long
-djb2_hash(char *str)
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+/* 64x64 -> 128 bit multiply folded back to 64 bits */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
 {
-	unsigned long hash = 5381;
-	int c;
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-	return hash;
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
 }
 
-void* initialize_map() {
-	struct hash_map *new_map;
+/* Word at a time: eight key bytes per multiply, with the seed folded
+ * into every step so no input can cancel the state out.
+ */
+uint64_t hash_bytes(uint64_t seed, const char *key, size_t len)
+{
+	uint64_t hash = seed ^ hash_mix(len ^ HASH_P0, seed ^ HASH_P1);
+	uint64_t word;
 
-	if((new_map = malloc(sizeof(struct hash_map))) == NULL) {
-		return NULL;
+	for(; len >= 8; key += 8, len -= 8) {
+		memcpy(&word, key, 8);
+		hash = hash_mix(word ^ seed ^ HASH_P1, hash ^ HASH_P2);
+	}
+	if(len) {
+		word = 0;
+		memcpy(&word, key, len);
+		hash = hash_mix(word ^ seed ^ HASH_P2, hash ^ HASH_P0);
 	}
+	return hash_mix(hash ^ HASH_P0, hash ^ HASH_P1);
+}
 
-	if((new_map->buckets = calloc(DEFAULT_BUCKETS, sizeof(struct bucket))) == NULL) {
-		free(new_map);
-		return NULL;
+uint64_t hash_new_seed()
+{
+	uint64_t seed;
+	int fd;
+
+	if(getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+		return seed;
+	if((fd = open("/dev/urandom", O_RDONLY)) != -1) {
+		if(read(fd, &seed, sizeof(seed)) == sizeof(seed)) {
+			close(fd);
+			return seed;
+		}
+		close(fd);
 	}
+	// Better than nothing
+	return hash_mix((uint64_t)time(NULL) ^ HASH_P0, (uint64_t)(uintptr_t)&seed ^ HASH_P1);
+}
 
-	new_map->num_buckets = DEFAULT_BUCKETS;
-	return (void*)new_map;
+/* Bitmask of the slots in the group at ctrl whose control byte is c */
+static inline uint32_t group_match(const int8_t *ctrl, int8_t c)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+	uint32_t mask = 0;
+	int idx;
+
+	for(idx = 0; idx < GROUP_WIDTH; ++idx)
+		mask |= (uint32_t)(ctrl[idx] == c) << idx;
+	return mask;
+#endif
+}
+
+/* Bitmask of the EMPTY or DELETED slots in the group at ctrl */
+static inline uint32_t group_match_free(const int8_t *ctrl)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+	uint32_t mask = 0;
+	int idx;
+
+	for(idx = 0; idx < GROUP_WIDTH; ++idx)
+		mask |= (uint32_t)(ctrl[idx] < 0) << idx;
+	return mask;
+#endif
+}
+
+static inline const char *slot_key(const struct slot *s)
+{
+	return s->key_len < INLINE_KEY_SIZE ? s->key.inline_key : s->key.heap_key;
 }
 
-void realloc_map(void *map) {
+static inline size_t max_load(size_t capacity)
+{
+	return capacity - capacity / 8;
+}
+
+/* Probe groups triangularly (+1, +2, +3... groups); with a power of two
+ * group count that visits every group once.
+ */
+static ssize_t find_slot(struct table *t, const char *key, size_t len, uint64_t hash)
+{
+	size_t group_mask = t->capacity / GROUP_WIDTH - 1;
+	size_t group = H1(hash) & group_mask, stride = 0, pos;
+	uint32_t match;
+	struct slot *s;
+
+	for(;;) {
+		pos = group * GROUP_WIDTH;
+		match = group_match(t->ctrl + pos, H2(hash));
+		while(match) {
+			s = &t->slots[pos + __builtin_ctz(match)];
+			if(s->hash == hash && s->key_len == len &&
+			   memcmp(slot_key(s), key, len) == 0)
+				return s - t->slots;
+			match &= match - 1;
+		}
+		// An EMPTY slot ends every probe chain that reaches this group
+		if(group_match(t->ctrl + pos, CTRL_EMPTY))
+			return -1;
+		group = (group + ++stride) & group_mask;
+	}
+}
+
+/* Find key in whichever table holds it, setting *in to that table */
+static ssize_t lookup(struct hash_map *hmap, const char *key, size_t len, uint64_t hash,
+		struct table **in)
+{
+	ssize_t found;
+
+	*in = &hmap->cur;
+	if((found = find_slot(&hmap->cur, key, len, hash)) != -1 || hmap->old.ctrl == NULL)
+		return found;
+	*in = &hmap->old;
+	return find_slot(&hmap->old, key, len, hash);
+}
+
+/* Claim the first EMPTY or DELETED slot on hash's probe sequence in t */
+static size_t claim_free(struct table *t, uint64_t hash)
+{
+	size_t group_mask = t->capacity / GROUP_WIDTH - 1;
+	size_t group = H1(hash) & group_mask, stride = 0, pos;
+	uint32_t match;
+
+	while((match = group_match_free(t->ctrl + group * GROUP_WIDTH)) == 0)
+		group = (group + ++stride) & group_mask;
+	pos = group * GROUP_WIDTH + __builtin_ctz(match);
+	if(t->ctrl[pos] == CTRL_EMPTY)
+		t->growth_left--;
+	t->ctrl[pos] = H2(hash);
+	return pos;
+}
+
+static int alloc_table(struct table *t, size_t capacity)
+{
+	if((t->ctrl = aligned_alloc(GROUP_WIDTH, capacity)) == NULL)
+		return -1;
+	if((t->slots = malloc(capacity * sizeof(struct slot))) == NULL) {
+		free(t->ctrl);
+		t->ctrl = NULL;
+		return -1;
+	}
+	memset(t->ctrl, CTRL_EMPTY, capacity);
+	t->capacity = capacity;
+	t->growth_left = max_load(capacity);
+	return 0;
+}
+
+/* Move the full slots of from in [pos, end) into to. The stored hashes
+ * mean no key is rehashed or compared. Moved slots become tombstones so
+ * probe chains through from stay intact for what is left.
+ */
+static void move_slots(struct table *from, size_t pos, size_t end, struct table *to)
+{
+	size_t at;
+
+	for(; pos < end; ++pos) {
+		if(from->ctrl[pos] < 0)
+			continue;
+		at = claim_free(to, from->slots[pos].hash);
+		to->slots[at] = from->slots[pos];
+		from->ctrl[pos] = CTRL_DELETED;
+	}
+}
+
+static void free_table(struct table *t)
+{
+	free(t->ctrl);
+	free(t->slots);
+	t->ctrl = NULL;
+}
+
+// Move up to groups groups of the old table into cur
+static void migrate(struct hash_map *hmap, size_t groups)
+{
+	struct table *old = &hmap->old;
+	size_t end;
+
+	if(old->ctrl == NULL)
+		return;
+
+	end = old->capacity;
+	if(groups < (end - hmap->migrate_pos) / GROUP_WIDTH)
+		end = hmap->migrate_pos + groups * GROUP_WIDTH;
+	move_slots(old, hmap->migrate_pos, end, &hmap->cur);
+	hmap->migrate_pos = end;
+
+	if(hmap->migrate_pos == old->capacity)
+		free_table(old);
+}
+
+/* cur is out of EMPTY slots: make it the old table and start draining it
+ * into a fresh one, big enough that every entry fills at most half of
+ * what it may hold. That is twice the size, unless most of the load was
+ * tombstones, in which case the same size is enough to clean them up.
+ * Either way the fresh table has room for everything plus the inserts
+ * made before the migration finishes.
+ */
+static int start_resize(struct hash_map *hmap)
+{
+	size_t new_capacity = hmap->cur.capacity;
+	struct table fresh;
+
+	while(hmap->size > max_load(new_capacity) / 2)
+		new_capacity *= 2;
+	if(alloc_table(&fresh, new_capacity) == -1)
+		return -1;
+
+	// A resize still in flight cannot drain into cur, which is full;
+	// what is left of it goes straight into the fresh table
+	if(hmap->old.ctrl) {
+		move_slots(&hmap->old, hmap->migrate_pos, hmap->old.capacity, &fresh);
+		free_table(&hmap->old);
+	}
+	hmap->old = hmap->cur;
+	hmap->cur = fresh;
+	hmap->migrate_pos = 0;
+	return 0;
+}
+
+void* initialize_map() {
 	struct hash_map *new_map;
-	struct hash_map *hmap = (struct hash_map *)map;
-	struct hash_entry *entry_ptr;
-	int idx, new_bucket_count = hmap->num_buckets * 2;
 
 	if((new_map = malloc(sizeof(struct hash_map))) == NULL) {
-		return;
+		return NULL;
 	}
 
-	if((new_map->buckets = calloc(new_bucket_count, sizeof(struct bucket))) == NULL) {
+	new_map->size = 0;
+	new_map->old.ctrl = NULL;
+	new_map->seed = hash_new_seed();
+	if(alloc_table(&new_map->cur, DEFAULT_CAPACITY) == -1) {
 		free(new_map);
-		return;
+		return NULL;
 	}
 
-	new_map->num_buckets = new_bucket_count;
+	return (void*)new_map;
+}
 
-	// Iterate over map and re-insert to new map.
-	for(idx = 0; idx < hmap->num_buckets; ++idx) {
-		entry_ptr = hmap->buckets[idx].head;
-		while(entry_ptr != NULL) {
-			map_put(new_map, entry_ptr->key, entry_ptr->data);
-			entry_ptr = entry_ptr->next_entry;
+/* Free the map, handing every stored data pointer to free_data first
+ * (if given).
+ */
+void map_destroy(void *map, void (*free_data)(void *)) {
+	struct hash_map *hmap = (struct hash_map *)map;
+	struct table *tables[2] = { &hmap->cur, &hmap->old };
+	size_t idx;
+	int t;
+
+	for(t = 0; t < 2; ++t) {
+		if(tables[t]->ctrl == NULL)
+			continue;
+		for(idx = 0; idx < tables[t]->capacity; ++idx) {
+			if(tables[t]->ctrl[idx] < 0)
+				continue;
+			if(tables[t]->slots[idx].key_len >= INLINE_KEY_SIZE)
+				free(tables[t]->slots[idx].key.heap_key);
+			if(free_data)
+				free_data(tables[t]->slots[idx].data);
 		}
+		free(tables[t]->ctrl);
+		free(tables[t]->slots);
 	}
-    free(hmap->buckets);
 	free(hmap);
-
-	map = (void*)new_map;
 }
 
 int map_put(void *map, char *key, void* data) {
-	unsigned long hash_value;
-	struct hash_map *hmap;
-	struct bucket *insert_bucket;
-	struct hash_entry *new_entry;
+	return map_put_n(map, key, strlen(key), data);
+}
+
+/* Inserts key, or replaces the data stored under it. The key bytes are
+ * copied (and NUL terminated) into the map.
+ */
+int map_put_n(void *map, const char *key, size_t len, void *data) {
+	struct hash_map *hmap = (struct hash_map *)map;
+	struct table *in;
+	char *heap_key = NULL;
+	uint64_t hash;
+	ssize_t found;
+	struct slot *s;
 
 	assert(map != NULL);
 	assert(key != NULL);
 
-	if((new_entry = malloc(sizeof(struct hash_entry))) == NULL)
-		return -1;
-
-	new_entry->key = strdup(key);
-	new_entry->data = data;
-	new_entry->next_entry = NULL;
+	migrate(hmap, MIGRATE_GROUPS);
 
-	hmap = (struct hash_map *)map;
-	hash_value = djb2_hash(key);
+	hash = hash_bytes(hmap->seed, key, len);
 
-	insert_bucket = &hmap->buckets[(hash_value % hmap->num_buckets)];
-	if(insert_bucket->num_entries == 0) {
-		insert_bucket->head = new_entry;
-		insert_bucket->tail = new_entry;
-	} else {
-		insert_bucket->tail->next_entry = new_entry;
+	if((found = lookup(hmap, key, len, hash, &in)) != -1) {
+		in->slots[found].data = data;
+		return 0;
 	}
-	insert_bucket->num_entries++;
 
-	if(insert_bucket->num_entries > BUCKET_LIMIT) {
-		realloc_map(map);
+	if(len >= INLINE_KEY_SIZE) {
+		if((heap_key = malloc(len + 1)) == NULL)
+			return -1;
+		memcpy(heap_key, key, len);
+		heap_key[len] = '\0';
+	}
+	if(hmap->cur.growth_left == 0 && start_resize(hmap) == -1) {
+		free(heap_key);
+		return -1;
 	}
 
+	s = &hmap->cur.slots[claim_free(&hmap->cur, hash)];
+	if(heap_key) {
+		s->key.heap_key = heap_key;
+	} else {
+		memcpy(s->key.inline_key, key, len);
+		s->key.inline_key[len] = '\0';
+	}
+	s->hash = hash;
+	s->key_len = len;
+	s->data = data;
+	hmap->size++;
 	return 0;
 }
 
 void *map_get(void *map, char *key) {
-	unsigned long hash_value;
-	struct hash_map *hmap;
-	struct bucket *search_bucket;
-	struct hash_entry *entry_ptr;
+	return map_get_n(map, key, strlen(key));
+}
+
+void *map_get_n(void *map, const char *key, size_t len) {
+	struct hash_map *hmap = (struct hash_map *)map;
+	struct table *in;
+	ssize_t found;
 
 	assert(map != NULL);
 	assert(key != NULL);
 
-	hmap = (struct hash_map *)map;
-	hash_value = djb2_hash(key);
-
-	search_bucket = &hmap->buckets[(hash_value % hmap->num_buckets)];
-	entry_ptr = search_bucket->head;
-
-	while(entry_ptr != NULL && strcmp(key, entry_ptr->key) != 0){
-		entry_ptr = entry_ptr->next_entry;
-	}
-
-	if(entry_ptr == NULL)
+	if((found = lookup(hmap, key, len, hash_bytes(hmap->seed, key, len), &in)) == -1)
 		return NULL;
 
-	return entry_ptr->data;
+	return in->slots[found].data;
 }
 
 void *map_remove(void *map, char *key) {
-	// Just like a get, but we remove the entry
-	// Could probably have better code reuse but f-it
-	unsigned long hash_value;
-	struct hash_map *hmap;
-	struct bucket *search_bucket;
-	struct hash_entry *entry_ptr, *prev_ptr;
-	void *retdata;
+	return map_remove_n(map, key, strlen(key));
+}
+
+void *map_remove_n(void *map, const char *key, size_t len) {
+	struct hash_map *hmap = (struct hash_map *)map;
+	struct table *in;
+	ssize_t found;
+	size_t group;
+	struct slot *s;
 
 	assert(map != NULL);
 	assert(key != NULL);
 
-	hmap = (struct hash_map *)map;
-	hash_value = djb2_hash(key);
-
-	search_bucket = &hmap->buckets[(hash_value % hmap->num_buckets)];
-	prev_ptr = entry_ptr = search_bucket->head;
-
-	while(entry_ptr != NULL && strcmp(key, entry_ptr->key) != 0){
-		prev_ptr = entry_ptr;
-		entry_ptr = entry_ptr->next_entry;
-	}
+	migrate(hmap, MIGRATE_GROUPS);
 
-	if(entry_ptr == NULL)
+	if((found = lookup(hmap, key, len, hash_bytes(hmap->seed, key, len), &in)) == -1)
 		return NULL;
 
-	if(search_bucket->num_entries == 1) {
-		// We're removing head & tail
-		search_bucket->head = NULL;
-		search_bucket->tail = NULL;
-	} else if (prev_ptr == entry_ptr) {
-		// We're removing the head
-		search_bucket->head = entry_ptr->next_entry; // guaranteed to be non-NULL from prev if
+	s = &in->slots[found];
+	if(s->key_len >= INLINE_KEY_SIZE)
+		free(s->key.heap_key);
+
+	// A group that still has an EMPTY slot has never been full, so no
+	// probe chain runs through it and the slot can go straight back to
+	// EMPTY. Otherwise leave a tombstone so later keys stay reachable.
+	group = found & ~(size_t)(GROUP_WIDTH - 1);
+	if(group_match(in->ctrl + group, CTRL_EMPTY)) {
+		in->ctrl[found] = CTRL_EMPTY;
+		in->growth_left++;
 	} else {
-		// We're removing either middle/tail
-		prev_ptr->next_entry = entry_ptr->next_entry;
-		if (prev_ptr->next_entry == NULL)
-			search_bucket->tail = prev_ptr;
+		in->ctrl[found] = CTRL_DELETED;
 	}
-	search_bucket->num_entries--;
+	hmap->size--;
 
 	// Let the user do with the data as they will.
-	retdata = entry_ptr->data; 
-	free(entry_ptr->key);
-	free(entry_ptr);
-
-	return retdata;
+	return s->data;
 }
-
-
-
-
-
-	
-
@@ -1,9 +1,21 @@
 #ifndef _HASHMAP_H
 #define _HASHMAP_H
+#include <stddef.h>
+#include <stdint.h>
 
 void *initialize_map();
+void map_destroy(void *map, void (*free_data)(void *));
 int map_put(void *map, char *key, void *data);
 void *map_get(void *map, char *key);
 void *map_remove(void *map, char *key);
 
+// Same, but the key is len bytes at key and need not be NUL terminated
+int map_put_n(void *map, const char *key, size_t len, void *data);
+void *map_get_n(void *map, const char *key, size_t len);
+void *map_remove_n(void *map, const char *key, size_t len);
+
+// The map's hash, for structures that want the same properties
+uint64_t hash_new_seed();
+uint64_t hash_bytes(uint64_t seed, const char *key, size_t len);
+
 #endif
@@ -0,0 +1,665 @@
+/* Membership journal and snapshots, see journal.h. Both are in host
+ * byte order.
+ *
+ * The journal is a struct file_header followed by records:
+ *   struct record_header, then name_len bytes of name and data_len of data
+ * The check covers everything in the record after itself, so a record
+ * torn by a crash is caught and the journal is cut back to the last good
+ * one.
+ *
+ * A snapshot is laid out to be mapped and used in place:
+ *   struct snapshot_header
+ *   each group's member keys, back to back
+ *   a directory of struct snapshot_group entries, each followed by the
+ *   group's name, at dir_offset
+ * Startup only walks the directory; a group's keys are read when the
+ * group is first used. (Version 1 snapshots were plain record streams
+ * like the journal and are still replayed.)
+ *
+ * The journal header carries a generation and a snapshot records the
+ * newest generation it covers all of. Compaction copies the state out
+ * while the journal is at generation G, and commits carry on appending
+ * to it while the copy is written. The snapshot therefore only claims
+ * G - 1, so after a crash before the journal is swapped the whole of
+ * journal G is replayed on top of it, which events being idempotent
+ * makes exact. Once the snapshot is in place, journal G is replaced by
+ * one of generation G + 1 holding just what was committed since the
+ * copy.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "journal.h"
+#include "hashmap.h"
+
+#define JOURNAL_MAGIC 0x4a4b4d53 // "SMKJ"
+#define SNAPSHOT_MAGIC 0x534b4d53 // "SMKS"
+#define JOURNAL_VERSION 1
+#define SNAPSHOT_VERSION 2
+#define COMPACT_MIN_SIZE (1 << 20) // Never compact a journal smaller than this
+#define COMPACT_RATIO 2 // ...or one less than this many times the snapshot
+#define DEFAULT_PENDING_SIZE 4096
+
+struct file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t generation;
+};
+
+struct record_header {
+	uint32_t len;	// bytes after check
+	uint32_t check;
+	uint8_t op;
+	uint8_t name_len;
+	uint16_t data_len;
+};
+
+struct snapshot_header {
+	struct file_header file;
+	uint64_t dir_offset;
+	uint32_t group_count;
+	uint32_t reserved;
+};
+
+struct snapshot_group {
+	uint64_t keys_offset;
+	uint32_t count;
+	uint16_t key_size;
+	uint8_t name_len;
+	uint8_t reserved;
+};
+
+#define RECORD_CHECK_OFFSET offsetof(struct record_header, op)
+#define RECORD_CHECKED_SIZE (sizeof(struct record_header) - RECORD_CHECK_OFFSET)
+
+/* The snapshot is built up in memory while the dump callback runs, so
+ * whatever locks it takes are not held across the write and fsync.
+ */
+struct journal_dump {
+	char *data;
+	size_t size;
+	size_t cap;
+	int error;
+	// The directory goes after the keys, once they are all in
+	char *dir;
+	size_t dir_len;
+	size_t dir_cap;
+	size_t cur;	// offset in dir of the group being written
+	uint32_t group_count;
+};
+
+static char *dir_path = NULL;
+static char *journal_path = NULL;
+static char *snapshot_path = NULL;
+static journal_dump_t dump_fn = NULL;
+static int journal_ready = 0; // set once replay is over
+
+// The mapped snapshot stays until every group has let go of its keys
+static void *snapshot_addr = NULL;
+static size_t snapshot_mapped = 0;
+static atomic_uint snapshot_refs;
+
+// The file side, owned by whoever holds commit_lock
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static uint64_t generation = 0;
+static off_t journal_size = 0;
+static off_t snapshot_size = 0;
+static char *writing = NULL;
+static size_t writing_cap = 0;
+// While a snapshot is written in the background: what has been committed
+// since its copy was taken, for the journal that replaces this one
+static int compacting = 0;
+static char *tail = NULL;
+static size_t tail_len = 0;
+static size_t tail_cap = 0;
+static int tail_error = 0;
+
+// Events appended since the last commit. Swapped with writing on commit
+// so appends never wait on the disk.
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *path;
+
+	if((path = malloc(strlen(dir) + strlen(name) + 2)) != NULL)
+		sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/* Make room for need bytes in a buffer that grows by doubling */
+static int reserve(char **buf, size_t *cap, size_t need)
+{
+	size_t new_cap = *cap ? *cap : DEFAULT_PENDING_SIZE;
+	char *new_buf;
+
+	if(need <= *cap)
+		return 0;
+	while(new_cap < need)
+		new_cap *= 2;
+	if((new_buf = realloc(*buf, new_cap)) == NULL)
+		return -1;
+	*buf = new_buf;
+	*cap = new_cap;
+	return 0;
+}
+
+/* Records are packed back to back, so headers go through memcpy */
+static size_t encode_record(const struct journal_event *ev, char *out)
+{
+	struct record_header hdr;
+	char *body = out + sizeof(struct record_header);
+
+	hdr.len = RECORD_CHECKED_SIZE + ev->name_len + ev->data_len;
+	hdr.op = ev->op;
+	hdr.name_len = ev->name_len;
+	hdr.data_len = ev->data_len;
+	memcpy(out, &hdr, sizeof(hdr));
+	memcpy(body, ev->name, ev->name_len);
+	if(ev->data_len)
+		memcpy(body + ev->name_len, ev->data, ev->data_len);
+	hdr.check = hash_bytes(0, out + RECORD_CHECK_OFFSET, hdr.len);
+	memcpy(out + offsetof(struct record_header, check), &hdr.check, sizeof(hdr.check));
+	return RECORD_CHECK_OFFSET + hdr.len;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while(len) {
+		if((ret = write(fd, buf, len)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int sync_dir()
+{
+	int fd, ret;
+
+	if((fd = open(dir_path, O_RDONLY | O_DIRECTORY)) == -1)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/* Feed every intact record of a mapped file to apply. Returns the
+ * offset just past the last one.
+ */
+static size_t replay_records(const char *base, size_t size, journal_apply_t apply)
+{
+	struct record_header hdr;
+	struct journal_event ev;
+	size_t off = sizeof(struct file_header);
+
+	while(size - off >= sizeof(struct record_header)) {
+		memcpy(&hdr, base + off, sizeof(hdr));
+		if(hdr.len > size - off - RECORD_CHECK_OFFSET ||
+		   hdr.len != RECORD_CHECKED_SIZE + hdr.name_len + hdr.data_len ||
+		   (uint32_t)hash_bytes(0, base + off + RECORD_CHECK_OFFSET, hdr.len) != hdr.check)
+			break;
+
+		ev.op = hdr.op;
+		ev.name_len = hdr.name_len;
+		ev.data_len = hdr.data_len;
+		ev.name = base + off + sizeof(hdr);
+		ev.data = ev.name + ev.name_len;
+		apply(&ev);
+		off += RECORD_CHECK_OFFSET + hdr.len;
+	}
+	return off;
+}
+
+/* Replay the file at path if it starts with magic. Returns the offset
+ * of its valid end (0 if the file is missing or empty) or -1 if it is
+ * not one of ours.
+ */
+static off_t replay_file(const char *path, uint32_t magic, uint64_t *gen, journal_apply_t apply)
+{
+	struct file_header *hdr;
+	struct stat statb;
+	off_t end = -1;
+	void *addr;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if(fstat(fd, &statb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if(statb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	if((size_t)statb.st_size < sizeof(struct file_header)) {
+		close(fd);
+		return -1;
+	}
+
+	// Only read, and gone again once replayed
+	if((addr = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		hdr = addr;
+		if(hdr->magic == magic && hdr->version == JOURNAL_VERSION) {
+			*gen = hdr->generation;
+			end = apply ? (off_t)replay_records(addr, statb.st_size, apply) : statb.st_size;
+		}
+		munmap(addr, statb.st_size);
+	}
+	close(fd);
+	return end;
+}
+
+/* Atomically replace the journal with one of generation gen holding the
+ * len bytes of records at data
+ */
+static int reset_journal(uint64_t gen, const char *data, size_t len)
+{
+	struct file_header hdr = { JOURNAL_MAGIC, JOURNAL_VERSION, 0, gen };
+	char *tmp_path;
+	int fd;
+
+	if((tmp_path = join_path(dir_path, "journal.tmp")) == NULL)
+		return -1;
+	if((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1) {
+		free(tmp_path);
+		return -1;
+	}
+	if(write_all(fd, (char *)&hdr, sizeof(hdr)) == -1 || write_all(fd, data, len) == -1 ||
+	   fdatasync(fd) == -1 ||
+	   rename(tmp_path, journal_path) == -1 || sync_dir() == -1) {
+		close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+
+	if(journal_fd != -1)
+		close(journal_fd);
+	journal_fd = fd;
+	journal_size = sizeof(hdr) + len;
+	generation = gen;
+	return 0;
+}
+
+static int dump_write(struct journal_dump *dump, const void *buf, size_t len)
+{
+	if(reserve(&dump->data, &dump->cap, dump->size + len) == -1) {
+		dump->error = 1;
+		return -1;
+	}
+	memcpy(dump->data + dump->size, buf, len);
+	dump->size += len;
+	return 0;
+}
+
+int journal_dump_group(struct journal_dump *dump, const char *name, size_t name_len, size_t key_size)
+{
+	struct snapshot_group entry;
+	size_t need = sizeof(entry) + name_len;
+
+	if(name_len > 255 || key_size > UINT16_MAX)
+		return -1;
+	if(reserve(&dump->dir, &dump->dir_cap, dump->dir_len + need) == -1) {
+		dump->error = 1;
+		return -1;
+	}
+
+	entry.keys_offset = dump->size;
+	entry.count = 0;
+	entry.key_size = key_size;
+	entry.name_len = name_len;
+	entry.reserved = 0;
+	dump->cur = dump->dir_len;
+	memcpy(dump->dir + dump->dir_len, &entry, sizeof(entry));
+	memcpy(dump->dir + dump->dir_len + sizeof(entry), name, name_len);
+	dump->dir_len += need;
+	dump->group_count++;
+	return 0;
+}
+
+int journal_dump_members(struct journal_dump *dump, const void *keys, uint32_t count)
+{
+	struct snapshot_group entry;
+
+	memcpy(&entry, dump->dir + dump->cur, sizeof(entry));
+	if(dump_write(dump, keys, (size_t)count * entry.key_size) == -1)
+		return -1;
+	entry.count += count;
+	memcpy(dump->dir + dump->cur, &entry, sizeof(entry));
+	return 0;
+}
+
+static int write_snapshot(const char *data, size_t size)
+{
+	char *tmp_path;
+	int fd, ret = -1;
+
+	if((tmp_path = join_path(dir_path, "snapshot.tmp")) == NULL)
+		return -1;
+	if((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) != -1) {
+		if(write_all(fd, data, size) == 0 && fsync(fd) == 0 &&
+		   rename(tmp_path, snapshot_path) == 0 && sync_dir() == 0)
+			ret = 0;
+		else
+			unlink(tmp_path);
+		close(fd);
+	}
+	free(tmp_path);
+	return ret;
+}
+
+/* Write the copy out and, once it is in place, swap in the journal that
+ * follows it. Only the swap, which writes no more than was committed
+ * meanwhile, holds up commits.
+ */
+static void *compact_thread(void *arg)
+{
+	struct journal_dump *dump = arg;
+	int ret = write_snapshot(dump->data, dump->size);
+
+	pthread_mutex_lock(&commit_lock);
+	if(ret == 0 && !tail_error)
+		ret = reset_journal(generation + 1, tail, tail_len);
+	if(ret == 0 && !tail_error) {
+		snapshot_size = dump->size;
+	} else {
+		// Journal G stays as it was and still has everything
+		perror("journal compaction");
+		snapshot_size = journal_size; // back off rather than retrying at once
+	}
+	compacting = 0;
+	tail_len = 0;
+	tail_error = 0;
+	pthread_mutex_unlock(&commit_lock);
+
+	free(dump->data);
+	free(dump);
+	return NULL;
+}
+
+/* Copy the whole state out for a snapshot superseding the current
+ * journal and have it written in the background. Called with
+ * commit_lock held, which is all the dump callback needs to see a state
+ * no commit is halfway into; events appended meanwhile stay pending.
+ */
+static int compact()
+{
+	struct snapshot_header hdr = { { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, generation - 1 }, 0, 0, 0 };
+	struct journal_dump *dump;
+	pthread_t tid;
+
+	if((dump = calloc(1, sizeof(*dump))) == NULL)
+		return -1;
+	// The header is filled in once the directory's place is known
+	if(dump_write(dump, &hdr, sizeof(hdr)) == -1 || dump_fn(dump) == -1 || dump->error)
+		goto fail;
+	hdr.dir_offset = dump->size;
+	hdr.group_count = dump->group_count;
+	if(dump_write(dump, dump->dir, dump->dir_len) == -1)
+		goto fail;
+	memcpy(dump->data, &hdr, sizeof(hdr));
+	free(dump->dir);
+	dump->dir = NULL;
+
+	compacting = 1;
+	if(pthread_create(&tid, NULL, compact_thread, dump) != 0) {
+		compacting = 0;
+		goto fail;
+	}
+	pthread_detach(tid);
+	return 0;
+fail:
+	free(dump->data);
+	free(dump->dir);
+	free(dump);
+	return -1;
+}
+
+void journal_snapshot_put()
+{
+	if(atomic_fetch_sub_explicit(&snapshot_refs, 1, memory_order_acq_rel) == 1) {
+		munmap(snapshot_addr, snapshot_mapped);
+		snapshot_addr = NULL;
+	}
+}
+
+/* Hand every group in the mapped snapshot to load. Each one holds a
+ * reference on the mapping until it calls journal_snapshot_put, which
+ * may be before load returns.
+ */
+static int load_groups(const char *base, size_t size, journal_load_t load)
+{
+	struct snapshot_header hdr;
+	struct snapshot_group entry;
+	size_t off, idx;
+
+	if(size < sizeof(hdr))
+		return -1;
+	memcpy(&hdr, base, sizeof(hdr));
+	if(hdr.dir_offset < sizeof(hdr) || hdr.dir_offset > size)
+		return -1;
+
+	// Check the whole directory before anyone gets a pointer into it
+	for(idx = 0, off = hdr.dir_offset; idx < hdr.group_count; ++idx) {
+		if(size - off < sizeof(entry))
+			return -1;
+		memcpy(&entry, base + off, sizeof(entry));
+		if(size - off - sizeof(entry) < entry.name_len || entry.keys_offset > hdr.dir_offset ||
+		   (uint64_t)entry.count * entry.key_size > hdr.dir_offset - entry.keys_offset)
+			return -1;
+		off += sizeof(entry) + entry.name_len;
+	}
+
+	atomic_fetch_add(&snapshot_refs, hdr.group_count);
+	for(idx = 0, off = hdr.dir_offset; idx < hdr.group_count; ++idx) {
+		memcpy(&entry, base + off, sizeof(entry));
+		load(base + off + sizeof(entry), entry.name_len,
+			base + entry.keys_offset, entry.key_size, entry.count);
+		off += sizeof(entry) + entry.name_len;
+	}
+	return 0;
+}
+
+/* Map the snapshot and register its groups. Returns its size (0 if there
+ * is none) or -1 if it cannot be used.
+ */
+static off_t load_snapshot(uint64_t *gen, journal_apply_t apply, journal_load_t load)
+{
+	struct file_header hdr;
+	struct stat statb;
+	void *addr;
+	int fd, ret;
+
+	if((fd = open(snapshot_path, O_RDONLY)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if(fstat(fd, &statb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if(statb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	if((size_t)statb.st_size < sizeof(hdr) ||
+	   (addr = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	memcpy(&hdr, addr, sizeof(hdr));
+	if(hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+		munmap(addr, statb.st_size);
+		return replay_file(snapshot_path, SNAPSHOT_MAGIC, gen, apply);
+	}
+
+	// Our own reference keeps it mapped while groups come and let go;
+	// whoever drops the last one unmaps it
+	snapshot_addr = addr;
+	snapshot_mapped = statb.st_size;
+	atomic_init(&snapshot_refs, 1);
+	ret = load_groups(addr, statb.st_size, load);
+	journal_snapshot_put();
+	if(ret == -1)
+		return -1;
+	*gen = hdr.generation;
+	return statb.st_size;
+}
+
+int journal_open(const char *dir, journal_apply_t apply, journal_load_t load, journal_dump_t dump)
+{
+	uint64_t snap_gen = 0, gen = 0;
+	off_t end;
+	int ret;
+
+	if((dir_path = strdup(dir)) == NULL ||
+	   (journal_path = join_path(dir, "journal")) == NULL ||
+	   (snapshot_path = join_path(dir, "snapshot")) == NULL)
+		return -1;
+	dump_fn = dump;
+
+	if((snapshot_size = load_snapshot(&snap_gen, apply, load)) == -1)
+		return -1;
+
+	// A journal no newer than the snapshot is already part of it
+	if((end = replay_file(journal_path, JOURNAL_MAGIC, &gen, NULL)) == -1)
+		return -1;
+	if(end == 0 || gen <= snap_gen) {
+		ret = reset_journal(snap_gen + 1, NULL, 0);
+	} else {
+		end = replay_file(journal_path, JOURNAL_MAGIC, &gen, apply);
+		if((journal_fd = open(journal_path, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1)
+			return -1;
+		// Cut off a record torn by a crash so appends follow the good ones
+		ret = ftruncate(journal_fd, end);
+		journal_size = end;
+		generation = gen;
+	}
+	journal_ready = ret == 0;
+	return ret;
+}
+
+static const char *const file_names[] = { "journal", "journal.tmp", "snapshot", "snapshot.tmp" };
+
+void journal_discard(const char *dir)
+{
+	char *path;
+	size_t idx;
+
+	for(idx = 0; idx < sizeof(file_names) / sizeof(file_names[0]); ++idx) {
+		if((path = join_path(dir, file_names[idx])) != NULL) {
+			unlink(path);
+			free(path);
+		}
+	}
+}
+
+int journal_file(const char *name)
+{
+	size_t idx;
+
+	for(idx = 0; idx < sizeof(file_names) / sizeof(file_names[0]); ++idx) {
+		if(strcmp(name, file_names[idx]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Events are only buffered here; nothing is durable until the next
+ * journal_commit. A no-op until the journal is open, so replaying does
+ * not log its own events again.
+ */
+int journal_append(const struct journal_event *ev)
+{
+	size_t need = sizeof(struct record_header) + ev->name_len + ev->data_len;
+	int ret = 0;
+
+	if(!journal_ready)
+		return 0;
+
+	pthread_mutex_lock(&pending_lock);
+	if((ret = reserve(&pending, &pending_cap, pending_len + need)) == 0)
+		pending_len += encode_record(ev, pending + pending_len);
+	pthread_mutex_unlock(&pending_lock);
+	return ret;
+}
+
+/* Make every event appended so far durable with one write and one
+ * fdatasync. Reactors that commit at the same time queue up on
+ * commit_lock and the later ones usually find nothing left to do. A
+ * commit that starts a compaction holds the rest up only while it
+ * copies the state.
+ */
+int journal_commit()
+{
+	size_t len, cap;
+	char *buf;
+	int ret = 0;
+
+	// Most iterations change nothing
+	pthread_mutex_lock(&pending_lock);
+	len = pending_len;
+	pthread_mutex_unlock(&pending_lock);
+	if(len == 0)
+		return 0;
+
+	pthread_mutex_lock(&commit_lock);
+	pthread_mutex_lock(&pending_lock);
+	buf = pending;
+	cap = pending_cap;
+	len = pending_len;
+	pending = writing;
+	pending_cap = writing_cap;
+	pending_len = 0;
+	pthread_mutex_unlock(&pending_lock);
+	writing = buf;
+	writing_cap = cap;
+
+	if(len) {
+		if(write_all(journal_fd, writing, len) == -1 || fdatasync(journal_fd) == -1) {
+			perror("journal");
+			ret = -1;
+		} else {
+			journal_size += len;
+			if(compacting && reserve(&tail, &tail_cap, tail_len + len) == 0) {
+				memcpy(tail + tail_len, writing, len);
+				tail_len += len;
+			} else if(compacting) {
+				tail_error = 1;
+			}
+		}
+	}
+
+	if(ret == 0 && !compacting && journal_size > COMPACT_MIN_SIZE &&
+	   journal_size > COMPACT_RATIO * snapshot_size && compact() == -1) {
+		perror("journal compaction");
+		// Back off rather than retrying on every commit
+		snapshot_size = journal_size;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+/* Append-only log of membership changes plus a snapshot to start from.
+ *
+ * journal_append only buffers an event in memory. journal_commit writes
+ * out everything buffered since the last commit with one write and one
+ * fdatasync (group commit), and is meant to run once per reactor
+ * iteration. Once the journal has grown well past the last snapshot, a
+ * commit also starts a compaction: the dump callback copies the whole
+ * state out through journal_dump_group/members, which holds up every
+ * reactor's commit while it runs. A background thread then writes the
+ * copy as a new snapshot while commits carry on, and the journal starts
+ * over with what they committed meanwhile.
+ *
+ * The snapshot is mapped at startup and each group in it handed to the
+ * load callback with a pointer to its member keys in the mapping, so
+ * the keys can be indexed lazily. The pointer stays good until that
+ * group calls journal_snapshot_put.
+ *
+ * Events are idempotent (creating an existing group or leaving twice
+ * does nothing), so a snapshot taken while changes are still coming in
+ * is made exact by replaying the journal on top of it.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_CREATE 1 // name
+#define JOURNAL_DELETE 2 // name
+#define JOURNAL_JOIN 3 // name, member key
+#define JOURNAL_LEAVE 4 // name, member key
+
+struct journal_event {
+	uint8_t op;
+	uint8_t name_len;
+	uint16_t data_len;
+	const char *name;
+	const void *data;
+};
+
+struct journal_dump;
+
+typedef void (*journal_apply_t)(const struct journal_event *ev);
+typedef void (*journal_load_t)(const char *name, size_t name_len,
+	const void *keys, size_t key_size, uint32_t count);
+typedef int (*journal_dump_t)(struct journal_dump *dump);
+
+/* Loads the snapshot in dir, replays the journal after it through apply
+ * and opens the journal for appending. A torn record at the tail is cut
+ * off.
+ */
+int journal_open(const char *dir, journal_apply_t apply, journal_load_t load, journal_dump_t dump);
+void journal_snapshot_put();
+// Removes the snapshot and journal in dir
+void journal_discard(const char *dir);
+// Whether name is one of the files the journal keeps in its dir
+int journal_file(const char *name);
+
+int journal_append(const struct journal_event *ev);
+int journal_commit();
+
+// For the dump callback: start a group, then write its member keys
+int journal_dump_group(struct journal_dump *dump, const char *name, size_t name_len, size_t key_size);
+int journal_dump_members(struct journal_dump *dump, const void *keys, uint32_t count);
+
+#endif /* _JOURNAL_H */
@@ -14,7 +14,11 @@
 /* GLEN < 256, MSGLEN < 65kb etc */
 /* Message Types */
 /*  1  |  1 |    N    |  2   |           N         BYTES*/
-/* TYPE|GLEN|GROUPNAME|STRLEN|(IP/CDN):PORT string */
+/* TYPE|GLEN|GROUPNAME|STRLEN|IP:PORT string */
+/* IP is a literal address, a.b.c.d or [v6]; host names do not fit a
+ * member record, and a JOINGROUP naming one is answered with
+ * REQUEST_FAILED, as is one the server could not carry out.
+ */
 #define JOINGROUP 1
 #define LEAVEGROUP 2
 #define HEALTHCHECK 3
@@ -27,6 +31,69 @@
 /* TYPE|GLEN|GROUPNAME */
 #define SUBGROUP 5
 #define UNSUBGROUP 6
-#define LISTMEMBERS 7
+#define LISTMEMBERS 7 // Answered with a JOINGROUP-shaped frame whose string is the member list (see LISTMEMBERS_PART)
+
+/* Batched heartbeats. Either one member in many groups, the member
+ * taking the group name's place and the groups listed after it each
+ * with its own length byte:
+ */
+/*  1  |  1 |    N    |   2   |         N            BYTES*/
+/* TYPE|MLEN|IP:PORT  |LISTLEN|(GLEN|GROUPNAME)...         */
+#define HEALTHCHECK_GROUPS 8
+/* or many members of one group, listed like a LISTMEMBERS reply: */
+/*  1  |  1 |    N    |  2   |           N           BYTES*/
+/* TYPE|GLEN|GROUPNAME|STRLEN|ip:port,ip:port,...         */
+#define HEALTHCHECK_MEMBERS 9
+
+/* With broadcast retention on, broadcasts are numbered per group (from
+ * 1) and a subscriber can catch up on what it missed. Only sockets that
+ * subscribed with SUBGROUP_FROM get them numbered; SUBGROUP and pattern
+ * subscribers keep getting BROADCAST. Subscribing to the same group
+ * again, either way, switches between the two.
+ */
+/*  1  |  1 |    N    |  8  |  2   |      N          BYTES*/
+/* TYPE|GLEN|GROUPNAME| SEQ |MSGLEN|MSG(untouched) */
+#define BROADCAST_SEQ 10
+/* Subscribe, first replaying the retained broadcasts numbered SEQ on */
+/*  1  |  1 |    N    | 2 (8)|  8        BYTES*/
+/* TYPE|GLEN|GROUPNAME|STRLEN| SEQ */
+#define SUBGROUP_FROM 11
+
+/* Watch mode: subscribe and have membership changes pushed rather than
+ * polling LISTMEMBERS. The generation goes up by exactly one with every
+ * change, so a watcher that sees it skip knows it missed something.
+ */
+/*  1  |  1 |   N      */
+/* TYPE|GLEN|GROUPNAME */
+#define SUBGROUP_WATCH 12
+/* Answers SUBGROUP_WATCH with the members as of generation GEN, or with
+ * REQUEST_FAILED if the group cannot be watched
+ */
+/*  1  |  1 |    N    |  8  |  2   |       N             BYTES*/
+/* TYPE|GLEN|GROUPNAME| GEN |STRLEN|ip:port,ip:port,...       */
+#define MEMBERS_AT 13
+/* One join or leave (OP is JOINGROUP or LEAVEGROUP), GEN after it */
+/*  1  |  1 |    N    |  8  | 1  |  2   |    N     BYTES*/
+/* TYPE|GLEN|GROUPNAME| GEN | OP |STRLEN|ip:port */
+#define MEMBER_DELTA 14
+
+/* Sent back when a request that is otherwise not answered was refused.
+ * REQTYPE is the refused request's type, REASON is for humans.
+ */
+/*  1  |  1 |    N    |  2   |   1   |   N     BYTES*/
+/* TYPE|GLEN|GROUPNAME|STRLEN|REQTYPE|REASON */
+#define REQUEST_FAILED 15
+
+/* A member list longer than the 65535 bytes one STRLEN can carry is
+ * answered with as many of these as it takes, each framed like the
+ * reply and ending on a member's comma, and then the usual LISTMEMBERS
+ * reply with the rest. Nothing else is sent in between.
+ */
+#define LISTMEMBERS_PART 16
+/* The same for MEMBERS_AT: a long list comes as MEMBERS_AT_PART frames,
+ * framed like MEMBERS_AT and all with its GEN, then a MEMBERS_AT. No
+ * MEMBER_DELTA comes before the last of them.
+ */
+#define MEMBERS_AT_PART 17
 
 #endif /* _MSGPROTO_H */
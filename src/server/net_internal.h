@@ -0,0 +1,114 @@
+#ifndef _NET_INTERNAL_H
+#define _NET_INTERNAL_H
+/* State shared between the reactor backends in networking.c (epoll)
+ * and net_uring.c (io_uring). Nothing outside the networking layer
+ * should include this.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "networking.h"
+
+#define MAX_EVENTS 1024 // Max pending events to handle per epoll_wait call
+#define RECV_BUF_SIZE 16384 // Initial per-connection receive buffer
+#define FRAME_HDR_SIZE (2 * sizeof(uint32_t)) // SMOKEMAGIC + length
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+#define MAX_IOV 64 // Queued frames gathered per writev
+
+typedef void (*event_callback_t)(int, uint32_t, void*);
+
+struct fd_data {
+	int fd;
+	void *context; // State maintained by cb if needed
+	event_callback_t cb_func;
+	struct fd_data *next_free; // Slab free list link
+};
+
+struct uring;
+
+// One event loop and listener per reactor thread. A connection stays
+// on the reactor that accepted it for its whole life.
+struct reactor {
+	int epollfd;
+	int listenfd;
+	pthread_t thread;
+	struct epoll_event events[MAX_EVENTS];
+	struct fd_data *listen_data;
+	int timerfd; // reactor 0 only, when there is an on_timer
+	struct uring *uring; // non-NULL when running the io_uring backend
+};
+
+// Per-connection receive buffer. Bytes are pulled in with large recv
+// calls and every complete frame is handed to the handler as a view
+// into buf; only a trailing partial frame is kept (compacted to the
+// front) across events.
+struct recv_buffer {
+	char *buf;
+	size_t cap;
+	size_t start;	// first unparsed byte
+	size_t end;	// one past the last received byte
+};
+
+// A reference to a (possibly shared) frame waiting for the socket
+// to become writable
+struct out_ref {
+	struct net_buf *buf;
+	size_t off;	// bytes of buf already written
+};
+
+/* A client connection, kept in fd_data->context. Any reactor may queue
+ * output on it, so the write side is guarded by wlock and the struct is
+ * refcounted; only the owning reactor reads from it or closes it.
+ */
+struct conn {
+	struct fd_data *fdata;
+	struct reactor *reactor;
+	struct recv_buffer rb;
+	atomic_int refs;
+
+	pthread_mutex_t wlock;
+	struct out_ref *out_q;	// circular, out_cap is a power of two
+	unsigned int out_cap;
+	unsigned int out_head;
+	unsigned int out_count;
+	size_t out_bytes;
+	int closed;
+	int write_error;
+	int epollout_armed;
+	int read_paused;	// out_bytes went over high_watermark
+
+	// io_uring backend only
+	int recv_armed;		// multishot recv outstanding
+	int recv_cancelled;	// ...but cancelled while reading is paused
+	int send_inflight;	// writev SQE outstanding, iov below in use
+	int send_iovcnt;	// ...covering this many queue entries
+	int flush_pending;	// on the reactor's flush list
+	struct conn *flush_next;
+	struct iovec send_iov[MAX_IOV];
+};
+
+extern size_t low_watermark;
+extern iteration_handler_t iteration_handler;
+extern timer_handler_t timer_handler;
+
+struct fd_data *alloc_fd_data();
+void free_fd_data(struct fd_data *fdata);
+struct conn *add_connection(struct reactor *r, int client_fd);
+void release_conn(struct conn *c);
+void clean_up_sock(struct conn *c);
+int conn_input(struct conn *c, const char *data, size_t len, int paused);
+int parse_frames(struct conn *c);
+int fill_out_iov(struct conn *c, struct iovec *iov, int max_iov);
+void consume_out_queue(struct conn *c, size_t nbytes);
+
+int uring_init_reactor(struct reactor *r);
+void *uring_reactor_loop(void *arg);
+void uring_schedule_flush(struct conn *c);
+int uring_arm_timer(struct reactor *r);
+void uring_close_reactor(struct reactor *r);
+
+#endif /* _NET_INTERNAL_H */
@@ -0,0 +1,621 @@
+/* io_uring reactor backend. Each reactor gets its own ring with a
+ * multishot accept on its SO_REUSEPORT listener, a multishot recv per
+ * connection fed from a provided-buffer ring, and one writev SQE per
+ * connection with queued output. Sends queued while handling a batch of
+ * completions go out together in the next io_uring_enter, so a broadcast
+ * fan-out costs one syscall rather than one per subscriber.
+ *
+ * Talks to the kernel directly rather than through liburing. When ring
+ * setup fails or the kernel predates multishot recv (io_uring disabled,
+ * anything before 6.0) init_reactor falls back to the epoll loop in
+ * networking.c.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "net_internal.h"
+
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 1024 // Provided receive buffers per reactor, power of two
+#define URING_BUF_SIZE 16384
+#define URING_BGID 0
+
+// user_data is a conn pointer (or NULL) with the request kind in the
+// low bits
+#define TAG_ACCEPT 1
+#define TAG_RECV 2
+#define TAG_SEND 3
+#define TAG_WAKE 4
+#define TAG_CANCEL 5
+#define TAG_TIMER 6
+#define TAG_MASK 7
+
+struct uring {
+	int ring_fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local_tail; // SQEs prepared but not yet published
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *buf_ring;
+	char *buf_base;
+	unsigned short buf_tail;
+
+	// Other reactors queue conns here and poke wake_fd
+	int wake_fd;
+	uint64_t wake_val;
+	uint64_t timer_val; // expirations read off the reactor's timerfd
+	pthread_mutex_t flush_lock;
+	struct conn *flush_head;
+};
+
+static __thread struct reactor *current_reactor = NULL;
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Publish prepared SQEs and optionally wait for a completion
+static int
+uring_submit(struct uring *u, unsigned wait)
+{
+	unsigned to_submit;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	do {
+		// Anything the kernel has not consumed yet still counts
+		to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if(to_submit == 0 && wait == 0)
+			return 0;
+		ret = sys_io_uring_enter(u->ring_fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while(ret == -1 && errno == EINTR);
+	return ret;
+}
+
+static struct io_uring_sqe *
+get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if(u->sq_local_tail - head > u->sq_mask) {
+		// Ring full; push what we have to the kernel and retry
+		if(uring_submit(u, 0) == -1)
+			return NULL;
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if(u->sq_local_tail - head > u->sq_mask)
+			return NULL;
+	}
+	sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[u->sq_local_tail & u->sq_mask] = u->sq_local_tail & u->sq_mask;
+	u->sq_local_tail++;
+	return sqe;
+}
+
+static void
+recycle_buffer(struct uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(u->buf_base + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	u->buf_tail++;
+	__atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int
+arm_accept(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = get_sqe(r->uring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = r->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = TAG_ACCEPT;
+	return 0;
+}
+
+static int
+arm_wake(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = get_sqe(u)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = u->wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&u->wake_val;
+	sqe->len = sizeof(u->wake_val);
+	sqe->user_data = TAG_WAKE;
+	return 0;
+}
+
+int
+uring_arm_timer(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = get_sqe(r->uring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->timerfd;
+	sqe->addr = (uint64_t)(uintptr_t)&r->uring->timer_val;
+	sqe->len = sizeof(r->uring->timer_val);
+	sqe->user_data = TAG_TIMER;
+	return 0;
+}
+
+// The outstanding recv holds a conn ref until its final completion
+static int
+arm_recv(struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = get_sqe(c->reactor->uring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fdata->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (uint64_t)(uintptr_t)c | TAG_RECV;
+	atomic_fetch_add(&c->refs, 1);
+	c->recv_armed = 1;
+	c->recv_cancelled = 0;
+	return 0;
+}
+
+static void
+cancel_recv(struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!c->recv_armed || c->recv_cancelled)
+		return;
+	if((sqe = get_sqe(c->reactor->uring)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)c | TAG_RECV;
+	sqe->user_data = TAG_CANCEL;
+	c->recv_cancelled = 1;
+}
+
+/* Called with c->wlock held whenever output was queued. The conn goes on
+ * its reactor's flush list and is turned into a writev SQE before that
+ * reactor next enters the kernel.
+ */
+void
+uring_schedule_flush(struct conn *c)
+{
+	struct uring *u = c->reactor->uring;
+	uint64_t one = 1;
+	int was_empty;
+
+	if(c->flush_pending || c->closed)
+		return;
+	c->flush_pending = 1;
+	atomic_fetch_add(&c->refs, 1);
+
+	pthread_mutex_lock(&u->flush_lock);
+	was_empty = u->flush_head == NULL;
+	c->flush_next = u->flush_head;
+	u->flush_head = c;
+	pthread_mutex_unlock(&u->flush_lock);
+
+	if(was_empty && current_reactor != c->reactor) {
+		if(write(u->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			perror("write: wake_fd");
+	}
+}
+
+// Turn every conn on the flush list into a writev SQE
+static void
+submit_flushes(struct reactor *r)
+{
+	struct uring *u = r->uring;
+	struct io_uring_sqe *sqe;
+	struct conn *c, *next;
+	int iovcnt;
+
+	pthread_mutex_lock(&u->flush_lock);
+	c = u->flush_head;
+	u->flush_head = NULL;
+	pthread_mutex_unlock(&u->flush_lock);
+
+	for(; c != NULL; c = next) {
+		next = c->flush_next;
+		pthread_mutex_lock(&c->wlock);
+		c->flush_pending = 0;
+		if(!c->closed && !c->send_inflight && c->out_count &&
+		   (sqe = get_sqe(u)) != NULL) {
+			iovcnt = fill_out_iov(c, c->send_iov, MAX_IOV);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = c->fdata->fd;
+			sqe->addr = (uint64_t)(uintptr_t)c->send_iov;
+			sqe->len = iovcnt;
+			sqe->user_data = (uint64_t)(uintptr_t)c | TAG_SEND;
+			c->send_inflight = 1;
+			c->send_iovcnt = iovcnt;
+			atomic_fetch_add(&c->refs, 1);
+		}
+		pthread_mutex_unlock(&c->wlock);
+		release_conn(c);
+	}
+}
+
+static void
+handle_accept_cqe(struct reactor *r, struct io_uring_cqe *cqe)
+{
+	struct conn *c;
+
+	if(cqe->res >= 0) {
+		if((c = add_connection(r, cqe->res)) != NULL && arm_recv(c) == -1)
+			clean_up_sock(c);
+	} else if(cqe->res != -EAGAIN && cqe->res != -ECONNABORTED) {
+		fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE) && arm_accept(r) == -1)
+		fprintf(stderr, "Failed to re-arm accept\n");
+}
+
+static void
+handle_recv_cqe(struct conn *c, struct io_uring_cqe *cqe)
+{
+	struct uring *u = c->reactor->uring;
+	int paused, more = cqe->flags & IORING_CQE_F_MORE;
+
+	pthread_mutex_lock(&c->wlock);
+	paused = c->read_paused;
+	pthread_mutex_unlock(&c->wlock);
+
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(!c->closed && cqe->res > 0) {
+			// Stop the flow while replies pile up; whatever was
+			// already in flight is parked in the receive buffer
+			if(paused)
+				cancel_recv(c);
+			if(conn_input(c, u->buf_base + (size_t)bid * URING_BUF_SIZE, cqe->res, paused) == -1)
+				clean_up_sock(c);
+		}
+		recycle_buffer(u, bid);
+	} else if(!c->closed) {
+		if(cqe->res == 0) {
+			// Client closed connection
+			fprintf(stderr, "Client closed connection\n");
+			clean_up_sock(c);
+		} else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+			fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+			clean_up_sock(c);
+		}
+	}
+
+	if(more)
+		return;
+
+	// Multishot recv ended (out of buffers, cancelled or closed)
+	c->recv_armed = 0;
+	if(!c->closed && !(c->recv_cancelled && paused) && arm_recv(c) == -1)
+		clean_up_sock(c);
+	release_conn(c);
+}
+
+static void
+handle_send_cqe(struct conn *c, struct io_uring_cqe *cqe)
+{
+	int resume = 0, failed = 0;
+
+	pthread_mutex_lock(&c->wlock);
+	c->send_inflight = 0;
+	if(!c->closed) {
+		if(cqe->res >= 0) {
+			consume_out_queue(c, cqe->res);
+			if(c->out_count)
+				uring_schedule_flush(c);
+			if(c->read_paused && c->out_bytes <= low_watermark) {
+				c->read_paused = 0;
+				resume = 1;
+			}
+		} else if(cqe->res != -EAGAIN && cqe->res != -EINTR) {
+			c->write_error = 1;
+			failed = 1;
+		} else {
+			uring_schedule_flush(c);
+		}
+	}
+	pthread_mutex_unlock(&c->wlock);
+
+	if(failed) {
+		fprintf(stderr, "writev: %s\n", strerror(-cqe->res));
+		clean_up_sock(c);
+	} else if(resume) {
+		// Deliver what was parked while paused and get the recv going
+		if(parse_frames(c) == -1)
+			clean_up_sock(c);
+		else if(!c->recv_armed && arm_recv(c) == -1)
+			clean_up_sock(c);
+		else
+			c->recv_cancelled = 0;
+	}
+	release_conn(c);
+}
+
+static void
+handle_cqe(struct reactor *r, struct io_uring_cqe *cqe)
+{
+	struct conn *c = (struct conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+
+	switch(cqe->user_data & TAG_MASK) {
+	case TAG_ACCEPT:
+		handle_accept_cqe(r, cqe);
+		break;
+	case TAG_RECV:
+		handle_recv_cqe(c, cqe);
+		break;
+	case TAG_SEND:
+		handle_send_cqe(c, cqe);
+		break;
+	case TAG_WAKE:
+		// Flush list is drained at the top of the loop
+		if(arm_wake(r->uring) == -1)
+			fprintf(stderr, "Failed to re-arm wakeup\n");
+		break;
+	case TAG_TIMER:
+		if(cqe->res > 0)
+			timer_handler();
+		if(uring_arm_timer(r) == -1)
+			fprintf(stderr, "Failed to re-arm timer\n");
+		break;
+	case TAG_CANCEL:
+		break;
+	}
+}
+
+static int
+setup_rings(struct uring *u)
+{
+	struct io_uring_params p;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz;
+
+	memset(&p, 0, sizeof(p));
+	if((u->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p)) == -1)
+		return -1;
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_sz > sq_sz)
+			sq_sz = cq_sz;
+	}
+
+	sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      u->ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED)
+		return -1;
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      u->ring_fd, IORING_OFF_CQ_RING);
+		if(cq_ptr == MAP_FAILED)
+			return -1;
+	}
+
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED)
+		return -1;
+
+	u->sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+	u->sq_local_tail = *u->sq_tail;
+
+	u->cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+static int
+setup_buffer_ring(struct uring *u)
+{
+	struct io_uring_buf_reg reg;
+	size_t ring_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	int idx;
+
+	if(posix_memalign((void **)&u->buf_ring, getpagesize(), ring_sz) != 0)
+		return -1;
+	memset(u->buf_ring, 0, ring_sz);
+	if((u->buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE)) == NULL)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BGID;
+	if(sys_io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+
+	for(idx = 0; idx < URING_BUF_COUNT; ++idx)
+		recycle_buffer(u, idx);
+	return 0;
+}
+
+/* IORING_RECV_MULTISHOT came in Linux 6.0, a release after the buffer
+ * rings and multishot accept (5.19) this backend also relies on. A 5.19
+ * kernel sets up the ring fine and then either refuses the flag or
+ * quietly does a single recv, so try one on a socketpair and see
+ * whether the kernel says it will keep going.
+ */
+static int
+probe_multishot_recv(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int sv[2], ret = -1, seen = 0, done = 0;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		return -1;
+	if((sqe = get_sqe(u)) == NULL || write(sv[1], "", 1) != 1)
+		goto out;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+
+	// A multishot recv only ends once the socket is shut down
+	while(!done) {
+		if(uring_submit(u, 1) == -1)
+			goto out;
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail && !done; ++head) {
+			cqe = &u->cqes[head & u->cq_mask];
+			if(cqe->flags & IORING_CQE_F_BUFFER)
+				recycle_buffer(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if(!seen++ && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE))
+				ret = 0;
+			if(cqe->flags & IORING_CQE_F_MORE)
+				shutdown(sv[0], SHUT_RDWR);
+			else
+				done = 1;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+out:
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+// Mappings go away with the ring fd
+static void
+free_uring(struct uring *u)
+{
+	if(u->ring_fd != -1)
+		close(u->ring_fd);
+	if(u->wake_fd != -1)
+		close(u->wake_fd);
+	free(u->buf_ring);
+	free(u->buf_base);
+	pthread_mutex_destroy(&u->flush_lock);
+	free(u);
+}
+
+int
+uring_init_reactor(struct reactor *r)
+{
+	struct uring *u;
+
+	if((u = calloc(1, sizeof(struct uring))) == NULL)
+		return -1;
+	u->ring_fd = -1;
+	u->wake_fd = -1;
+	pthread_mutex_init(&u->flush_lock, NULL);
+
+	if(setup_rings(u) == -1 || setup_buffer_ring(u) == -1 ||
+	   (u->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		perror("io_uring setup");
+		free_uring(u);
+		return -1;
+	}
+	if(probe_multishot_recv(u) == -1) {
+		fprintf(stderr, "io_uring lacks multishot recv (Linux 6.0)\n");
+		free_uring(u);
+		return -1;
+	}
+
+	r->uring = u;
+	if(arm_accept(r) == -1 || arm_wake(u) == -1) {
+		r->uring = NULL;
+		free_uring(u);
+		return -1;
+	}
+	return 0;
+}
+
+// Tear down the ring of a reactor that never ran
+void
+uring_close_reactor(struct reactor *r)
+{
+	free_uring(r->uring);
+	r->uring = NULL;
+}
+
+void *
+uring_reactor_loop(void *arg)
+{
+	struct reactor *r = arg;
+	struct uring *u = r->uring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+
+	current_reactor = r;
+	while(1) {
+		// Everything queued since the last pass goes out in this enter
+		submit_flushes(r);
+		if(uring_submit(u, 1) == -1 && errno != EBUSY) {
+			perror("io_uring_enter");
+			continue;
+		}
+
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		while(head != tail) {
+			cqe = &u->cqes[head & u->cq_mask];
+			handle_cqe(r, cqe);
+			head++;
+			// Hand the slot back before the handler's own sends can
+			// overflow the completion ring
+			__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+			if(head == tail)
+				tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		}
+		if(iteration_handler)
+			iteration_handler();
+	}
+	return NULL;
+}
@@ -1,6 +1,5 @@
+#define _GNU_SOURCE // accept4
 #include <stdlib.h>
-#include <sys/epoll.h>
-#include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
@@ -11,186 +10,814 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <signal.h>
+#include <sys/timerfd.h>
 
 #include "msgproto.h"
+#include "networking.h"
+#include "net_internal.h"
 
-#define MAX_EVENTS 1024 // Max pending events to handle per epoll_wait call
-#define DEFAULT_HT_SIZE 64
-#define BACKLOG 10
+#define DEFAULT_FD_TABLE_SIZE 1024
+#define FD_SLAB_SIZE 256
+#define DEFAULT_BACKLOG SOMAXCONN
+#define ACCEPT_BATCH 256 // Max connections accepted per listener wakeup
+#define DEFAULT_OUT_QUEUE_SIZE 16
+#define DEFAULT_HIGH_WATERMARK (1024 * 1024) // Stop reading a conn above this much queued output
+#define DEFAULT_LOW_WATERMARK (256 * 1024) // ...and resume once it drains below this
+#define DEFAULT_MAX_QUEUED (8 * 1024 * 1024) // Hard ceiling on queued output per conn
+#define DEFAULT_TIMER_INTERVAL_MS 1000
 
-// I'd like to have a hash table int -> (fd struct/parse_func)...
-// It'd be nice to reuse the hash table I made for group_manager but 
-// that's map string -> void*.
+// make_room outcomes
+#define ROOM_OK 0
+#define ROOM_DROP_NEW 1
+#define ROOM_EVICTED 2
 
-typedef void (*event_callback_t)(int, void*);
-typedef void (*handler_t)(char*, size_t);
+static handler_t handler = NULL;
+static close_handler_t close_handler = NULL;
+iteration_handler_t iteration_handler = NULL;
+timer_handler_t timer_handler = NULL;
 
-struct fd_data {
-	int fd;
-	void *context; // State maintained by cb if needed
-	event_callback_t cb_func;
-	struct fd_data *next;
-};
+static struct reactor *reactors = NULL;
+static int num_reactors = 0;
 
-static handler_t handler = NULL;
+// Epoll events carry their fd_data in data.ptr, so the table below is
+// only for lookups by fd. It is indexed directly by fd number and
+// doubles when a larger fd shows up.
+static struct fd_data **fd_table = NULL;
+static int fd_table_size = 0;
+static pthread_rwlock_t fd_table_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-// Global event structure
-static struct epoll_event ev, events[MAX_EVENTS];
-// Global fds
-static int epollfd, listenfd;
-// Simple hash table
-struct fd_data *hashtable[DEFAULT_HT_SIZE] = {0};
+// fd_data records are carved out of FD_SLAB_SIZE sized slabs and
+// recycled through a free list rather than malloc'd per connection.
+static struct fd_data *fd_free_list = NULL;
+static pthread_mutex_t fd_slab_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void
-insert_hashtable(struct fd_data *fdata) {
-	struct fd_data *p, *prev;
-	int idx = fdata->fd % DEFAULT_HT_SIZE;
+struct fd_data *
+alloc_fd_data()
+{
+	struct fd_data *fdata, *slab;
+	int idx;
 
-	p = hashtable[idx];
-	if(p == NULL) {
-		hashtable[idx] = fdata;
-	} else {
-		while(p != NULL) {
-			prev = p;
-			p = p->next;
+	pthread_mutex_lock(&fd_slab_lock);
+	if(fd_free_list == NULL) {
+		if((slab = malloc(FD_SLAB_SIZE * sizeof(struct fd_data))) == NULL) {
+			pthread_mutex_unlock(&fd_slab_lock);
+			return NULL;
+		}
+		for(idx = 0; idx < FD_SLAB_SIZE; ++idx) {
+			slab[idx].next_free = fd_free_list;
+			fd_free_list = &slab[idx];
 		}
-		prev->next = fdata;
 	}
+	fdata = fd_free_list;
+	fd_free_list = fdata->next_free;
+	pthread_mutex_unlock(&fd_slab_lock);
+
+	memset(fdata, 0, sizeof(struct fd_data));
+	return fdata;
+}
+
+void
+free_fd_data(struct fd_data *fdata)
+{
+	pthread_mutex_lock(&fd_slab_lock);
+	fdata->next_free = fd_free_list;
+	fd_free_list = fdata;
+	pthread_mutex_unlock(&fd_slab_lock);
+}
+
+static int
+insert_fd_table(struct fd_data *fdata)
+{
+	struct fd_data **new_table;
+	int new_size;
+
+	pthread_rwlock_wrlock(&fd_table_lock);
+	if(fdata->fd >= fd_table_size) {
+		new_size = fd_table_size ? fd_table_size : DEFAULT_FD_TABLE_SIZE;
+		while(new_size <= fdata->fd)
+			new_size *= 2;
+		if((new_table = realloc(fd_table, new_size * sizeof(struct fd_data *))) == NULL) {
+			pthread_rwlock_unlock(&fd_table_lock);
+			return -1;
+		}
+		memset(new_table + fd_table_size, 0, (new_size - fd_table_size) * sizeof(struct fd_data *));
+		fd_table = new_table;
+		fd_table_size = new_size;
+	}
+	fd_table[fdata->fd] = fdata;
+	pthread_rwlock_unlock(&fd_table_lock);
+	return 0;
 }
 
 static struct fd_data *
-fetch_hashtable(int fd)
+remove_fd_table(int fd)
 {
-	struct fd_data *p;
-	int idx = fd % DEFAULT_HT_SIZE;
+	struct fd_data *p = NULL;
 
-	p = hashtable[idx];
-	while(p != NULL && p->fd != fd)
-		p = p->next;
+	pthread_rwlock_wrlock(&fd_table_lock);
+	if(fd >= 0 && fd < fd_table_size) {
+		p = fd_table[fd];
+		fd_table[fd] = NULL;
+	}
+	pthread_rwlock_unlock(&fd_table_lock);
 	return p;
 }
 
-static struct fd_data *
-remove_hashtable(int fd)
+static size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+static size_t max_queued = DEFAULT_MAX_QUEUED;
+static enum net_overflow_policy overflow_policy = NET_OVERFLOW_DISCONNECT;
+size_t low_watermark = DEFAULT_LOW_WATERMARK;
+
+static struct conn *
+alloc_conn(struct reactor *r, struct fd_data *fdata)
 {
-	struct fd_data *p, *prev = NULL;
-	int idx = fd % DEFAULT_HT_SIZE;
+	struct conn *c;
 
-	p = hashtable[idx];
-	while(p != NULL && p->fd != fd) {
-		prev = p;
-		p = p->next;
+	if((c = calloc(1, sizeof(struct conn))) == NULL)
+		return NULL;
+	if((c->rb.buf = malloc(RECV_BUF_SIZE)) == NULL) {
+		free(c);
+		return NULL;
 	}
+	c->rb.cap = RECV_BUF_SIZE;
+	c->fdata = fdata;
+	c->reactor = r;
+	atomic_init(&c->refs, 1);
+	pthread_mutex_init(&c->wlock, NULL);
+	return c;
+}
+
+struct net_buf *
+net_buf_alloc(size_t len)
+{
+	struct net_buf *buf;
+
+	if((buf = malloc(sizeof(struct net_buf) + len)) == NULL)
+		return NULL;
+	atomic_init(&buf->refs, 1);
+	buf->len = len;
+	return buf;
+}
 
-	if(p == NULL)
+struct net_buf *
+net_buf_frame(const struct iovec *iov, int iovcnt)
+{
+	struct net_buf *buf;
+	uint32_t hdr[2];
+	size_t msg_sz = 0, off = FRAME_HDR_SIZE;
+	int idx;
+
+	for(idx = 0; idx < iovcnt; ++idx)
+		msg_sz += iov[idx].iov_len;
+	if((buf = net_buf_alloc(FRAME_HDR_SIZE + msg_sz)) == NULL)
 		return NULL;
 
-	if(prev == NULL) {
-		hashtable[idx] = p->next;
-	} else {
-		prev->next = p->next;
+	hdr[0] = htonl(SMOKEMAGIC);
+	hdr[1] = htonl(msg_sz);
+	memcpy(buf->data, hdr, FRAME_HDR_SIZE);
+	for(idx = 0; idx < iovcnt; ++idx) {
+		memcpy(buf->data + off, iov[idx].iov_base, iov[idx].iov_len);
+		off += iov[idx].iov_len;
 	}
-	return p;
+	return buf;
+}
+
+void
+net_buf_get(struct net_buf *buf)
+{
+	atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+void
+net_buf_put(struct net_buf *buf)
+{
+	if(atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1)
+		free(buf);
 }
 
 static void
-clean_up_sock(int sockfd)
+free_out_queue(struct conn *c)
 {
-    struct fd_data *fdata = remove_hashtable(sockfd);
-    if(fdata)
-        free(fdata);
-    close(sockfd);
+	while(c->out_count) {
+		net_buf_put(c->out_q[c->out_head].buf);
+		c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+		c->out_count--;
+	}
+	c->out_head = 0;
+	c->out_bytes = 0;
 }
 
+/* Look up a connection by fd and take a reference on it, so it can be
+ * written to from any reactor without being freed underneath us.
+ */
+static struct conn *
+acquire_conn(int fd)
+{
+	struct fd_data *fdata;
+	struct conn *c = NULL;
+
+	pthread_rwlock_rdlock(&fd_table_lock);
+	if(fd >= 0 && fd < fd_table_size && (fdata = fd_table[fd]) != NULL) {
+		c = fdata->context;
+		atomic_fetch_add(&c->refs, 1);
+	}
+	pthread_rwlock_unlock(&fd_table_lock);
+	return c;
+}
+
+void
+release_conn(struct conn *c)
+{
+	if(atomic_fetch_sub(&c->refs, 1) != 1)
+		return;
+	free_out_queue(c);
+	free(c->out_q);
+	free(c->rb.buf);
+	pthread_mutex_destroy(&c->wlock);
+	free_fd_data(c->fdata);
+	free(c);
+}
+
+/* Only ever called by the owning reactor. The fd is closed under wlock
+ * so a writer on another reactor can never hit a reused fd number.
+ */
+void
+clean_up_sock(struct conn *c)
+{
+	int sockfd = c->fdata->fd;
+
+	remove_fd_table(sockfd);
+	if(close_handler)
+		close_handler(sockfd);
+
+	pthread_mutex_lock(&c->wlock);
+	c->closed = 1;
+	// An in-flight io_uring writev still points at the queued frames;
+	// release_conn frees them once it completes
+	if(!c->send_inflight)
+		free_out_queue(c);
+	// In-flight io_uring requests pin the socket open, so knock them
+	// loose first; they drop their conn refs as they complete.
+	if(c->reactor->uring)
+		shutdown(sockfd, SHUT_RDWR);
+	// Closing drops the fd from the reactor's epoll set
+	close(sockfd);
+	pthread_mutex_unlock(&c->wlock);
+
+	release_conn(c);
+}
+
+/* Hand every complete frame in buf to the handler as a view. Returns
+ * the bytes consumed, or -1 if the peer announced a frame we refuse to
+ * buffer.
+ */
+static ssize_t
+deliver_frames(struct conn *c, char *buf, size_t len)
+{
+	uint32_t hdr[2];
+	size_t pos = 0, frame_sz;
+
+	while(len - pos >= FRAME_HDR_SIZE) {
+		memcpy(hdr, buf + pos, FRAME_HDR_SIZE);
+		if(ntohl(hdr[0]) != SMOKEMAGIC) {
+			// Slide forward a byte at a time until we find magic again
+			pos++;
+			continue;
+		}
+
+		if(ntohl(hdr[1]) > MAX_FRAME_SIZE) {
+			fprintf(stderr, "Frame of %u bytes exceeds limit\n", ntohl(hdr[1]));
+			return -1;
+		}
+
+		frame_sz = FRAME_HDR_SIZE + ntohl(hdr[1]);
+		if(len - pos < frame_sz)
+			break;
+
+		// Invoke handler with a view of the message
+		handler(c->fdata->fd, buf + pos + FRAME_HDR_SIZE, frame_sz - FRAME_HDR_SIZE);
+		pos += frame_sz;
+	}
+	return pos;
+}
+
+// Deliver every complete frame sitting in the receive buffer
+int
+parse_frames(struct conn *c)
+{
+	struct recv_buffer *rb = &c->rb;
+	ssize_t used;
+
+	if((used = deliver_frames(c, rb->buf + rb->start, rb->end - rb->start)) == -1)
+		return -1;
+	rb->start += used;
+	if(rb->start == rb->end)
+		rb->start = rb->end = 0;
+	return 0;
+}
+
+/* Make room for at least one more recv. If the pending partial frame
+ * is larger than the buffer the buffer is grown to hold it.
+ */
 static int
-clear_or_find_next_magic(int sockfd)
-{
-    /* Called in the event of invalid SMOKEMAGIC */
-    uint32_t buf;
-    int ret;
-
-    while(1) {
-        ret = recv(sockfd, &buf, sizeof(uint32_t), 0);
-        if(ret == 0) {
-            fprintf(stderr, "Client closed connection\n");
-            clean_up_sock(sockfd);
-            break;
-        } else if(ret == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                break;
-            perror("Finding magic");
-            clean_up_sock(sockfd);
-            break;
-        }
-        buf = ntohl(buf);
-        if(buf == SMOKEMAGIC)
-            return 1;
-    }
-    return 0;
+reserve_recv_buffer(struct recv_buffer *rb)
+{
+	size_t pending = rb->end - rb->start;
+	size_t need = FRAME_HDR_SIZE;
+	uint32_t hdr[2];
+	char *new_buf;
+
+	if(pending == 0) {
+		rb->start = rb->end = 0;
+		return 0;
+	}
+
+	if(pending >= FRAME_HDR_SIZE) {
+		memcpy(hdr, rb->buf + rb->start, FRAME_HDR_SIZE);
+		need = FRAME_HDR_SIZE + ntohl(hdr[1]);
+	}
+
+	if(rb->start && rb->cap - rb->start < need) {
+		memmove(rb->buf, rb->buf + rb->start, pending);
+		rb->start = 0;
+		rb->end = pending;
+	}
+
+	if(need > rb->cap) {
+		if((new_buf = realloc(rb->buf, need)) == NULL)
+			return -1;
+		rb->buf = new_buf;
+		rb->cap = need;
+	}
+	return 0;
 }
 
-static void
-handle_message(int sockfd, void *context)
+/* Feed bytes that arrived outside the receive buffer (io_uring provided
+ * buffers). Frames wholly inside data are delivered straight from it
+ * and only a trailing partial frame is copied. While reading is paused
+ * everything is parked in the receive buffer undelivered.
+ */
+int
+conn_input(struct conn *c, const char *data, size_t len, int paused)
 {
-	char *msg = NULL;
-	size_t buf_sz = 0;
-	uint32_t msg_sz = 0;
-	uint32_t remaining = 0;
-	int ret;
+	struct recv_buffer *rb = &c->rb;
+	ssize_t used;
+	size_t pending;
+	char *new_buf;
+
+	if(rb->end == rb->start && !paused) {
+		if((used = deliver_frames(c, (char *)data, len)) == -1)
+			return -1;
+		data += used;
+		len -= used;
+	}
+	if(len == 0)
+		return 0;
+
+	if(rb->cap - rb->end < len) {
+		pending = rb->end - rb->start;
+		memmove(rb->buf, rb->buf + rb->start, pending);
+		rb->start = 0;
+		rb->end = pending;
+		if(rb->cap - rb->end < len) {
+			if((new_buf = realloc(rb->buf, rb->end + len)) == NULL)
+				return -1;
+			rb->buf = new_buf;
+			rb->cap = rb->end + len;
+		}
+	}
+	memcpy(rb->buf + rb->end, data, len);
+	rb->end += len;
 
-    /* Check valid magic */
-    if(!clear_or_find_next_magic(sockfd))
-        return;
+	if(paused)
+		return 0;
+	return parse_frames(c);
+}
+
+/* Read and dispatch until the socket is drained or reading is paused
+ * for backpressure. Returns -1 if the connection was torn down.
+ */
+static int
+handle_read(struct conn *c)
+{
+	struct recv_buffer *rb = &c->rb;
+	int sockfd = c->fdata->fd;
+	int paused;
+	size_t space;
+	ssize_t ret;
 
 	while(1) {
-		// Get header
-		ret = recv(sockfd, &msg_sz, sizeof(uint32_t), 0);
+		// Leave input in the socket while our replies pile up; the
+		// EPOLLOUT path resumes us once they drain.
+		pthread_mutex_lock(&c->wlock);
+		paused = c->read_paused;
+		pthread_mutex_unlock(&c->wlock);
+		if(paused)
+			return 0;
+
+		if(reserve_recv_buffer(rb) == -1) {
+			fprintf(stderr, "Failed to grow receive buffer\n");
+			clean_up_sock(c);
+			return -1;
+		}
+
+		space = rb->cap - rb->end;
+		ret = recv(sockfd, rb->buf + rb->end, space, 0);
 		if(ret == 0) {
 			// Client closed connection
 			fprintf(stderr, "Client closed connection\n");
-            clean_up_sock(sockfd);
-            break;
+			clean_up_sock(c);
+			return -1;
 		} else if(ret == -1) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK)
-				break;
+			// Out of data for now; the partial frame waits in rb
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if(errno == EINTR)
+				continue;
 			perror("read");
-            clean_up_sock(sockfd);
-            break;
+			clean_up_sock(c);
+			return -1;
+		}
+
+		rb->end += ret;
+		if(parse_frames(c) == -1) {
+			clean_up_sock(c);
+			return -1;
 		}
 
-		msg_sz = ntohl(msg_sz);
-		remaining = msg_sz;
-		if((msg = malloc(msg_sz)) == NULL)
+		// A short read means the socket is drained, so skip the
+		// recv that would only come back with EAGAIN.
+		if((size_t)ret < space)
+			return 0;
+	}
+}
+
+static void
+set_epollout(struct conn *c, int enable)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET | (enable ? EPOLLOUT : 0);
+	ev.data.ptr = c->fdata;
+	if(epoll_ctl(c->reactor->epollfd, EPOLL_CTL_MOD, c->fdata->fd, &ev) == -1)
+		perror("epoll_ctl: EPOLLOUT");
+	c->epollout_armed = enable;
+}
+
+// Point iov at the head of the queue. Called with wlock held.
+int
+fill_out_iov(struct conn *c, struct iovec *iov, int max_iov)
+{
+	struct out_ref *ref;
+	int iovcnt;
+
+	for(iovcnt = 0; iovcnt < max_iov && (unsigned int)iovcnt < c->out_count; ++iovcnt) {
+		ref = &c->out_q[(c->out_head + iovcnt) & (c->out_cap - 1)];
+		iov[iovcnt].iov_base = ref->buf->data + ref->off;
+		iov[iovcnt].iov_len = ref->buf->len - ref->off;
+	}
+	return iovcnt;
+}
+
+// Drop nbytes written from the head of the queue. Called with wlock held.
+void
+consume_out_queue(struct conn *c, size_t nbytes)
+{
+	struct out_ref *ref;
+	size_t left;
+
+	c->out_bytes -= nbytes;
+	while(nbytes > 0) {
+		ref = &c->out_q[c->out_head];
+		left = ref->buf->len - ref->off;
+		if(nbytes < left) {
+			ref->off += nbytes;
 			break;
+		}
+		nbytes -= left;
+		// Last subscriber to drain a shared frame frees it
+		net_buf_put(ref->buf);
+		c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+		c->out_count--;
+	}
+	if(c->out_count == 0)
+		c->out_head = 0;
+}
+
+/* Write out as much of the queue as the socket takes, MAX_IOV frames
+ * per writev. Called with wlock held. Returns 0 once the queue is
+ * empty, 1 if the socket is full and -1 on error.
+ */
+static int
+flush_out_queue(struct conn *c)
+{
+	struct iovec iov[MAX_IOV];
+	ssize_t ret;
+	int iovcnt;
+
+	while(c->out_count) {
+		iovcnt = fill_out_iov(c, iov, MAX_IOV);
+		if((ret = writev(c->fdata->fd, iov, iovcnt)) == -1) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+		consume_out_queue(c, ret);
+	}
+	return 0;
+}
+
+/* Append a reference to buf, off bytes of which are already written.
+ * Takes over the caller's reference. Called with wlock held.
+ */
+static int
+queue_buf(struct conn *c, struct net_buf *buf, size_t off)
+{
+	struct out_ref *new_q;
+	unsigned int new_cap, idx;
+
+	if(c->out_count == c->out_cap) {
+		new_cap = c->out_cap ? c->out_cap * 2 : DEFAULT_OUT_QUEUE_SIZE;
+		if((new_q = malloc(new_cap * sizeof(struct out_ref))) == NULL)
+			return -1;
+		// Unwrap into the new array
+		for(idx = 0; idx < c->out_count; ++idx)
+			new_q[idx] = c->out_q[(c->out_head + idx) & (c->out_cap - 1)];
+		free(c->out_q);
+		c->out_q = new_q;
+		c->out_cap = new_cap;
+		c->out_head = 0;
+	}
+
+	idx = (c->out_head + c->out_count) & (c->out_cap - 1);
+	c->out_q[idx].buf = buf;
+	c->out_q[idx].off = off;
+	c->out_count++;
+	c->out_bytes += buf->len - off;
+	return 0;
+}
+
+/* Copy whatever writev did not take (everything past skip bytes) into
+ * a private buffer at the tail of the queue. Called with wlock held.
+ */
+static int
+queue_iov(struct conn *c, const struct iovec *iov, int iovcnt, size_t skip)
+{
+	struct net_buf *buf;
+	size_t total = 0, len, off = 0;
+	int idx;
+
+	for(idx = 0; idx < iovcnt; ++idx)
+		total += iov[idx].iov_len;
+	if(skip >= total)
+		return 0;
+
+	if((buf = net_buf_alloc(total - skip)) == NULL)
+		return -1;
+
+	for(idx = 0; idx < iovcnt; ++idx) {
+		len = iov[idx].iov_len;
+		if(skip >= len) {
+			skip -= len;
+			continue;
+		}
+		memcpy(buf->data + off, (char *)iov[idx].iov_base + skip, len - skip);
+		off += len - skip;
+		skip = 0;
+	}
+
+	if(queue_buf(c, buf, 0) == -1) {
+		net_buf_put(buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write iov straight to the socket if nothing is queued ahead of it.
+ * Returns the bytes written, or -1 on a hard error. Called with wlock
+ * held.
+ */
+static ssize_t
+try_direct_write(struct conn *c, const struct iovec *iov, int iovcnt)
+{
+	ssize_t written;
+
+	// The io_uring reactor batches every send into its next submit
+	if(c->out_count || c->reactor->uring)
+		return 0;
+
+	while((written = writev(c->fdata->fd, iov, iovcnt)) == -1 && errno == EINTR)
+		;
+	if(written == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		// The owning reactor sees the error on its next event and
+		// tears the connection down
+		c->write_error = 1;
+		return -1;
+	}
+	return written;
+}
+
+// Called with wlock held after anything was queued
+static void
+update_backpressure(struct conn *c)
+{
+	if(c->reactor->uring) {
+		if(c->out_count)
+			uring_schedule_flush(c);
+	} else if(c->out_count && !c->epollout_armed) {
+		set_epollout(c, 1);
+	}
+	if(c->out_bytes > high_watermark)
+		c->read_paused = 1;
+}
+
+/* Keep a connection under its max_queued budget before need more bytes
+ * are queued. Returns ROOM_OK, ROOM_DROP_NEW if the new bytes must be
+ * discarded, or ROOM_EVICTED if the connection is being disconnected.
+ * *discarded is set to the number of older frames thrown out on the
+ * way. Called with wlock held.
+ */
+static int
+make_room(struct conn *c, size_t need, int partial, unsigned int *discarded)
+{
+	struct out_ref *ref;
+	unsigned int mask = c->out_cap - 1;
+	unsigned int pinned, dropped = 0, idx;
+
+	*discarded = 0;
+	if(c->out_bytes + need <= max_queued)
+		return ROOM_OK;
+
+	switch(overflow_policy) {
+	case NET_OVERFLOW_DROP_OLDEST:
+		// Frames being written (a partial head, or the iovs of an
+		// in-flight io_uring writev) must stay; drop the oldest whole
+		// frames behind them.
+		if(c->send_inflight)
+			pinned = c->send_iovcnt;
+		else
+			pinned = c->out_count && c->out_q[c->out_head].off ? 1 : 0;
+		while(pinned + dropped < c->out_count && c->out_bytes + need > max_queued) {
+			ref = &c->out_q[(c->out_head + pinned + dropped) & mask];
+			c->out_bytes -= ref->buf->len - ref->off;
+			net_buf_put(ref->buf);
+			dropped++;
+		}
+		// Slide the pinned frames up over the gap
+		for(idx = pinned; idx-- > 0;)
+			c->out_q[(c->out_head + idx + dropped) & mask] = c->out_q[(c->out_head + idx) & mask];
+		c->out_head = (c->out_head + dropped) & mask;
+		c->out_count -= dropped;
+		*discarded = dropped;
+		if(c->out_bytes + need <= max_queued)
+			return ROOM_OK;
+		// It cannot fit behind the pinned frames either
+		__attribute__((fallthrough));
+	case NET_OVERFLOW_DROP_NEWEST:
+		// Half a frame is already on the wire, the rest cannot be
+		// dropped without corrupting the stream
+		if(!partial)
+			return ROOM_DROP_NEW;
+		break;
+	case NET_OVERFLOW_DISCONNECT:
+		break;
+	}
+
+	// Evict: the owning reactor sees the shutdown as a hangup and tears
+	// the connection down; free what we can right away
+	c->write_error = 1;
+	if(!c->send_inflight)
+		free_out_queue(c);
+	shutdown(c->fdata->fd, SHUT_RDWR);
+	return ROOM_EVICTED;
+}
+
+static int
+room_to_send_status(int room, unsigned int discarded)
+{
+	switch(room) {
+	case ROOM_DROP_NEW:
+		return discarded + 1;
+	case ROOM_EVICTED:
+		return NET_SEND_EVICTED;
+	}
+	return discarded;
+}
+
+int
+net_send_frame(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	struct iovec out[MAX_IOV];
+	uint32_t hdr[2];
+	size_t msg_sz = 0;
+	ssize_t written;
+	struct conn *c;
+	unsigned int discarded;
+	int idx, room, ret = -1;
+
+	if(iovcnt < 0 || iovcnt >= MAX_IOV)
+		return -1;
+	if((c = acquire_conn(sockfd)) == NULL)
+		return -1;
+
+	for(idx = 0; idx < iovcnt; ++idx)
+		msg_sz += iov[idx].iov_len;
+	hdr[0] = htonl(SMOKEMAGIC);
+	hdr[1] = htonl(msg_sz);
+	out[0].iov_base = hdr;
+	out[0].iov_len = FRAME_HDR_SIZE;
+	memcpy(out + 1, iov, iovcnt * sizeof(struct iovec));
+
+	pthread_mutex_lock(&c->wlock);
+	if(!c->closed && !c->write_error &&
+	   (written = try_direct_write(c, out, iovcnt + 1)) != -1) {
+		ret = NET_SEND_OK;
+		if((size_t)written < FRAME_HDR_SIZE + msg_sz) {
+			room = make_room(c, FRAME_HDR_SIZE + msg_sz - written, written > 0, &discarded);
+			ret = room_to_send_status(room, discarded);
+			if(room == ROOM_OK && queue_iov(c, out, iovcnt + 1, written) == -1)
+				ret = -1;
+		}
+		update_backpressure(c);
+	}
+	pthread_mutex_unlock(&c->wlock);
+
+	release_conn(c);
+	return ret;
+}
+
+int
+net_send_buf(int sockfd, struct net_buf *buf)
+{
+	struct iovec iov;
+	ssize_t written;
+	struct conn *c;
+	unsigned int discarded;
+	int room, ret = -1;
 
-		// For now we're going to block until we read msg_sz bytes
-		// off this socket. However in the future we may save the 
-		// state in *context so we can return instead of block and
-		// handle the rest on the next event trigger
-		while(remaining) {
-			ret = recv(sockfd, msg, remaining, 0);
-			if(ret == 0) {
-				// Client closed connection
-				fprintf(stderr, "Client closed connection\n");
-				free(msg);
-                clean_up_sock(sockfd);
-                return;
-			} else if(ret == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					continue;
-				perror("read");
-				free(msg);
-                clean_up_sock(sockfd);
-                return;
+	if((c = acquire_conn(sockfd)) == NULL)
+		return -1;
+
+	iov.iov_base = buf->data;
+	iov.iov_len = buf->len;
+
+	pthread_mutex_lock(&c->wlock);
+	if(!c->closed && !c->write_error &&
+	   (written = try_direct_write(c, &iov, 1)) != -1) {
+		ret = NET_SEND_OK;
+		if((size_t)written < buf->len) {
+			room = make_room(c, buf->len - written, written > 0, &discarded);
+			ret = room_to_send_status(room, discarded);
+			if(room == ROOM_OK) {
+				// Only a reference is queued, the bytes stay shared
+				net_buf_get(buf);
+				if(queue_buf(c, buf, written) == -1) {
+					net_buf_put(buf);
+					ret = -1;
+				}
 			}
-			remaining -= ret;
 		}
+		update_backpressure(c);
+	}
+	pthread_mutex_unlock(&c->wlock);
 
-		// Invoke handler with message
-		handler(msg, msg_sz);
-		free(msg);
+	release_conn(c);
+	return ret;
+}
+
+static void
+conn_event(int sockfd, uint32_t events, void *context)
+{
+	struct conn *c = context;
+	int ret, resume = 0;
+
+	if(events & EPOLLOUT) {
+		pthread_mutex_lock(&c->wlock);
+		ret = flush_out_queue(c);
+		if(ret == 0 && c->epollout_armed)
+			set_epollout(c, 0);
+		if(c->read_paused && c->out_bytes <= low_watermark) {
+			c->read_paused = 0;
+			resume = 1;
+		}
+		pthread_mutex_unlock(&c->wlock);
+
+		if(ret == -1) {
+			perror("writev");
+			clean_up_sock(c);
+			return;
+		}
 	}
-    return;
+
+	// Edge triggered, so input left behind while paused has to be
+	// picked up here rather than waiting for another EPOLLIN
+	if(resume || (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		handle_read(c);
 }
 
 static int
@@ -216,63 +843,83 @@ set_nonblocking(int fd)
 	return 0;
 }
 
-static void
-accept_cb()
+struct conn *
+add_connection(struct reactor *r, int client_fd)
 {
-	struct sockaddr_in client_addr;
 	struct fd_data *fdata;
-	int client_addr_len = sizeof(client_addr);
-	int client_fd;
+	struct conn *c;
+	struct epoll_event ev;
 
-	if((client_fd = accept(listenfd, (struct sockaddr *)&client_addr, &client_addr_len)) == -1) {
-		perror("accept");
-		return;
+	// Construct fd_data 
+	if((fdata = alloc_fd_data()) == NULL) {
+		close(client_fd);
+		return NULL;
 	}
-
-	if(set_nonblocking(client_fd) == -1) {
+	fdata->fd = client_fd;
+	fdata->cb_func = &conn_event;
+	if((c = alloc_conn(r, fdata)) == NULL) {
 		close(client_fd);
-		return;
+		free_fd_data(fdata);
+		return NULL;
 	}
+	fdata->context = c;
 
-	// Construct fd_data 
-	if((fdata = malloc(sizeof(struct fd_data))) == NULL) {
+	if(insert_fd_table(fdata) == -1) {
 		close(client_fd);
-		return;
+		release_conn(c);
+		return NULL;
 	}
-	fdata->fd = client_fd;
-	fdata->cb_func = &handle_message;
-	// For now no context, but in the future we might add a struct
-	// for storing data between events if we don't get a full message
-	// in one read and need to know how much more to expect between events
-	fdata->context = NULL;
 
-	insert_hashtable(fdata);
+	// The io_uring backend arms its own multishot recv
+	if(r->uring)
+		return c;
 
+	// The connection lives on the reactor that accepted it
 	ev.events = EPOLLIN | EPOLLET;
-	ev.data.fd = client_fd;
-	if(epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+	ev.data.ptr = fdata;
+	if(epoll_ctl(r->epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
 		perror("epoll_ctl: client_fd");
-		close(client_fd);
-		free(fdata);
+		clean_up_sock(c);
+		return NULL;
 	}
+	return c;
 }
 
-
-int
-init_networking(const char* port, handler_t h_func) // For now a raw int port, eventually a configuration object
+/* Drain up to ACCEPT_BATCH pending connections per wakeup. accept4 hands
+ * back sockets that are already nonblocking, and TCP_NODELAY/SO_KEEPALIVE
+ * are inherited from the listener, so each connection costs one syscall
+ * before it is registered. The listener is level triggered so anything
+ * left over fires again on the next epoll_wait.
+ */
+static void
+accept_cb(int listenfd, uint32_t events, void *context)
 {
-	struct addrinfo hints, *servinfo, *p;
-	int rv, optval = 1;
-
-	// For now only a single handler function. In the future
-	// perhaps allow a series of handler which will be chained
-	handler = h_func;
+	struct reactor *r = context;
+	int client_fd, accepted;
 
-	// Set up the epoll structure, bind the listen socket etc.
-	if((epollfd = epoll_create1(0)) == -1) {
-		perror("epoll_create1");
-		return -1;
+	for(accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+		client_fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(client_fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// EAGAIN: drained, or another reactor sharing the port
+			// raced us to it
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4");
+			return;
+		}
+		add_connection(r, client_fd);
 	}
+}
+
+/* Each reactor binds its own listener to the shared port with
+ * SO_REUSEPORT so the kernel spreads incoming connections across them.
+ */
+static int
+open_listener(const char *port, int backlog)
+{
+	struct addrinfo hints, *servinfo, *p;
+	int rv, fd = -1, optval = 1;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
@@ -285,18 +932,21 @@ init_networking(const char* port, handler_t h_func) // For now a raw int port, e
 	}
 
 	for(p = servinfo; p != NULL; p = p->ai_next) {
-		if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
 			perror("socket");
 			continue;
 		}
 
-		if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) == -1) {
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) == -1 ||
+		   setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == -1) {
 			perror("setsockopt");
+			close(fd);
+			freeaddrinfo(servinfo);
 			return -1;
 		}
 
-		if(bind(listenfd, p->ai_addr, p->ai_addrlen) == -1) {
-			close(listenfd);
+		if(bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(fd);
 			perror("bind");
 			continue;
 		}
@@ -310,52 +960,233 @@ init_networking(const char* port, handler_t h_func) // For now a raw int port, e
 		return -1;
 	}
 
-	if(set_nonblocking(listenfd) == -1) {
+	// Socket options set here are inherited by accepted connections
+	if(set_nonblocking(fd) == -1) {
 		fprintf(stderr, "Failed to set nonblocking\n");
-		close(listenfd);
+		close(fd);
 		return -1;
 	}
 
-	if(listen(listenfd, BACKLOG) == -1) {
+	if(listen(fd, backlog) == -1) {
 		perror("listen");
-		close(listenfd);
+		close(fd);
 		return -1;
 	}
 
+	return fd;
+}
+
+static int
+init_reactor(struct reactor *r, const struct net_config *conf)
+{
+	struct epoll_event ev;
+
+	r->epollfd = -1;
+	r->timerfd = -1;
+	if((r->listenfd = open_listener(conf->port, conf->backlog > 0 ? conf->backlog : DEFAULT_BACKLOG)) == -1)
+		return -1;
+
+	if(conf->backend == NET_BACKEND_URING) {
+		if(uring_init_reactor(r) == 0)
+			return 0;
+		fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+	}
+
+	// Set up the epoll structure, bind the listen socket etc.
+	if((r->epollfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		close(r->listenfd);
+		return -1;
+	}
+
+	// The listener dispatches like any other fd, with its reactor as context
+	if((r->listen_data = alloc_fd_data()) == NULL) {
+		close(r->listenfd);
+		close(r->epollfd);
+		return -1;
+	}
+	r->listen_data->fd = r->listenfd;
+	r->listen_data->cb_func = &accept_cb;
+	r->listen_data->context = r;
+
 	ev.events = EPOLLIN; // listen socket is level triggered, NOT edge triggered
-	ev.data.fd = listenfd;
-	if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+	ev.data.ptr = r->listen_data;
+	if(epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->listenfd, &ev) == -1) {
 		perror("epoll_ctl: listenfd");
-		close(listenfd);
+		free_fd_data(r->listen_data);
+		close(r->listenfd);
+		close(r->epollfd);
 		return -1;
 	}
 
 	return 0;
 }
 
-void
-start_networking_loop()
+static void
+timer_cb(int timerfd, uint32_t events, void *context)
+{
+	uint64_t expirations;
+
+	if(read(timerfd, &expirations, sizeof(expirations)) == -1) {
+		if(errno != EAGAIN)
+			perror("read: timerfd");
+		return;
+	}
+	timer_handler();
+}
+
+/* The periodic timer is just another fd in reactor 0's loop */
+static int
+start_timer(struct reactor *r, unsigned int interval_ms)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	struct fd_data *fdata;
+
+	if((r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(r->timerfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		goto fail;
+	}
+
+	if(r->uring) {
+		if(uring_arm_timer(r) == -1)
+			goto fail;
+		return 0;
+	}
+
+	if((fdata = alloc_fd_data()) == NULL)
+		goto fail;
+	fdata->fd = r->timerfd;
+	fdata->cb_func = &timer_cb;
+	ev.events = EPOLLIN;
+	ev.data.ptr = fdata;
+	if(epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->timerfd, &ev) == -1) {
+		perror("epoll_ctl: timerfd");
+		free_fd_data(fdata);
+		goto fail;
+	}
+	return 0;
+fail:
+	close(r->timerfd);
+	r->timerfd = -1;
+	return -1;
+}
+
+/* Undo init_reactor. Closing the listener takes it out of the
+ * SO_REUSEPORT group, so the kernel stops routing connections to it.
+ */
+static void
+close_reactor(struct reactor *r)
 {
-	int numfds, idx, ret;
+	close(r->listenfd);
+	r->listenfd = -1;
+	if(r->uring)
+		uring_close_reactor(r);
+	if(r->epollfd != -1)
+		close(r->epollfd);
+	r->epollfd = -1;
+	if(r->listen_data)
+		free_fd_data(r->listen_data);
+	r->listen_data = NULL;
+}
+
+int
+init_networking(const struct net_config *conf, handler_t h_func)
+{
+	int idx;
+
+	// For now only a single handler function. In the future
+	// perhaps allow a series of handler which will be chained
+	handler = h_func;
+	close_handler = conf->on_close;
+	iteration_handler = conf->on_iteration;
+	timer_handler = conf->on_timer;
+
+	if(conf->high_watermark)
+		high_watermark = conf->high_watermark;
+	if(conf->low_watermark)
+		low_watermark = conf->low_watermark;
+	if(low_watermark > high_watermark)
+		low_watermark = high_watermark;
+	if(conf->max_queued)
+		max_queued = conf->max_queued;
+	overflow_policy = conf->overflow_policy;
+
+	// Writes to a peer that went away should fail with EPIPE, not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	num_reactors = conf->num_reactors > 0 ? conf->num_reactors : 1;
+	if((reactors = calloc(num_reactors, sizeof(struct reactor))) == NULL)
+		return -1;
+
+	for(idx = 0; idx < num_reactors; ++idx) {
+		if(init_reactor(&reactors[idx], conf) == -1)
+			goto fail;
+	}
+	if(timer_handler && start_timer(&reactors[0],
+			conf->timer_interval_ms ? conf->timer_interval_ms : DEFAULT_TIMER_INTERVAL_MS) == -1)
+		goto fail;
+
+	return 0;
+fail:
+	while(idx--)
+		close_reactor(&reactors[idx]);
+	free(reactors);
+	reactors = NULL;
+	return -1;
+}
+
+static void *
+reactor_loop(void *arg)
+{
+	struct reactor *r = arg;
+	int numfds, idx;
 	struct fd_data *fdata;
 	// I need to set up some signal handlers soon
 	while(1) {
-		numfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+		numfds = epoll_wait(r->epollfd, r->events, MAX_EVENTS, -1);
 		if(numfds == -1) {
-			perror("epoll_wait");
+			if(errno != EINTR)
+				perror("epoll_wait");
+			continue;
 		}
 
 		for(idx = 0; idx < numfds; ++idx) {
-            if(events[idx].data.fd == listenfd) {
-                accept_cb();
-                continue;
-            }
-			fdata = fetch_hashtable(events[idx].data.fd);
-			if(fdata == NULL) {
-				fprintf(stderr, "Failed to retrieve fd data\n");
-				continue;
-			}
-			fdata->cb_func(fdata->fd, fdata->context);
+			fdata = r->events[idx].data.ptr;
+			fdata->cb_func(fdata->fd, r->events[idx].events, fdata->context);
+		}
+		if(iteration_handler)
+			iteration_handler();
+	}
+	return NULL;
+}
+
+/* Runs reactor 0 on the calling thread and one extra thread for
+ * every other reactor. Does not return.
+ */
+void
+start_networking_loop()
+{
+	int idx;
+
+	for(idx = 1; idx < num_reactors; ++idx) {
+		if(pthread_create(&reactors[idx].thread, NULL,
+				  reactors[idx].uring ? uring_reactor_loop : reactor_loop,
+				  &reactors[idx]) != 0) {
+			// Nobody would accept what the kernel hands its listener
+			fprintf(stderr, "Failed to start reactor %d\n", idx);
+			close_reactor(&reactors[idx]);
 		}
 	}
+	if(reactors[0].uring)
+		uring_reactor_loop(&reactors[0]);
+	else
+		reactor_loop(&reactors[0]);
 }
@@ -1,8 +1,91 @@
 #ifndef _NETWORKING_H
 #define _NETWORKING_H
 
-typedef void (*handler_t)(char*, size_t);
-int init_networking(const char *port, handler_t h_func);
-void start_network_loop();
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* An encoded outbound frame shared by every connection it is queued on.
+ * Each queued reference holds a ref; the buffer is freed when the last
+ * connection has written it out.
+ */
+struct net_buf {
+	atomic_int refs;
+	size_t len;
+	char data[];
+};
+
+/* Handlers are called on the reactor owning sockfd with a view of one
+ * frame body; msg is only valid for the duration of the call.
+ */
+typedef void (*handler_t)(int sockfd, char *msg, size_t msg_sz);
+
+/* Called on the owning reactor just before a connection's fd is closed,
+ * while the fd number cannot yet be handed to a new connection.
+ */
+typedef void (*close_handler_t)(int sockfd);
+
+/* Called by every reactor once it has worked through a batch of events,
+ * so work the batch queued up can be finished in one go.
+ */
+typedef void (*iteration_handler_t)(void);
+
+/* Called on reactor 0 every timer_interval_ms, driven by a timerfd in
+ * the same event loop as everything else. Ticks missed while the
+ * reactor was busy are folded into one call.
+ */
+typedef void (*timer_handler_t)(void);
+
+enum net_backend {
+	NET_BACKEND_EPOLL,
+	NET_BACKEND_URING, // falls back to epoll without io_uring multishot recv (Linux 6.0)
+};
+
+// What to do when a connection's queued output would exceed max_queued
+enum net_overflow_policy {
+	NET_OVERFLOW_DISCONNECT,
+	NET_OVERFLOW_DROP_OLDEST, // discard the oldest unsent frames to make room
+	NET_OVERFLOW_DROP_NEWEST, // discard the frame being sent
+};
+
+/* net_send_frame/net_send_buf results besides -1 (no such connection).
+ * A positive result is the number of frames, older ones or the one being
+ * sent, discarded under the overflow policy.
+ */
+#define NET_SEND_OK 0
+#define NET_SEND_EVICTED -2 // the connection is being disconnected
+
+struct net_config {
+	const char *port;
+	int num_reactors; // epoll threads, each with its own SO_REUSEPORT listener
+	int backlog; // listen() backlog per listener, <= 0 for SOMAXCONN
+	size_t high_watermark; // queued output at which a conn stops being read, 0 for default
+	size_t low_watermark; // queued output at which reading resumes, 0 for default
+	enum net_backend backend;
+	size_t max_queued; // ceiling on queued output per conn, 0 for default
+	enum net_overflow_policy overflow_policy;
+	close_handler_t on_close; // optional
+	iteration_handler_t on_iteration; // optional
+	timer_handler_t on_timer; // optional
+	unsigned int timer_interval_ms; // on_timer period, 0 for default
+};
+
+int init_networking(const struct net_config *conf, handler_t h_func);
+void start_networking_loop();
+/* Queue one frame (SMOKEMAGIC + length + iov) on sockfd. Safe to call
+ * from any reactor; never blocks. Returns NET_SEND_OK, the number of
+ * frames discarded to make room, NET_SEND_EVICTED, or -1 if the
+ * connection is gone.
+ */
+int net_send_frame(int sockfd, const struct iovec *iov, int iovcnt);
+
+/* Encode iov into a framed net_buf once, then net_send_buf it to as many
+ * connections as needed and drop the creator's ref with net_buf_put.
+ */
+struct net_buf *net_buf_alloc(size_t len);
+struct net_buf *net_buf_frame(const struct iovec *iov, int iovcnt);
+void net_buf_get(struct net_buf *buf);
+void net_buf_put(struct net_buf *buf);
+int net_send_buf(int sockfd, struct net_buf *buf);
 
 #endif /* _NETWORKING_H */
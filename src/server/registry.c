@@ -0,0 +1,231 @@
+/* Read-mostly concurrent index, see registry.h.
+ *
+ * A chained hash whose bucket heads and links are atomic pointers.
+ * Writers (holding reg->wlock) only ever publish fully built nodes with
+ * a release store and unlink with a single store, so a reader walking a
+ * chain always sees a consistent list. Unlinked nodes are retired
+ * through the epoch layer. Growing builds a fresh table of copied nodes
+ * and swaps it in; the old table and its nodes are retired whole.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "registry.h"
+#include "epoch.h"
+#include "hashmap.h"
+
+#define DEFAULT_BUCKETS 64 // Power of two
+#define MAX_LOAD 2 // Average chain length before the table doubles
+
+struct reg_node {
+	struct reg_node *_Atomic next;
+	void *value;
+	uint64_t hash;
+	size_t key_len;
+	char key[];
+};
+
+struct reg_table {
+	size_t mask;
+	struct reg_node *_Atomic buckets[];
+};
+
+struct registry {
+	struct reg_table *_Atomic table;
+	pthread_mutex_t wlock;
+	size_t count;
+	uint64_t seed;
+};
+
+static struct reg_table *alloc_table(size_t num_buckets)
+{
+	struct reg_table *t;
+	size_t idx;
+
+	if((t = malloc(sizeof(struct reg_table) + num_buckets * sizeof(t->buckets[0]))) == NULL)
+		return NULL;
+	t->mask = num_buckets - 1;
+	for(idx = 0; idx < num_buckets; ++idx)
+		atomic_init(&t->buckets[idx], NULL);
+	return t;
+}
+
+static struct reg_node *alloc_node(const char *key, size_t len, uint64_t hash, void *value)
+{
+	struct reg_node *node;
+
+	if((node = malloc(sizeof(struct reg_node) + len)) == NULL)
+		return NULL;
+	memcpy(node->key, key, len);
+	node->key_len = len;
+	node->hash = hash;
+	node->value = value;
+	atomic_init(&node->next, NULL);
+	return node;
+}
+
+/* Frees a table and every node still chained from it */
+static void free_table(void *arg)
+{
+	struct reg_table *t = arg;
+	struct reg_node *node, *next;
+	size_t idx;
+
+	for(idx = 0; idx <= t->mask; ++idx) {
+		for(node = atomic_load_explicit(&t->buckets[idx], memory_order_relaxed); node; node = next) {
+			next = atomic_load_explicit(&node->next, memory_order_relaxed);
+			free(node);
+		}
+	}
+	free(t);
+}
+
+struct registry *registry_create()
+{
+	struct registry *reg;
+	struct reg_table *t;
+
+	if((reg = malloc(sizeof(struct registry))) == NULL)
+		return NULL;
+	if((t = alloc_table(DEFAULT_BUCKETS)) == NULL) {
+		free(reg);
+		return NULL;
+	}
+	atomic_init(&reg->table, t);
+	pthread_mutex_init(&reg->wlock, NULL);
+	reg->count = 0;
+	reg->seed = hash_new_seed();
+	return reg;
+}
+
+void *registry_get(struct registry *reg, const char *key, size_t len)
+{
+	uint64_t hash = hash_bytes(reg->seed, key, len);
+	struct reg_table *t = atomic_load_explicit(&reg->table, memory_order_acquire);
+	struct reg_node *node;
+
+	node = atomic_load_explicit(&t->buckets[hash & t->mask], memory_order_acquire);
+	for(; node; node = atomic_load_explicit(&node->next, memory_order_acquire)) {
+		if(node->hash == hash && node->key_len == len && memcmp(node->key, key, len) == 0)
+			return node->value;
+	}
+	return NULL;
+}
+
+void registry_lock(struct registry *reg)
+{
+	pthread_mutex_lock(&reg->wlock);
+}
+
+void registry_unlock(struct registry *reg)
+{
+	pthread_mutex_unlock(&reg->wlock);
+}
+
+/* Double the table. Readers may be walking the old chains, so the nodes
+ * are copied rather than relinked. Called with wlock held.
+ */
+static int grow(struct registry *reg)
+{
+	struct reg_table *old = atomic_load_explicit(&reg->table, memory_order_relaxed);
+	struct reg_table *t;
+	struct reg_node *node, *copy;
+	size_t idx, bucket;
+
+	if((t = alloc_table((old->mask + 1) * 2)) == NULL)
+		return -1;
+
+	for(idx = 0; idx <= old->mask; ++idx) {
+		node = atomic_load_explicit(&old->buckets[idx], memory_order_relaxed);
+		for(; node; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+			if((copy = alloc_node(node->key, node->key_len, node->hash, node->value)) == NULL) {
+				free_table(t);
+				return -1;
+			}
+			bucket = copy->hash & t->mask;
+			atomic_init(&copy->next, atomic_load_explicit(&t->buckets[bucket], memory_order_relaxed));
+			atomic_init(&t->buckets[bucket], copy);
+		}
+	}
+
+	atomic_store_explicit(&reg->table, t, memory_order_release);
+	epoch_retire(old, free_table);
+	return 0;
+}
+
+/* Returns -1 if key is already present or on allocation failure. Called
+ * with the registry locked.
+ */
+int registry_insert(struct registry *reg, const char *key, size_t len, void *value)
+{
+	uint64_t hash = hash_bytes(reg->seed, key, len);
+	struct reg_table *t;
+	struct reg_node *node, *head;
+
+	if(registry_get(reg, key, len) != NULL)
+		return -1;
+
+	// A failed grow just leaves the chains a bit longer
+	t = atomic_load_explicit(&reg->table, memory_order_relaxed);
+	if(reg->count >= (t->mask + 1) * MAX_LOAD && grow(reg) == 0)
+		t = atomic_load_explicit(&reg->table, memory_order_relaxed);
+
+	if((node = alloc_node(key, len, hash, value)) == NULL)
+		return -1;
+	head = atomic_load_explicit(&t->buckets[hash & t->mask], memory_order_relaxed);
+	atomic_init(&node->next, head);
+	atomic_store_explicit(&t->buckets[hash & t->mask], node, memory_order_release);
+	reg->count++;
+	return 0;
+}
+
+/* Unlinks key and returns its value, or NULL if it was not present.
+ * Called with the registry locked.
+ */
+void *registry_remove(struct registry *reg, const char *key, size_t len)
+{
+	uint64_t hash = hash_bytes(reg->seed, key, len);
+	struct reg_table *t = atomic_load_explicit(&reg->table, memory_order_relaxed);
+	struct reg_node *_Atomic *link;
+	struct reg_node *node;
+	void *value;
+
+	for(link = &t->buckets[hash & t->mask];
+	    (node = atomic_load_explicit(link, memory_order_relaxed)) != NULL;
+	    link = &node->next) {
+		if(node->hash == hash && node->key_len == len && memcmp(node->key, key, len) == 0)
+			break;
+	}
+	if(node == NULL)
+		return NULL;
+
+	// Readers already on node can still follow node->next
+	atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed),
+		memory_order_release);
+	reg->count--;
+	value = node->value;
+	epoch_retire(node, free);
+	return value;
+}
+
+/* Visit every value. Called with the registry locked, so the table and
+ * its chains hold still.
+ */
+int registry_foreach(struct registry *reg, int (*fn)(void *value, void *arg), void *arg)
+{
+	struct reg_table *t = atomic_load_explicit(&reg->table, memory_order_relaxed);
+	struct reg_node *node;
+	size_t idx;
+	int ret;
+
+	for(idx = 0; idx <= t->mask; ++idx) {
+		node = atomic_load_explicit(&t->buckets[idx], memory_order_relaxed);
+		for(; node; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+			if((ret = fn(node->value, arg)) != 0)
+				return ret;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+/* A name -> pointer index built for read-mostly use from many threads.
+ *
+ * registry_get takes no locks: call it between epoch_enter() and
+ * epoch_exit() and the returned pointer stays valid until the exit.
+ * Inserts and removals serialize on the registry's own lock; a removed
+ * value is the caller's to retire with epoch_retire().
+ */
+#include <stddef.h>
+
+struct registry;
+
+struct registry *registry_create();
+void *registry_get(struct registry *reg, const char *key, size_t len);
+
+void registry_lock(struct registry *reg);
+void registry_unlock(struct registry *reg);
+int registry_insert(struct registry *reg, const char *key, size_t len, void *value);
+void *registry_remove(struct registry *reg, const char *key, size_t len);
+// Calls fn on every value until it returns non-zero, which is returned
+int registry_foreach(struct registry *reg, int (*fn)(void *value, void *arg), void *arg);
+
+#endif /* _REGISTRY_H */
@@ -1,26 +1,265 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <endian.h>
 #include "networking.h"
 #include "group_manager.h"
+#include "msgproto.h"
 
-void handle_msg(char *msg, size_t msg_sz)
+/* A parsed message. Every field is a view into the connection's receive
+ * buffer, which is only valid until the handler returns, and none of
+ * them is NUL terminated.
+ */
+struct msg_view {
+	uint8_t type;
+	const char *group;
+	size_t group_len;
+	const char *body; // STRLEN/MSGLEN delimited payload, if the type has one
+	size_t body_len;
+};
+
+typedef int (*msg_handler_t)(int sockfd, const struct msg_view *mv);
+
+/* Answer a request that otherwise gets no reply with REQUEST_FAILED,
+ * so the client does not take silence for success.
+ */
+static void send_failure(int sockfd, const struct msg_view *mv, const char *reason)
+{
+	uint8_t hdr[2] = { REQUEST_FAILED, mv->group_len };
+	uint8_t body_hdr[3] = { 0, 0, mv->type };
+	size_t reason_len = strlen(reason);
+	struct iovec iov[4] = {
+		{ hdr, sizeof(hdr) },
+		{ (void *)mv->group, mv->group_len },
+		{ body_hdr, sizeof(body_hdr) },
+		{ (void *)reason, reason_len },
+	};
+
+	body_hdr[0] = (1 + reason_len) >> 8;
+	body_hdr[1] = (1 + reason_len) & 0xff;
+	net_send_frame(sockfd, iov, 4);
+}
+
+static int handle_join(int sockfd, const struct msg_view *mv)
+{
+	switch(join_group_n(mv->group, mv->group_len, mv->body, mv->body_len)) {
+	case 0:
+		return 0;
+	case JOIN_BAD_MEMBER:
+		send_failure(sockfd, mv, "members are a.b.c.d:port or [v6]:port");
+		break;
+	default:
+		send_failure(sockfd, mv, "the group could not be created or loaded, or out of memory");
+	}
+	return -1;
+}
+
+static int handle_leave(int sockfd, const struct msg_view *mv)
+{
+	return leave_group_n(mv->group, mv->group_len, mv->body, mv->body_len);
+}
+
+static int handle_healthcheck(int sockfd, const struct msg_view *mv)
+{
+	return healthcheck_group_n(mv->group, mv->group_len, mv->body, mv->body_len);
+}
+
+// The "group" of a HEALTHCHECK_GROUPS is the member
+static int handle_healthcheck_groups(int sockfd, const struct msg_view *mv)
+{
+	return healthcheck_groups_n(mv->group, mv->group_len, mv->body, mv->body_len);
+}
+
+static int handle_healthcheck_members(int sockfd, const struct msg_view *mv)
+{
+	return healthcheck_members_n(mv->group, mv->group_len, mv->body, mv->body_len);
+}
+
+static int handle_broadcast(int sockfd, const struct msg_view *mv)
+{
+	return broadcast_group_n(mv->group, mv->group_len, mv->body, mv->body_len);
+}
+
+static int handle_sub(int sockfd, const struct msg_view *mv)
+{
+	return sub_group_n(mv->group, mv->group_len, sockfd);
+}
+
+static int handle_sub_from(int sockfd, const struct msg_view *mv)
+{
+	uint64_t from;
+
+	if(mv->body_len != sizeof(from))
+		return -1;
+	memcpy(&from, mv->body, sizeof(from));
+	return sub_group_from_n(mv->group, mv->group_len, sockfd, be64toh(from));
+}
+
+static int handle_sub_watch(int sockfd, const struct msg_view *mv)
+{
+	// A watcher waits for its MEMBERS_AT, so tell it there is none coming
+	if(sub_group_watch_n(mv->group, mv->group_len, sockfd) == -1) {
+		send_failure(sockfd, mv, "no such group, or out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+static int handle_unsub(int sockfd, const struct msg_view *mv)
+{
+	return unsub_group_n(mv->group, mv->group_len, sockfd);
+}
+
+static int handle_list(int sockfd, const struct msg_view *mv)
+{
+	return send_group_members_n(mv->group, mv->group_len, sockfd);
+}
+
+/* Indexed by the TYPE byte. has_body says whether a 2 byte big endian
+ * length and that many bytes follow the group name.
+ */
+static const struct {
+	msg_handler_t handler;
+	int has_body;
+} dispatch_table[256] = {
+	[JOINGROUP] = { handle_join, 1 },
+	[LEAVEGROUP] = { handle_leave, 1 },
+	[HEALTHCHECK] = { handle_healthcheck, 1 },
+	[BROADCAST] = { handle_broadcast, 1 },
+	[SUBGROUP] = { handle_sub, 0 },
+	[UNSUBGROUP] = { handle_unsub, 0 },
+	[LISTMEMBERS] = { handle_list, 0 },
+	[HEALTHCHECK_GROUPS] = { handle_healthcheck_groups, 1 },
+	[HEALTHCHECK_MEMBERS] = { handle_healthcheck_members, 1 },
+	[SUBGROUP_FROM] = { handle_sub_from, 1 },
+	[SUBGROUP_WATCH] = { handle_sub_watch, 0 },
+};
+
+/* Split msg into mv in place. Returns -1 for an unknown type or if the
+ * lengths inside the message disagree with its size.
+ */
+static int parse_msg(const char *msg, size_t msg_sz, struct msg_view *mv)
 {
-	char *buf;
-	// msg does not contain null terminator!
-	buf = malloc(msg_sz + 1);
-	strncpy(buf, msg, msg_sz);
-	buf[msg_sz] = 0;
+	const unsigned char *p = (const unsigned char *)msg;
+	size_t off;
+
+	if(msg_sz < 2)
+		return -1;
+	mv->type = p[0];
+	if(dispatch_table[mv->type].handler == NULL)
+		return -1;
 
-	printf("Msg: %s\n", buf);
-	free(buf);
+	mv->group_len = p[1];
+	mv->group = msg + 2;
+	off = 2 + mv->group_len;
+	if(mv->group_len == 0 || off > msg_sz)
+		return -1;
+
+	if(!dispatch_table[mv->type].has_body) {
+		mv->body = NULL;
+		mv->body_len = 0;
+		return off == msg_sz ? 0 : -1;
+	}
+
+	if(off + 2 > msg_sz)
+		return -1;
+	mv->body_len = (size_t)p[off] << 8 | p[off + 1];
+	mv->body = msg + off + 2;
+	return off + 2 + mv->body_len == msg_sz ? 0 : -1;
+}
+
+void handle_msg(int sockfd, char *msg, size_t msg_sz)
+{
+	struct msg_view mv;
+
+	// msg is a view into the connection's receive buffer and does
+	// not contain a null terminator!
+	if(parse_msg(msg, msg_sz, &mv) == -1) {
+		fprintf(stderr, "Dropping malformed message on fd %d\n", sockfd);
+		return;
+	}
+	dispatch_table[mv.type].handler(sockfd, &mv);
 }
 
 int main(int argc, char *argv[]) {
+	struct net_config conf = {
+		.port = "51511",
+		.num_reactors = 1,
+		.backlog = 0,
+		.backend = NET_BACKEND_EPOLL,
+		.overflow_policy = NET_OVERFLOW_DISCONNECT,
+		.on_close = unsub_all_groups,
+		.on_iteration = commit_group_changes,
+	};
+	unsigned int retain_msgs = 0;
+	size_t retain_bytes = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:t:b:uq:o:e:r:R:d:")) != -1) {
+		switch(opt) {
+		case 'p':
+			conf.port = optarg;
+			break;
+		case 't':
+			conf.num_reactors = atoi(optarg);
+			break;
+		case 'b':
+			conf.backlog = atoi(optarg);
+			break;
+		case 'u':
+			conf.backend = NET_BACKEND_URING;
+			break;
+		case 'q':
+			conf.max_queued = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			if(strcmp(optarg, "oldest") == 0)
+				conf.overflow_policy = NET_OVERFLOW_DROP_OLDEST;
+			else if(strcmp(optarg, "newest") == 0)
+				conf.overflow_policy = NET_OVERFLOW_DROP_NEWEST;
+			else if(strcmp(optarg, "disconnect") == 0)
+				conf.overflow_policy = NET_OVERFLOW_DISCONNECT;
+			else
+				goto usage;
+			break;
+		case 'e':
+			// Drop members not heard from in this many seconds
+			set_member_timeout(atoi(optarg));
+			conf.on_timer = expire_members;
+			break;
+		case 'r':
+			// Keep this many recent broadcasts per group for replay
+			retain_msgs = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			// ...or at most this many bytes of them
+			retain_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			set_group_dir(optarg);
+			break;
+		default:
+		usage:
+			fprintf(stderr, "Usage: %s [-p port] [-t reactor_threads] [-b backlog] [-u]"
+				" [-q max_queued_bytes] [-o oldest|newest|disconnect] [-e expiry_secs]"
+				" [-r retained_msgs] [-R retained_bytes] [-d group_dir]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	set_broadcast_retention(retain_msgs, retain_bytes);
 	printf("Initializing...\n");
-	init_networking("51511", &handle_msg);
+	if(initialize_group_manager() == -1) {
+		fprintf(stderr, "Failed to initialize group manager\n");
+		return 1;
+	}
+	if(init_networking(&conf, &handle_msg) == -1) {
+		fprintf(stderr, "Failed to initialize networking\n");
+		return 1;
+	}
 	printf("Starting server\n");
 	start_networking_loop();
 	return 0;
 }
-
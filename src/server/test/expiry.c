@@ -0,0 +1,78 @@
+/* Member expiry through ./smoke -e: a member that keeps sending
+ * HEALTHCHECKs stays, one that goes quiet is dropped within a tick or
+ * two of its deadline, the drop is journaled (it stays gone across a
+ * restart), and members replayed at startup expire unless heard from.
+ */
+#include "harness.h"
+
+#define PORT "51681"
+#define GROUP "expiry"
+#define TIMEOUT "2"
+#define QUIET "10.0.0.1:1"
+#define CHATTY "10.0.0.2:2"
+
+static const char *const args[] = { "-e", TIMEOUT, NULL };
+
+static void members(int fd, char *out, size_t cap)
+{
+	char reply[4096];
+	size_t hdr = 2 + strlen(GROUP);
+	ssize_t n;
+
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) >= (ssize_t)(hdr + 2));
+	CHECK(reply[0] == LISTMEMBERS && (size_t)(n - hdr - 2) < cap);
+	memcpy(out, reply + hdr + 2, n - hdr - 2);
+	out[n - hdr - 2] = '\0';
+}
+
+// Heartbeat CHATTY for the given time
+static void chat(int fd, int ms)
+{
+	for(; ms > 0; ms -= 200) {
+		send_msg(fd, HEALTHCHECK, GROUP, CHATTY, strlen(CHATTY));
+		usleep(200000);
+	}
+}
+
+int main()
+{
+	char list[4096];
+	int fd;
+
+	spawn_smoke(PORT, args);
+	fd = connect_to(PORT);
+	send_msg(fd, JOINGROUP, GROUP, QUIET, strlen(QUIET));
+	send_msg(fd, JOINGROUP, GROUP, CHATTY, strlen(CHATTY));
+	members(fd, list, sizeof(list));
+	CHECK(strcmp(list, QUIET "," CHATTY ",") == 0);
+
+	// Well past the deadline, with the once a second timer
+	chat(fd, 4000);
+	members(fd, list, sizeof(list));
+	CHECK(strcmp(list, CHATTY ",") == 0);
+	printf("quiet member expired, heartbeating one kept\n");
+
+	// A second round trip, so the expiry is committed too
+	members(fd, list, sizeof(list));
+	close(fd);
+	kill_smoke();
+
+	spawn_smoke(PORT, args);
+	fd = connect_to(PORT);
+	members(fd, list, sizeof(list));
+	CHECK(strcmp(list, CHATTY ",") == 0);
+	printf("expiry survived a restart\n");
+
+	// Replayed members start out as seen at startup
+	sleep(4);
+	members(fd, list, sizeof(list));
+	CHECK(list[0] == '\0');
+	printf("replayed member expired without heartbeats\n");
+
+	// and rejoining works as ever
+	send_msg(fd, JOINGROUP, GROUP, QUIET, strlen(QUIET));
+	members(fd, list, sizeof(list));
+	CHECK(strcmp(list, QUIET ",") == 0);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/* Pattern subscribers closing while a group is broadcast to: once a
+ * subscriber's connection is gone and its fd number handed to a new
+ * connection, the new one must not get a single frame meant for the old
+ * one. Many more pattern subscribers (fake fds with no connection) make
+ * every broadcast slow to fan out, so closes keep landing mid-broadcast.
+ */
+#include <stdatomic.h>
+#include "harness.h"
+#include "group_manager.h"
+
+#define PORT "51721"
+#define GROUP "reuse.g"
+#define PATTERN "reuse.*"
+#define FIRST_FD 100000
+#define FAKE_SUBS 5000
+#define ROUNDS 1000
+
+static atomic_int running = 1;
+
+// "s" subscribes to PATTERN, anything else only asks; both get the fd back
+static void handle(int sockfd, char *msg, size_t msg_sz)
+{
+	struct iovec iov = { &sockfd, sizeof(sockfd) };
+
+	if(msg_sz == 1 && msg[0] == 's')
+		CHECK(sub_group_n(PATTERN, strlen(PATTERN), sockfd) == 0);
+	net_send_frame(sockfd, &iov, 1);
+}
+
+static void *broadcaster(void *arg)
+{
+	while(atomic_load(&running))
+		broadcast_group_n(GROUP, strlen(GROUP), "x", 1);
+	return NULL;
+}
+
+// Send req and return the fd the server answers with, skipping broadcasts
+static int server_fd(int fd, const char *req, int allow_broadcasts)
+{
+	char reply[512];
+	ssize_t n;
+	int sockfd;
+
+	send_frame(fd, req, strlen(req));
+	while((n = read_frame(fd, reply, sizeof(reply), 5000)) != (ssize_t)sizeof(sockfd)) {
+		CHECK(n > 0 && reply[0] == BROADCAST);
+		CHECK(allow_broadcasts);
+	}
+	memcpy(&sockfd, reply, sizeof(sockfd));
+	return sockfd;
+}
+
+int main()
+{
+	struct net_config conf = {
+		.port = PORT,
+		.num_reactors = 2,
+		.backend = NET_BACKEND_EPOLL,
+		.on_close = unsub_all_groups,
+	};
+	char reply[512];
+	pthread_t tid;
+	int idx, sub, fresh, old_fd, reused = 0;
+
+	set_group_dir(test_group_dir());
+	CHECK(initialize_group_manager() == 0);
+	CHECK(join_group(GROUP, "10.0.0.1:1") == 0);
+	for(idx = 0; idx < FAKE_SUBS; ++idx)
+		CHECK(sub_group_n(PATTERN, strlen(PATTERN), FIRST_FD + idx) == 0);
+	start_server(&conf, handle);
+	CHECK(pthread_create(&tid, NULL, broadcaster, NULL) == 0);
+
+	for(idx = 0; idx < ROUNDS; ++idx) {
+		sub = connect_to(PORT);
+		old_fd = server_fd(sub, "s", 1);
+		close(sub);
+
+		fresh = connect_to(PORT);
+		if(server_fd(fresh, "h", 0) == old_fd)
+			reused++;
+		CHECK(read_frame(fresh, reply, sizeof(reply), 2) == -1);
+		close(fresh);
+	}
+	atomic_store(&running, 0);
+	pthread_join(tid, NULL);
+	CHECK(reused > 0);
+	printf("%d of %d new connections reused a pattern subscriber's fd, none got its broadcasts\n",
+		reused, ROUNDS);
+	return 0;
+}
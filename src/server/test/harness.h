@@ -0,0 +1,248 @@
+#ifndef _HARNESS_H
+#define _HARNESS_H
+/* Helpers shared by the tests and benchmarks: a clock, a blocking
+ * client speaking the wire protocol and ways to run a server, either
+ * in process or as a ./smoke child. Everything is static, each program
+ * includes this once.
+ * Failures go to stdout, the server's own chatter to stderr.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "networking.h"
+#include "msgproto.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while(0)
+
+static inline double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void *loop_thread(void *arg)
+{
+	start_networking_loop();
+	return NULL;
+}
+
+/* Bring up networking with conf and run the reactors on a thread of
+ * their own. The loop never returns, the process exiting ends it.
+ */
+static inline void start_server(const struct net_config *conf, handler_t h_func)
+{
+	pthread_t tid;
+
+	CHECK(init_networking(conf, h_func) == 0);
+	CHECK(pthread_create(&tid, NULL, loop_thread, NULL) == 0);
+	pthread_detach(tid);
+}
+
+static inline int connect_to(const char *port)
+{
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+	int fd, one = 1, tries;
+
+	CHECK(getaddrinfo("127.0.0.1", port, &hints, &res) == 0);
+	CHECK((fd = socket(res->ai_family, res->ai_socktype, 0)) != -1);
+	// The server may still be coming up, for up to half a minute when
+	// it has a lot of groups to load
+	for(tries = 0; connect(fd, res->ai_addr, res->ai_addrlen) == -1; ++tries) {
+		CHECK(tries < 30000);
+		usleep(1000);
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	freeaddrinfo(res);
+	return fd;
+}
+
+static pid_t smoke_pid;
+static char scratch[] = "/tmp/smoke_test.XXXXXX";
+static char group_dir[sizeof(scratch) + 8];
+
+// Like a crash: the group directory is left for the next spawn_smoke
+static inline void kill_smoke()
+{
+	if(smoke_pid <= 0)
+		return;
+	kill(smoke_pid, SIGKILL);
+	waitpid(smoke_pid, NULL, 0);
+	smoke_pid = 0;
+}
+
+static inline void clean_up_scratch()
+{
+	char cmd[64];
+
+	kill_smoke();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch);
+	if(system(cmd) != 0)
+		fprintf(stderr, "Failed to remove %s\n", scratch);
+}
+
+/* Where the server under test keeps its groups: a directory inside one
+ * of our own that goes away at exit. The server creates it.
+ */
+static inline const char *test_group_dir()
+{
+	if(group_dir[0] == '\0') {
+		CHECK(mkdtemp(scratch) != NULL);
+		snprintf(group_dir, sizeof(group_dir), "%s/groups", scratch);
+		atexit(clean_up_scratch);
+	}
+	return group_dir;
+}
+
+// Lots of connections on both ends of one box
+static inline void raise_fd_limit()
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/* Run ./smoke (so from src/server) on port with the NULL terminated
+ * args, its groups in test_group_dir() so they outlive kill_smoke, and
+ * wait until it takes connections. Its output goes to /dev/null unless
+ * SMOKE_LOG is set. It is killed at exit.
+ */
+static inline void spawn_smoke(const char *port, const char *const args[])
+{
+	const char *argv[32] = { "./smoke", "-p", port, "-d", test_group_dir() };
+	int argc = 5, devnull;
+
+	for(; args && *args; ++args) {
+		CHECK(argc < 31);
+		argv[argc++] = *args;
+	}
+	argv[argc] = NULL;
+
+	CHECK((smoke_pid = fork()) != -1);
+	if(smoke_pid == 0) {
+		if(getenv("SMOKE_LOG") == NULL && (devnull = open("/dev/null", O_WRONLY)) != -1) {
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		execv(argv[0], (char *const *)argv);
+		_exit(127);
+	}
+	close(connect_to(port));
+}
+
+static inline void write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while(len > 0) {
+		CHECK((n = write(fd, p, len)) > 0);
+		p += n;
+		len -= n;
+	}
+}
+
+// Frame msg the way the server expects it: SMOKEMAGIC, length, body
+static inline void send_frame(int fd, const void *msg, size_t len)
+{
+	char buf[8 + 65536 + 512];
+	uint32_t hdr[2] = { htonl(SMOKEMAGIC), htonl(len) };
+
+	CHECK(len <= sizeof(buf) - 8);
+	memcpy(buf, hdr, 8);
+	memcpy(buf + 8, msg, len);
+	write_all(fd, buf, 8 + len);
+}
+
+/* Build TYPE|GLEN|GROUPNAME, followed by LEN|body if body is not NULL.
+ * Returns the message length.
+ */
+static inline size_t build_msg(char *out, int type, const char *group, const void *body, size_t body_len)
+{
+	size_t glen = strlen(group), off;
+
+	out[0] = type;
+	out[1] = glen;
+	memcpy(out + 2, group, glen);
+	off = 2 + glen;
+	if(body == NULL)
+		return off;
+	out[off] = body_len >> 8;
+	out[off + 1] = body_len & 0xff;
+	memcpy(out + off + 2, body, body_len);
+	return off + 2 + body_len;
+}
+
+static inline void send_msg(int fd, int type, const char *group, const void *body, size_t body_len)
+{
+	char msg[2 + 255 + 2 + 65535];
+
+	send_frame(fd, msg, build_msg(msg, type, group, body, body_len));
+}
+
+static inline int read_full(int fd, void *data, size_t len, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char *p = data;
+	ssize_t n;
+
+	while(len > 0) {
+		if(poll(&pfd, 1, timeout_ms) != 1)
+			return -1;
+		if((n = read(fd, p, len)) <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read one frame's body into buf. Returns its length, or -1 on timeout,
+ * EOF or a frame that does not fit.
+ */
+static inline ssize_t read_frame(int fd, char *buf, size_t cap, int timeout_ms)
+{
+	uint32_t hdr[2];
+
+	if(read_full(fd, hdr, sizeof(hdr), timeout_ms) == -1)
+		return -1;
+	CHECK(ntohl(hdr[0]) == SMOKEMAGIC);
+	if(ntohl(hdr[1]) > cap)
+		return -1;
+	if(read_full(fd, buf, ntohl(hdr[1]), timeout_ms) == -1)
+		return -1;
+	return ntohl(hdr[1]);
+}
+
+#endif /* _HARNESS_H */
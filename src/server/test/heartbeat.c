@@ -0,0 +1,86 @@
+/* Batched heartbeats through ./smoke -e: HEALTHCHECK_GROUPS keeps one
+ * member alive in exactly the groups it lists, HEALTHCHECK_MEMBERS
+ * keeps exactly the listed members of one group alive, and neither
+ * creates a group or adds a member that was not there. A batch cut
+ * short still counts for the entries before the cut.
+ */
+#include "harness.h"
+
+#define PORT "51691"
+#define MEMBER "10.0.0.1:1"
+
+static const char *const args[] = { "-e", "2", NULL };
+
+// The member list of group, or NULL if there is no such group
+static char *members(int fd, const char *group)
+{
+	static char reply[4096], out[4096];
+	size_t hdr = 2 + strlen(group);
+	ssize_t n;
+
+	send_msg(fd, LISTMEMBERS, group, NULL, 0);
+	if((n = read_frame(fd, reply, sizeof(reply), 500)) == -1)
+		return NULL;
+	CHECK(reply[0] == LISTMEMBERS && n >= (ssize_t)(hdr + 2));
+	memcpy(out, reply + hdr + 2, n - hdr - 2);
+	out[n - hdr - 2] = '\0';
+	return out;
+}
+
+// Append GLEN|GROUPNAME to a HEALTHCHECK_GROUPS list
+static size_t add_group(char *list, size_t len, const char *group)
+{
+	list[len] = strlen(group);
+	memcpy(list + len + 1, group, strlen(group));
+	return len + 1 + strlen(group);
+}
+
+int main()
+{
+	char groups[256], cut[256];
+	const char *hc = "10.0.1.1:1,10.0.1.2:2,10.0.1.9:9,";
+	size_t groups_len = 0, cut_len = 0;
+	int fd, ms;
+
+	spawn_smoke(PORT, args);
+	fd = connect_to(PORT);
+	send_msg(fd, JOINGROUP, "hb.a", MEMBER, strlen(MEMBER));
+	send_msg(fd, JOINGROUP, "hb.b", MEMBER, strlen(MEMBER));
+	send_msg(fd, JOINGROUP, "hb.c", MEMBER, strlen(MEMBER));
+	send_msg(fd, JOINGROUP, "hb.m", "10.0.1.1:1", 10);
+	send_msg(fd, JOINGROUP, "hb.m", "10.0.1.2:2", 10);
+	send_msg(fd, JOINGROUP, "hb.m", "10.0.1.3:3", 10);
+
+	// hb.a and a group that does not exist in one batch; hb.b in one
+	// whose second entry claims more bytes than there are
+	groups_len = add_group(groups, groups_len, "hb.a");
+	groups_len = add_group(groups, groups_len, "hb.missing");
+	cut_len = add_group(cut, cut_len, "hb.b");
+	cut[cut_len++] = 40;
+	memcpy(cut + cut_len, "hb", 2);
+	cut_len += 2;
+
+	// Twice the timeout, with the once a second timer
+	for(ms = 0; ms < 4500; ms += 200) {
+		send_msg(fd, HEALTHCHECK_GROUPS, MEMBER, groups, groups_len);
+		send_msg(fd, HEALTHCHECK_GROUPS, MEMBER, cut, cut_len);
+		// 10.0.1.9:9 is not a member and must not become one
+		send_msg(fd, HEALTHCHECK_MEMBERS, "hb.m", hc, strlen(hc));
+		usleep(200000);
+	}
+
+	CHECK(strcmp(members(fd, "hb.a"), MEMBER ",") == 0);
+	CHECK(strcmp(members(fd, "hb.b"), MEMBER ",") == 0);
+	CHECK(strcmp(members(fd, "hb.c"), "") == 0);
+	CHECK(members(fd, "hb.missing") == NULL);
+	printf("HEALTHCHECK_GROUPS kept the member in exactly the listed groups\n");
+
+	CHECK(strcmp(members(fd, "hb.m"), "10.0.1.1:1,10.0.1.2:2,") == 0);
+	printf("HEALTHCHECK_MEMBERS kept exactly the listed members\n");
+
+	// Once the heartbeats stop, everyone goes
+	sleep(4);
+	CHECK(strcmp(members(fd, "hb.a"), "") == 0);
+	CHECK(strcmp(members(fd, "hb.m"), "") == 0);
+	return 0;
+}
@@ -0,0 +1,86 @@
+/* Member addresses over the wire: literal IPv4 and [IPv6] addresses
+ * with a port join without a reply, and anything else (a host name, a
+ * missing or out of range port) is answered with REQUEST_FAILED, never
+ * shows up in LISTMEMBERS and does not create the group. A join that
+ * fails for the group rather than the address says so.
+ */
+#include "harness.h"
+
+#define PORT "51641"
+#define GROUP "join"
+#define BAD_ADDRESS "members are a.b.c.d:port or [v6]:port"
+
+// The REQUEST_FAILED for a JOINGROUP that has to come next; returns its reason
+static char *join_failure(int fd, const char *group, size_t glen)
+{
+	static char reply[4096];
+	size_t hdr = 2 + glen;
+	ssize_t n;
+
+	CHECK((n = read_frame(fd, reply, sizeof(reply) - 1, 5000)) > (ssize_t)(hdr + 3));
+	CHECK(reply[0] == REQUEST_FAILED);
+	CHECK((size_t)(uint8_t)reply[1] == glen && memcmp(reply + 2, group, glen) == 0);
+	CHECK(reply[hdr + 2] == JOINGROUP);
+	reply[n] = '\0';
+	return reply + hdr + 3;
+}
+
+static const char *const accepted[] = { "10.0.0.1:80", "[::1]:8080", "[2001:db8::7]:65535" };
+static const char *const rejected[] = {
+	"cdn.example.com:80", "10.0.0.1", "10.0.0.1:0", "10.0.0.1:65536", "10.0.0.1:8o",
+	"[::1:80", "::1:80", "10.0.0.256:80",
+};
+
+int main()
+{
+	char reply[4096], list[4096], *reason;
+	size_t hdr = 2 + strlen(GROUP), idx, len;
+	ssize_t n;
+	int fd;
+
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+
+	for(idx = 0; idx < sizeof(rejected) / sizeof(rejected[0]); ++idx) {
+		send_msg(fd, JOINGROUP, GROUP, rejected[idx], strlen(rejected[idx]));
+		reason = join_failure(fd, GROUP, strlen(GROUP));
+		CHECK(strcmp(reason, BAD_ADDRESS) == 0);
+		printf("%-20s rejected: %s\n", rejected[idx], reason);
+	}
+
+	// A group name no group can have, with a good address
+	len = build_msg(reply, JOINGROUP, "?bad", accepted[0], strlen(accepted[0]));
+	reply[2] = '\0';
+	send_frame(fd, reply, len);
+	reason = join_failure(fd, "\0bad", 4);
+	CHECK(strcmp(reason, BAD_ADDRESS) != 0);
+	printf("%-20s rejected: %s\n", "group \\0bad", reason);
+
+	// Accepted joins are not answered, so the list is the next frame
+	for(idx = 0; idx < sizeof(accepted) / sizeof(accepted[0]); ++idx)
+		send_msg(fd, JOINGROUP, GROUP, accepted[idx], strlen(accepted[idx]));
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) > (ssize_t)(hdr + 2));
+	CHECK(reply[0] == LISTMEMBERS);
+	len = n - hdr - 2;
+	memcpy(list, reply + hdr + 2, len);
+	list[len] = '\0';
+
+	for(idx = 0; idx < sizeof(accepted) / sizeof(accepted[0]); ++idx) {
+		snprintf(reply, sizeof(reply), "%s,", accepted[idx]);
+		CHECK(strstr(list, reply) != NULL);
+	}
+	CHECK(strstr(list, "example") == NULL);
+	CHECK(strlen(list) == strlen("10.0.0.1:80,[::1]:8080,[2001:db8::7]:65535,"));
+	printf("members: %s\n", list);
+
+	// A refused join leaves no group behind, so the only reply is GROUP's
+	send_msg(fd, JOINGROUP, "join.none", rejected[0], strlen(rejected[0]));
+	join_failure(fd, "join.none", 9);
+	send_msg(fd, LISTMEMBERS, "join.none", NULL, 0);
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) > (ssize_t)hdr);
+	CHECK(reply[0] == LISTMEMBERS && memcmp(reply + 2, GROUP, strlen(GROUP)) == 0);
+	printf("a refused join created no group\n");
+	return 0;
+}
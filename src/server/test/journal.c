@@ -0,0 +1,195 @@
+/* Restarts of ./smoke on the same group directory:
+ *  - group files left by the one-file-per-group layouts, text and
+ *    records, are imported into the journal and removed; host names in
+ *    the text kind are dropped
+ *  - a directory holding a group file the server cannot read keeps it
+ *    and refuses to start
+ *  - a snapshot in which every group is empty (compaction after enough
+ *    churn) loads again
+ *  - changes committed while the snapshot is written in the background
+ *    survive a kill, whether it lands before the snapshot is in place
+ *    or after
+ */
+#include <sys/stat.h>
+#include "harness.h"
+
+#define PORT "51661"
+#define CHURN 40000 // join/leave pairs, well past the 1MB compaction threshold
+
+// The record layout group files had before the journal
+struct legacy_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;
+	uint32_t count;
+	uint8_t reserved[48];
+};
+
+struct legacy_record {
+	int64_t last_seen;
+	uint8_t addr[16];
+	uint16_t port;
+	uint8_t family;
+	uint8_t pad[5];
+};
+
+static void write_file(const char *name, const void *data, size_t len)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", test_group_dir(), name);
+	CHECK((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1);
+	write_all(fd, data, len);
+	close(fd);
+}
+
+static int file_exists(const char *name)
+{
+	char path[256];
+	struct stat statb;
+
+	snprintf(path, sizeof(path), "%s/%s", test_group_dir(), name);
+	return stat(path, &statb) == 0;
+}
+
+// The snapshot is written in the background
+static int wait_for_file(const char *name)
+{
+	int ms;
+
+	for(ms = 0; ms < 5000 && !file_exists(name); ++ms)
+		usleep(1000);
+	return file_exists(name);
+}
+
+static void write_records_file(const char *name, uint16_t version)
+{
+	char buf[sizeof(struct legacy_header) + 8 + 64 * sizeof(struct legacy_record)];
+	struct legacy_header hdr = { 0x474b4d53, version, sizeof(struct legacy_record), 64, 2 };
+	struct legacy_record rec;
+	uint64_t bitmap = 1ULL << 0 | 1ULL << 5;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &bitmap, sizeof(bitmap));
+
+	memset(&rec, 0, sizeof(rec));
+	rec.family = 4;
+	inet_pton(AF_INET, "192.168.1.1", rec.addr);
+	rec.port = htons(9000);
+	memcpy(buf + sizeof(hdr) + 8, &rec, sizeof(rec));
+	rec.family = 6;
+	inet_pton(AF_INET6, "fe80::1", rec.addr);
+	rec.port = htons(9001);
+	memcpy(buf + sizeof(hdr) + 8 + 5 * sizeof(rec), &rec, sizeof(rec));
+	write_file(name, buf, sizeof(buf));
+}
+
+// The member list of group, or NULL if the group does not exist
+static char *list(int fd, const char *group)
+{
+	static char reply[65536], out[65536];
+	size_t hdr = 2 + strlen(group);
+	ssize_t n;
+
+	send_msg(fd, LISTMEMBERS, group, NULL, 0);
+	if((n = read_frame(fd, reply, sizeof(reply), 500)) == -1)
+		return NULL;
+	CHECK(reply[0] == LISTMEMBERS && n >= (ssize_t)(hdr + 2));
+	memcpy(out, reply + hdr + 2, n - hdr - 2);
+	out[n - hdr - 2] = '\0';
+	return out;
+}
+
+// Runs ./smoke expecting it to give up; returns its exit status
+static int smoke_status()
+{
+	const char *argv[] = { "./smoke", "-p", PORT, "-d", test_group_dir(), NULL };
+	int status, devnull;
+	pid_t pid;
+
+	CHECK((pid = fork()) != -1);
+	if(pid == 0) {
+		if(getenv("SMOKE_LOG") == NULL && (devnull = open("/dev/null", O_WRONLY)) != -1) {
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		execv(argv[0], (char *const *)argv);
+		_exit(127);
+	}
+	CHECK(waitpid(pid, &status, 0) == pid);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main()
+{
+	const char text[] = "10.0.0.1:80,cdn.example.com:81,[::1]:82,";
+	char *members;
+	int fd, idx;
+
+	// A directory as the old server left it
+	CHECK(mkdir(test_group_dir(), 0700) == 0);
+	write_file(".lasttime", "", 0);
+	write_file("legacy.text", text, strlen(text));
+	write_records_file("legacy.records", 1);
+	write_file("legacy.empty", "", 0);
+
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+	CHECK((members = list(fd, "legacy.text")) != NULL);
+	CHECK(strcmp(members, "10.0.0.1:80,[::1]:82,") == 0);
+	CHECK((members = list(fd, "legacy.records")) != NULL);
+	CHECK(strcmp(members, "192.168.1.1:9000,[fe80::1]:9001,") == 0);
+	CHECK((members = list(fd, "legacy.empty")) != NULL && members[0] == '\0');
+	CHECK(!file_exists("legacy.text") && !file_exists("legacy.records") && !file_exists("legacy.empty"));
+	printf("imported the text, record and empty group files\n");
+
+	// Empty every group and churn until the journal compacts
+	send_msg(fd, LEAVEGROUP, "legacy.text", "10.0.0.1:80", 11);
+	send_msg(fd, LEAVEGROUP, "legacy.text", "[::1]:82", 8);
+	send_msg(fd, LEAVEGROUP, "legacy.records", "192.168.1.1:9000", 16);
+	send_msg(fd, LEAVEGROUP, "legacy.records", "[fe80::1]:9001", 14);
+	for(idx = 0; idx < CHURN; ++idx) {
+		send_msg(fd, JOINGROUP, "churn", "10.1.1.1:1", 10);
+		send_msg(fd, LEAVEGROUP, "churn", "10.1.1.1:1", 10);
+	}
+	// Changes are committed after the iteration that made them, which
+	// is over once a second round trip is answered. Made right away,
+	// these land while the snapshot is being written.
+	send_msg(fd, JOINGROUP, "compacting", "10.2.2.2:2", 10);
+	CHECK((members = list(fd, "churn")) != NULL && members[0] == '\0');
+	CHECK((members = list(fd, "churn")) != NULL && members[0] == '\0');
+	close(fd);
+	kill_smoke();
+
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+	CHECK((members = list(fd, "compacting")) != NULL && strcmp(members, "10.2.2.2:2,") == 0);
+	send_msg(fd, LEAVEGROUP, "compacting", "10.2.2.2:2", 10);
+	CHECK((members = list(fd, "compacting")) != NULL && members[0] == '\0');
+	CHECK((members = list(fd, "compacting")) != NULL && members[0] == '\0');
+	CHECK(wait_for_file("snapshot"));
+	close(fd);
+	kill_smoke();
+	printf("kept what was committed during compaction\n");
+
+	// Every group in that snapshot is empty
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+	CHECK((members = list(fd, "churn")) != NULL && members[0] == '\0');
+	CHECK((members = list(fd, "legacy.text")) != NULL && members[0] == '\0');
+	CHECK((members = list(fd, "compacting")) != NULL && members[0] == '\0');
+	CHECK(list(fd, "absent") == NULL);
+	close(fd);
+	kill_smoke();
+	printf("restarted from a snapshot of empty groups\n");
+
+	// A record file of a version we never wrote
+	write_records_file("legacy.future", 9);
+	CHECK(smoke_status() == 1);
+	CHECK(file_exists("legacy.future"));
+	printf("refused to start over an unreadable group file\n");
+	return 0;
+}
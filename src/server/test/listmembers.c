@@ -0,0 +1,78 @@
+/* A member list too long for one frame: LISTMEMBERS has to be answered
+ * with LISTMEMBERS_PART frames, each within the 65535 byte STRLEN and
+ * ending on a whole member, then a final LISTMEMBERS, which together
+ * list every member exactly once. A short list stays a single frame.
+ */
+#include "harness.h"
+
+#define PORT "51651"
+#define GROUP "listmembers"
+#define MEMBERS 8000 // "[2001:db8::xxxx]:pppp," is about 24 bytes
+
+static char list[MEMBERS * 64];
+
+// Read a whole reply into list; returns its length, counts the frames
+static size_t read_list(int fd, int *frames)
+{
+	static char reply[2 + 255 + 2 + 65535];
+	size_t hdr = 2 + strlen(GROUP), len, total = 0;
+	ssize_t n;
+
+	*frames = 0;
+	do {
+		CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) >= (ssize_t)(hdr + 2));
+		CHECK(reply[0] == LISTMEMBERS_PART || reply[0] == LISTMEMBERS);
+		CHECK(memcmp(reply + 2, GROUP, strlen(GROUP)) == 0);
+		len = (size_t)(uint8_t)reply[hdr] << 8 | (uint8_t)reply[hdr + 1];
+		CHECK(len == n - hdr - 2);
+		// Pieces hold whole members
+		CHECK(len == 0 || reply[hdr + 2 + len - 1] == ',');
+		CHECK(total + len < sizeof(list));
+		memcpy(list + total, reply + hdr + 2, len);
+		total += len;
+		(*frames)++;
+	} while(reply[0] == LISTMEMBERS_PART);
+	list[total] = '\0';
+	return total;
+}
+
+int main()
+{
+	char addr[64], *seen;
+	size_t len, first_len;
+	int fd, idx, frames;
+	unsigned int a, p;
+
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+
+	send_msg(fd, JOINGROUP, GROUP, "10.0.0.1:80", 11);
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	read_list(fd, &frames);
+	CHECK(frames == 1);
+	CHECK(strcmp(list, "10.0.0.1:80,") == 0);
+	send_msg(fd, LEAVEGROUP, GROUP, "10.0.0.1:80", 11);
+
+	for(idx = 0; idx < MEMBERS; ++idx) {
+		len = snprintf(addr, sizeof(addr), "[2001:db8::%x]:%u", idx + 1, 1000 + idx);
+		send_msg(fd, JOINGROUP, GROUP, addr, len);
+	}
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	first_len = read_list(fd, &frames);
+	CHECK(frames > 1);
+	printf("%d members listed in %d frames, %zu bytes\n", MEMBERS, frames, first_len);
+
+	CHECK((seen = calloc(MEMBERS, 1)) != NULL);
+	for(idx = 0, len = 0; len < first_len; ++idx) {
+		CHECK(sscanf(list + len, "[2001:db8::%x]:%u,", &a, &p) == 2);
+		CHECK(a >= 1 && a <= MEMBERS && p == 999 + a && !seen[a - 1]);
+		seen[a - 1] = 1;
+		len = strchr(list + len, ',') - list + 1;
+	}
+	CHECK(idx == MEMBERS);
+
+	// The cached reply the next poller gets is the same
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+	CHECK(read_list(fd, &idx) == first_len && idx == frames);
+	return 0;
+}
@@ -0,0 +1,84 @@
+/* A subscriber that stops reading under NET_OVERFLOW_DROP_OLDEST: what
+ * it gets afterwards has to be the newest broadcasts in order, and the
+ * group's dropped count has to account for every frame it never saw,
+ * including calls that had to throw out several small frames to fit one
+ * big one.
+ */
+#include "harness.h"
+#include "group_manager.h"
+
+#define GROUP "overflow"
+#define COUNT 20000
+
+static void handle(int sockfd, char *msg, size_t msg_sz)
+{
+	struct iovec iov = { "ok", 2 };
+
+	CHECK(sub_group_n(GROUP, strlen(GROUP), sockfd) == 0);
+	net_send_frame(sockfd, &iov, 1);
+}
+
+// A small receive window keeps the kernel from soaking up the backlog
+static int connect_small(const char *port)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	int fd, rcvbuf = 4096;
+
+	addr.sin_port = htons(atoi(port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CHECK((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+	CHECK(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+	CHECK(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	return fd;
+}
+
+int main()
+{
+	struct net_config conf = {
+		.port = "51631",
+		.num_reactors = 1,
+		.backend = NET_BACKEND_EPOLL,
+		.max_queued = 16384,
+		.overflow_policy = NET_OVERFLOW_DROP_OLDEST,
+		.on_close = unsub_all_groups,
+	};
+	char msg[8192], reply[8192];
+	unsigned long dropped, evicted;
+	uint32_t idx, seen, received = 0, last = 0;
+	size_t len, hdr = 2 + strlen(GROUP) + 2;
+	ssize_t n;
+	int fd;
+
+	set_group_dir(test_group_dir());
+	CHECK(initialize_group_manager() == 0);
+	CHECK(join_group(GROUP, "10.0.0.1:1") == 0);
+	start_server(&conf, handle);
+
+	fd = connect_small(conf.port);
+	send_frame(fd, "sub", 3);
+	CHECK(read_frame(fd, reply, sizeof(reply), 5000) == 2);
+
+	// Runs of small frames and then a big one, which evicts many
+	memset(msg, 'x', sizeof(msg));
+	for(idx = 0; idx < COUNT; ++idx) {
+		len = idx % 10 == 9 ? 8000 : 100;
+		memcpy(msg, &idx, sizeof(idx));
+		CHECK(broadcast_group_n(GROUP, strlen(GROUP), msg, len) == 1);
+	}
+
+	while((n = read_frame(fd, reply, sizeof(reply), 500)) != -1) {
+		CHECK((size_t)n > hdr && reply[0] == BROADCAST);
+		memcpy(&seen, reply + hdr, sizeof(seen));
+		CHECK(received == 0 || seen > last);
+		last = seen;
+		received++;
+	}
+	CHECK(last == COUNT - 1);
+	CHECK(received < COUNT);
+
+	CHECK(group_overflow_stats(GROUP, &dropped, &evicted) == 0);
+	CHECK(evicted == 0);
+	CHECK(dropped == COUNT - received);
+	printf("%u of %u broadcasts delivered, %lu counted as dropped\n", received, COUNT, dropped);
+	return 0;
+}
@@ -0,0 +1,127 @@
+/* Map growth under load. hashmap.c is linked three ways: as is, moving
+ * MIGRATE_GROUPS groups per write; built with migration of the whole
+ * old table on the first write after a resize, i.e. a stop-the-world
+ * resize (stw_*); and built to never migrate on writes, so every resize
+ * has to finish the previous one first (lazy_*).
+ *
+ * Inserting 2M keys goes through fifteen resizes, and a few percent of
+ * the inserts land while one is being drained, so the p99.9 insert time
+ * is that of an insert paying for its share of a migration. For the
+ * incremental map it has to stay within what moving MIGRATE_SLOTS slots
+ * can cost, however big the table has grown: a page fault into the new
+ * table and SLOT_NS a slot. The slowest inserts, which
+ * allocate the new tables, are only reported: one preemption would
+ * decide them. Every variant has to still find (and then remove) every
+ * key.
+ */
+#include "harness.h"
+#include "hashmap.h"
+
+#define KEYS 2000000
+#define RUNS 3
+#define MIGRATE_SLOTS 32 // per write: MIGRATE_GROUPS (2) groups of GROUP_WIDTH (16), see hashmap.c
+#define FAULT_NS 10000 // a migrating write's first touch of a page of the new table
+#define SLOT_NS 100 // moving one slot: a rehash and a probe into the new table
+
+#define HASHMAP_API(p) \
+	void *p##_initialize_map(); \
+	void p##_map_destroy(void *map, void (*free_data)(void *)); \
+	int p##_map_put(void *map, char *key, void *data); \
+	void *p##_map_get(void *map, char *key); \
+	void *p##_map_remove(void *map, char *key);
+HASHMAP_API(stw)
+HASHMAP_API(lazy)
+
+struct impl {
+	const char *name;
+	void *(*create)();
+	void (*destroy)(void *map, void (*free_data)(void *));
+	int (*put)(void *map, char *key, void *data);
+	void *(*get)(void *map, char *key);
+	void *(*remove)(void *map, char *key);
+};
+
+static const struct impl incremental = {
+	"incremental", initialize_map, map_destroy, map_put, map_get, map_remove
+};
+static const struct impl stop_the_world = {
+	"stop-the-world", stw_initialize_map, stw_map_destroy, stw_map_put, stw_map_get, stw_map_remove
+};
+static const struct impl lazy = {
+	"lazy", lazy_initialize_map, lazy_map_destroy, lazy_map_put, lazy_map_get, lazy_map_remove
+};
+
+static char *keys[KEYS];
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Insert every key, timing each put; returns the p99.9 in ns and checks
+ * everything is still there (half of it mid-migration, since the last
+ * resize is still being drained at that point).
+ */
+static uint64_t fill(const struct impl *impl, uint64_t *times)
+{
+	uint64_t start;
+	void *map;
+	long idx;
+
+	CHECK((map = impl->create()) != NULL);
+	for(idx = 0; idx < KEYS; ++idx) {
+		start = now_ns();
+		CHECK(impl->put(map, keys[idx], keys[idx]) == 0);
+		times[idx] = now_ns() - start;
+	}
+	for(idx = 0; idx < KEYS; ++idx)
+		CHECK(impl->get(map, keys[idx]) == keys[idx]);
+	// Removes move migration along too
+	for(idx = 0; idx < KEYS; idx += 2)
+		CHECK(impl->remove(map, keys[idx]) == keys[idx]);
+	for(idx = 0; idx < KEYS; ++idx)
+		CHECK(impl->get(map, keys[idx]) == (idx % 2 ? keys[idx] : NULL));
+	impl->destroy(map, NULL);
+
+	qsort(times, KEYS, sizeof(uint64_t), cmp_u64);
+	printf("%-14s p50 %5lu ns  p99.9 %6lu ns  max %9lu ns\n", impl->name,
+		(unsigned long)times[KEYS / 2], (unsigned long)times[KEYS - KEYS / 1000],
+		(unsigned long)times[KEYS - 1]);
+	return times[KEYS - KEYS / 1000];
+}
+
+// The quietest of a few runs, so a busy machine cannot decide it
+static uint64_t best_p999(const struct impl *impl, uint64_t *times)
+{
+	uint64_t p999, best = UINT64_MAX;
+	int run;
+
+	for(run = 0; run < RUNS; ++run) {
+		if((p999 = fill(impl, times)) < best)
+			best = p999;
+	}
+	return best;
+}
+
+int main()
+{
+	uint64_t *times, inc;
+	char buf[32];
+	long idx;
+
+	for(idx = 0; idx < KEYS; ++idx) {
+		snprintf(buf, sizeof(buf), "member.%ld", idx);
+		CHECK((keys[idx] = strdup(buf)) != NULL);
+	}
+	CHECK((times = malloc(KEYS * sizeof(uint64_t))) != NULL);
+
+	// For comparison
+	fill(&lazy, times);
+	fill(&stop_the_world, times);
+
+	inc = best_p999(&incremental, times);
+	CHECK(inc < FAULT_NS + MIGRATE_SLOTS * SLOT_NS);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/* Broadcast retention through ./smoke -r: sockets that subscribed with
+ * SUBGROUP_FROM get BROADCAST_SEQ, numbered from 1 and replayed from the
+ * number they asked for, while SUBGROUP and pattern subscribers on the
+ * same group keep getting plain BROADCAST. Subscribing again switches a
+ * socket between the two.
+ */
+#include "harness.h"
+
+#define PORT "51701"
+#define GROUP "retain.g"
+#define MEMBER "10.0.0.1:1"
+
+static const char *const args[] = { "-r", "8", NULL };
+
+/* Subscribe, then ask for the member list; once the reply is in (see
+ * synced), so is the subscription, after any replay
+ */
+static void subscribe(int fd, int type, const char *group, uint64_t from)
+{
+	from = htobe64(from);
+	send_msg(fd, type, group, type == SUBGROUP_FROM ? (char *)&from : NULL, sizeof(from));
+	send_msg(fd, LISTMEMBERS, GROUP, NULL, 0);
+}
+
+static void synced(int fd)
+{
+	char reply[4096];
+
+	CHECK(read_frame(fd, reply, sizeof(reply), 5000) > 0 && reply[0] == LISTMEMBERS);
+}
+
+/* The next frame is a broadcast of msg to GROUP, numbered seq if seq is
+ * not 0 and plain otherwise
+ */
+static void expect(int fd, const char *msg, uint64_t seq)
+{
+	char reply[4096];
+	size_t off = 2 + strlen(GROUP);
+	uint64_t wire_seq;
+	ssize_t n;
+
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) > (ssize_t)off);
+	CHECK(reply[0] == (seq ? BROADCAST_SEQ : BROADCAST));
+	CHECK(memcmp(reply + 2, GROUP, strlen(GROUP)) == 0);
+	if(seq) {
+		memcpy(&wire_seq, reply + off, sizeof(wire_seq));
+		CHECK(be64toh(wire_seq) == seq);
+		off += sizeof(wire_seq);
+	}
+	CHECK((size_t)n == off + 2 + strlen(msg));
+	CHECK(memcmp(reply + off + 2, msg, strlen(msg)) == 0);
+}
+
+static void broadcast(int fd, const char *msg)
+{
+	send_msg(fd, BROADCAST, GROUP, msg, strlen(msg));
+}
+
+int main()
+{
+	int pub, plain, numbered, pattern, late;
+
+	spawn_smoke(PORT, args);
+	pub = connect_to(PORT);
+	send_msg(pub, JOINGROUP, GROUP, MEMBER, strlen(MEMBER));
+	plain = connect_to(PORT);
+	subscribe(plain, SUBGROUP, GROUP, 0);
+	synced(plain);
+	numbered = connect_to(PORT);
+	subscribe(numbered, SUBGROUP_FROM, GROUP, 1);
+	synced(numbered);
+	pattern = connect_to(PORT);
+	subscribe(pattern, SUBGROUP, "retain.*", 0);
+	synced(pattern);
+
+	broadcast(pub, "one");
+	broadcast(pub, "two");
+	broadcast(pub, "three");
+	expect(plain, "one", 0);
+	expect(plain, "two", 0);
+	expect(plain, "three", 0);
+	expect(pattern, "one", 0);
+	expect(pattern, "two", 0);
+	expect(pattern, "three", 0);
+	expect(numbered, "one", 1);
+	expect(numbered, "two", 2);
+	expect(numbered, "three", 3);
+	printf("only the SUBGROUP_FROM subscriber got BROADCAST_SEQ\n");
+
+	// Catching up, then live
+	late = connect_to(PORT);
+	subscribe(late, SUBGROUP_FROM, GROUP, 2);
+	expect(late, "two", 2);
+	expect(late, "three", 3);
+	synced(late);
+	broadcast(pub, "four");
+	expect(late, "four", 4);
+	expect(numbered, "four", 4);
+	expect(plain, "four", 0);
+	expect(pattern, "four", 0);
+	printf("replayed from 2 and carried on numbered\n");
+
+	// Swap the two over
+	subscribe(plain, SUBGROUP_FROM, GROUP, 5);
+	synced(plain);
+	subscribe(numbered, SUBGROUP, GROUP, 0);
+	synced(numbered);
+	broadcast(pub, "five");
+	expect(plain, "five", 5);
+	expect(numbered, "five", 0);
+	expect(late, "five", 5);
+	printf("subscribing again switched between the two\n");
+	return 0;
+}
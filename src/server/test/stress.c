@@ -0,0 +1,217 @@
+/* Every group_manager entry point from many threads at once: groups
+ * created and deleted under members joining, leaving and heartbeating,
+ * subscribers coming and going, and broadcasts and member lists served
+ * through the lock-free lookups meanwhile. Built with -fsanitize=thread
+ * (see the Makefile), which fails the run on the first data race; what
+ * is checked here is that nothing crashes and that the manager still
+ * answers correctly once the threads are done.
+ *
+ * Subscribers are plain fd numbers with no connection behind them, so
+ * broadcasts run the whole fan-out path up to net_send_buf, which then
+ * finds nobody to write to.
+ *
+ * Usage: stress [seconds]
+ */
+#include <stdatomic.h>
+#include "harness.h"
+#include "group_manager.h"
+
+#define GROUPS 16
+#define MEMBERS 64
+#define FIRST_FD 100000
+
+// Stop at the first race rather than report them all at exit
+const char *__tsan_default_options()
+{
+	return "halt_on_error=1";
+}
+
+static atomic_int running = 1;
+static atomic_long ops;
+
+static void group_name(char *buf, unsigned int idx)
+{
+	sprintf(buf, "stress.%u", idx % GROUPS);
+}
+
+static void member_addr(char *buf, unsigned int idx)
+{
+	sprintf(buf, "10.0.%u.%u:%u", idx % MEMBERS / 16, idx % 16 + 1, 8000 + idx % MEMBERS);
+}
+
+static void *admin(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	char name[32];
+	long count = 0;
+
+	while(atomic_load(&running)) {
+		group_name(name, rand_r(&seed));
+		if(rand_r(&seed) % 4)
+			create_group(name);
+		else
+			delete_group(name);
+		count++;
+	}
+	atomic_fetch_add(&ops, count);
+	return NULL;
+}
+
+static void *members(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	char name[32], addr[32], batch[256];
+	size_t batch_len;
+	long count = 0;
+	int idx;
+
+	while(atomic_load(&running)) {
+		group_name(name, rand_r(&seed));
+		member_addr(addr, rand_r(&seed));
+		switch(rand_r(&seed) % 5) {
+		case 0:
+		case 1:
+			join_group(name, addr);
+			break;
+		case 2:
+			leave_group(name, addr);
+			break;
+		case 3:
+			healthcheck_group(name, addr);
+			break;
+		case 4:
+			// One address heartbeating several groups at once
+			batch_len = 0;
+			for(idx = 0; idx < 4; ++idx) {
+				group_name(name, rand_r(&seed));
+				batch[batch_len] = strlen(name);
+				memcpy(batch + batch_len + 1, name, strlen(name));
+				batch_len += 1 + strlen(name);
+			}
+			healthcheck_groups_n(addr, strlen(addr), batch, batch_len);
+			break;
+		}
+		count++;
+	}
+	atomic_fetch_add(&ops, count);
+	return NULL;
+}
+
+static void *subscribers(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	char name[32];
+	long count = 0;
+	int fd;
+
+	while(atomic_load(&running)) {
+		group_name(name, rand_r(&seed));
+		fd = FIRST_FD + rand_r(&seed) % 32;
+		switch(rand_r(&seed) % 6) {
+		case 0:
+		case 1:
+			sub_group(name, fd);
+			break;
+		case 2:
+			sub_group_from_n(name, strlen(name), fd, 0);
+			break;
+		case 3:
+			sub_group_watch_n(name, strlen(name), fd);
+			break;
+		case 4:
+			unsub_group(name, fd);
+			break;
+		case 5:
+			unsub_all_groups(fd);
+			break;
+		}
+		count++;
+	}
+	atomic_fetch_add(&ops, count);
+	return NULL;
+}
+
+static void *readers(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	char name[32], msg[256], *list;
+	long count = 0;
+
+	memset(msg, 'x', sizeof(msg));
+	while(atomic_load(&running)) {
+		group_name(name, rand_r(&seed));
+		switch(rand_r(&seed) % 4) {
+		case 0:
+		case 1:
+			broadcast_group_n(name, strlen(name), msg, rand_r(&seed) % sizeof(msg) + 1);
+			break;
+		case 2:
+			group_exists_n(name, strlen(name));
+			send_group_members_n(name, strlen(name), FIRST_FD);
+			break;
+		case 3:
+			if((list = retrieve_group_members(name)) != NULL)
+				free(list);
+			break;
+		}
+		count++;
+	}
+	atomic_fetch_add(&ops, count);
+	return NULL;
+}
+
+// What the reactors' on_iteration and on_timer hooks would be doing
+static void *housekeeping(void *arg)
+{
+	struct timespec pause = { 0, 1000000 };
+
+	while(atomic_load(&running)) {
+		commit_group_changes();
+		expire_members();
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+static const struct {
+	void *(*fn)(void *);
+	int count;
+} roles[] = {
+	{ admin, 2 }, { members, 4 }, { subscribers, 2 }, { readers, 4 }, { housekeeping, 1 },
+};
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[32];
+	char name[] = "stress.check", addr[] = "10.9.9.9:9", *list;
+	int seconds = argc > 1 ? atoi(argv[1]) : 3;
+	int role, idx, count = 0;
+
+	set_group_dir(test_group_dir());
+	set_member_timeout(1);
+	set_broadcast_retention(64, 0);
+	CHECK(initialize_group_manager() == 0);
+
+	for(role = 0; role < (int)(sizeof(roles) / sizeof(roles[0])); ++role) {
+		for(idx = 0; idx < roles[role].count; ++idx, ++count)
+			CHECK(pthread_create(&threads[count], NULL, roles[role].fn,
+				(void *)(uintptr_t)(count + 1)) == 0);
+	}
+	sleep(seconds);
+	atomic_store(&running, 0);
+	for(idx = 0; idx < count; ++idx)
+		pthread_join(threads[idx], NULL);
+	printf("%ld operations in %ds across %d threads\n", atomic_load(&ops), seconds, count);
+
+	// Still consistent afterwards
+	CHECK(join_group(name, addr) == 0);
+	CHECK(group_exists(name));
+	CHECK((list = retrieve_group_members(name)) != NULL);
+	CHECK(strstr(list, addr) != NULL);
+	free(list);
+	CHECK(leave_group(name, addr) == 0);
+	CHECK(delete_group(name) == 0);
+	CHECK(!group_exists(name));
+	commit_group_changes();
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* The timing wheel on its own: entries due anywhere from the next tick
+ * to past the top level's range, added as time moves on in uneven
+ * steps, some deleted and some re-armed from the callback, have to
+ * come up exactly once and exactly on their tick (clamped ones at the
+ * end of the range), however many levels they cascade through.
+ */
+#include "harness.h"
+#include "timer_wheel.h"
+
+#define ENTRIES 200000
+#define MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer {
+	struct wheel_entry entry; // first, so an entry is its timer
+	uint64_t due;
+	uint64_t fired_at;
+	int fired;
+	int rearm;
+};
+
+static struct timer timers[ENTRIES];
+static struct timer_wheel wheel;
+static long fired;
+
+static void fire(struct wheel_entry *e, void *arg)
+{
+	struct timer *t = (struct timer *)e;
+
+	CHECK(wheel.now == t->due);
+	if(t->rearm) {
+		// Once more, a level or two up
+		t->rearm = 0;
+		t->due = wheel.now + 1 + random() % 100000;
+		wheel_add(&wheel, e, t->due);
+		return;
+	}
+	t->fired++;
+	t->fired_at = wheel.now;
+	fired++;
+}
+
+static uint64_t random_delta()
+{
+	switch(random() % 4) {
+	case 0:
+		return 1 + random() % WHEEL_SLOTS;
+	case 1:
+		return 1 + random() % (WHEEL_SLOTS * WHEEL_SLOTS);
+	case 2:
+		return 1 + random() % (1 << 20);
+	default:
+		// Beyond the top level too
+		return 1 + random() % (2 * MAX_DELTA);
+	}
+}
+
+static void arm(struct timer *t, uint64_t expires)
+{
+	t->due = expires - wheel.now > MAX_DELTA ? wheel.now + MAX_DELTA : expires;
+	wheel_add(&wheel, &t->entry, expires);
+}
+
+int main()
+{
+	uint64_t now = 1000;
+	long idx, deleted = 0, added = 0;
+
+	srandom(1);
+	wheel_init(&wheel, now);
+
+	// Entries due exactly on a cascade boundary, where an entry comes
+	// down from a higher level on the very tick it is due
+	for(idx = 0; idx < WHEEL_LEVELS; ++idx, ++added)
+		arm(&timers[added], ((now >> (WHEEL_BITS * idx)) + 2) << (WHEEL_BITS * idx));
+
+	while(added < ENTRIES) {
+		for(idx = 0; idx < 1000 && added < ENTRIES; ++idx, ++added) {
+			timers[added].rearm = random() % 16 == 0;
+			arm(&timers[added], wheel.now + random_delta());
+		}
+		// Some never come up at all
+		for(idx = 0; idx < 10; ++idx) {
+			struct timer *t = &timers[random() % added];
+
+			if(wheel_armed(&t->entry) && !t->rearm) {
+				wheel_del(&t->entry);
+				t->fired = -1;
+				deleted++;
+			}
+		}
+		now += random() % 5000;
+		wheel_advance(&wheel, now, fire, NULL);
+	}
+	wheel_advance(&wheel, now + 2 * MAX_DELTA, fire, NULL);
+
+	for(idx = 0; idx < ENTRIES; ++idx) {
+		CHECK(!wheel_armed(&timers[idx].entry));
+		CHECK(timers[idx].fired == -1 || (timers[idx].fired == 1 && timers[idx].fired_at == timers[idx].due));
+	}
+	CHECK(fired + deleted == ENTRIES);
+	printf("%ld timers fired on their tick, %ld deleted\n", fired, deleted);
+	return 0;
+}
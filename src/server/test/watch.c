@@ -0,0 +1,95 @@
+/* SUBGROUP_WATCH on a group whose member list does not fit one frame:
+ * the snapshot has to come as MEMBERS_AT_PART frames and a final
+ * MEMBERS_AT, all of the same generation and together listing every
+ * member once, and the first MEMBER_DELTA only after them. A group that
+ * cannot be watched is answered with REQUEST_FAILED.
+ */
+#include "harness.h"
+
+#define PORT "51711"
+#define GROUP "watch"
+#define MEMBERS 8000 // "[2001:db8::xxxx]:pppp," is about 24 bytes
+#define NEWCOMER "10.9.9.9:9"
+
+static char list[MEMBERS * 64];
+
+static uint64_t frame_gen(const char *frame)
+{
+	uint64_t gen;
+
+	memcpy(&gen, frame + 2 + strlen(GROUP), sizeof(gen));
+	return be64toh(gen);
+}
+
+// Read a whole MEMBERS_AT into list; returns its generation, counts the frames
+static uint64_t read_snapshot(int fd, int *frames)
+{
+	static char reply[2 + 255 + 8 + 2 + 65535];
+	size_t hdr = 2 + strlen(GROUP) + 8, len, total = 0;
+	uint64_t gen = 0;
+	ssize_t n;
+
+	*frames = 0;
+	do {
+		CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) >= (ssize_t)(hdr + 2));
+		CHECK(reply[0] == MEMBERS_AT_PART || reply[0] == MEMBERS_AT);
+		CHECK(memcmp(reply + 2, GROUP, strlen(GROUP)) == 0);
+		CHECK(*frames == 0 || frame_gen(reply) == gen);
+		gen = frame_gen(reply);
+		len = (size_t)(uint8_t)reply[hdr] << 8 | (uint8_t)reply[hdr + 1];
+		CHECK(len == n - hdr - 2);
+		CHECK(len == 0 || reply[hdr + 2 + len - 1] == ',');
+		CHECK(total + len < sizeof(list));
+		memcpy(list + total, reply + hdr + 2, len);
+		total += len;
+		(*frames)++;
+	} while(reply[0] == MEMBERS_AT_PART);
+	list[total] = '\0';
+	return gen;
+}
+
+int main()
+{
+	char addr[64], reply[4096], *seen;
+	size_t len, hdr = 2 + strlen(GROUP);
+	uint64_t gen;
+	int fd, other, idx, frames;
+	unsigned int a, p;
+	ssize_t n;
+
+	spawn_smoke(PORT, NULL);
+	fd = connect_to(PORT);
+
+	send_msg(fd, SUBGROUP_WATCH, "watch.missing", NULL, 0);
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) > 0);
+	CHECK(reply[0] == REQUEST_FAILED && reply[2 + 13 + 2] == SUBGROUP_WATCH);
+	printf("watching a missing group failed with REQUEST_FAILED\n");
+
+	for(idx = 0; idx < MEMBERS; ++idx) {
+		len = snprintf(addr, sizeof(addr), "[2001:db8::%x]:%u", idx + 1, 1000 + idx);
+		send_msg(fd, JOINGROUP, GROUP, addr, len);
+	}
+	send_msg(fd, SUBGROUP_WATCH, GROUP, NULL, 0);
+	gen = read_snapshot(fd, &frames);
+	CHECK(frames > 1);
+
+	seen = calloc(MEMBERS, 1);
+	for(len = 0; list[len]; len += strchr(list + len, ',') - (list + len) + 1) {
+		CHECK(sscanf(list + len, "[2001:db8::%x]:%u,", &a, &p) == 2);
+		CHECK(a >= 1 && a <= MEMBERS && p == 1000 + a - 1 && !seen[a - 1]);
+		seen[a - 1] = 1;
+	}
+	for(idx = 0; idx < MEMBERS; ++idx)
+		CHECK(seen[idx]);
+	printf("%d members in %d frames of generation %llu\n", MEMBERS, frames, (unsigned long long)gen);
+
+	other = connect_to(PORT);
+	send_msg(other, JOINGROUP, GROUP, NEWCOMER, strlen(NEWCOMER));
+	CHECK((n = read_frame(fd, reply, sizeof(reply), 5000)) > 0);
+	CHECK(reply[0] == MEMBER_DELTA && frame_gen(reply) == gen + 1);
+	CHECK(reply[hdr + 8] == JOINGROUP);
+	CHECK((size_t)n == hdr + 8 + 1 + 2 + strlen(NEWCOMER));
+	CHECK(memcmp(reply + hdr + 8 + 3, NEWCOMER, strlen(NEWCOMER)) == 0);
+	printf("the next join came as a delta after the snapshot\n");
+	return 0;
+}
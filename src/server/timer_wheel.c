@@ -0,0 +1,103 @@
+/* Hierarchical timing wheel, see timer_wheel.h.
+ *
+ * Level n slots are WHEEL_SLOTS^n ticks wide. An entry goes in the
+ * lowest level whose span covers its distance from now, at the slot its
+ * deadline falls in. Whenever the bottom level wraps, the next slot of
+ * the level above is emptied back into the wheel, which lands each of
+ * its entries one or more levels lower.
+ */
+#include <stddef.h>
+#include "timer_wheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * WHEEL_BITS)
+#define MAX_DELTA (((uint64_t)1 << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+void wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	int level, slot;
+
+	w->now = now;
+	for(level = 0; level < WHEEL_LEVELS; ++level) {
+		for(slot = 0; slot < WHEEL_SLOTS; ++slot) {
+			w->slots[level][slot].next = &w->slots[level][slot];
+			w->slots[level][slot].prev = &w->slots[level][slot];
+		}
+	}
+}
+
+static void link_entry(struct wheel_entry *head, struct wheel_entry *e)
+{
+	e->next = head->next;
+	e->prev = head;
+	head->next->prev = e;
+	head->next = e;
+}
+
+void wheel_add(struct timer_wheel *w, struct wheel_entry *e, uint64_t expires)
+{
+	uint64_t delta;
+	int level;
+
+	// Already late entries go in the very next slot
+	if(expires <= w->now)
+		expires = w->now + 1;
+	if(expires - w->now > MAX_DELTA)
+		expires = w->now + MAX_DELTA;
+	e->expires = expires;
+
+	delta = expires - w->now;
+	for(level = 0; level < WHEEL_LEVELS - 1; ++level) {
+		if(delta < ((uint64_t)1 << LEVEL_SHIFT(level + 1)))
+			break;
+	}
+	link_entry(&w->slots[level][(expires >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1)], e);
+}
+
+void wheel_del(struct wheel_entry *e)
+{
+	if(!wheel_armed(e))
+		return;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = e->prev = NULL;
+}
+
+/* Re-add every entry of a higher level slot; each lands lower down. One
+ * due this very tick goes straight into the bottom slot about to be
+ * emptied, as wheel_add would push it to the next.
+ */
+static void cascade(struct timer_wheel *w, int level)
+{
+	struct wheel_entry *head, *e;
+
+	head = &w->slots[level][(w->now >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1)];
+	while((e = head->next) != head) {
+		wheel_del(e);
+		if(e->expires == w->now)
+			link_entry(&w->slots[0][w->now & (WHEEL_SLOTS - 1)], e);
+		else
+			wheel_add(w, e, e->expires);
+	}
+}
+
+void wheel_advance(struct timer_wheel *w, uint64_t now,
+	void (*fn)(struct wheel_entry *e, void *arg), void *arg)
+{
+	struct wheel_entry *head, *e;
+	int level;
+
+	while(w->now < now) {
+		w->now++;
+		for(level = 1; level < WHEEL_LEVELS; ++level) {
+			if(w->now & ((1 << LEVEL_SHIFT(level)) - 1))
+				break;
+			cascade(w, level);
+		}
+
+		head = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+		while((e = head->next) != head) {
+			wheel_del(e);
+			fn(e, arg);
+		}
+	}
+}
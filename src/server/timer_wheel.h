@@ -0,0 +1,43 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+/* A hierarchical timing wheel over integer ticks.
+ *
+ * Entries are embedded in the caller's own structures. Adding and
+ * deleting are O(1); an entry due within WHEEL_SLOTS ticks sits in the
+ * bottom level, later ones in coarser levels that are cascaded down as
+ * time reaches them. Deadlines beyond the top level are clamped to it
+ * and simply come up early. Nothing here locks.
+ */
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^24 ticks of range
+
+struct wheel_entry {
+	struct wheel_entry *next;	// NULL while not in a wheel
+	struct wheel_entry *prev;
+	uint64_t expires;
+};
+
+struct timer_wheel {
+	uint64_t now;
+	struct wheel_entry slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+};
+
+void wheel_init(struct timer_wheel *w, uint64_t now);
+void wheel_add(struct timer_wheel *w, struct wheel_entry *e, uint64_t expires);
+void wheel_del(struct wheel_entry *e);
+
+static inline int wheel_armed(const struct wheel_entry *e)
+{
+	return e->next != NULL;
+}
+
+/* Move the wheel up to now, unlinking every entry that has come due and
+ * passing it to fn. fn may add entries back.
+ */
+void wheel_advance(struct timer_wheel *w, uint64_t now,
+	void (*fn)(struct wheel_entry *e, void *arg), void *arg);
+
+#endif /* _TIMER_WHEEL_H */
@@ -0,0 +1,269 @@
+/* Wildcard subscription trie, see topic_trie.h.
+ *
+ * Each node is one segment of some pattern. Literal segments hang off
+ * the children map (only allocated once a node has one), the two
+ * wildcards off their own pointers so matching never has to look them
+ * up. Nodes left with no subscribers and no children are pruned, so the
+ * trie only ever holds live patterns.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "topic_trie.h"
+#include "hashmap.h"
+
+#define MAX_DEPTH 128 // Segments in a name of < 256 bytes
+#define DEFAULT_MAX_FDS 4
+
+struct trie_node {
+	void *children; /* literal segment -> struct trie_node */
+	int num_children;
+	struct trie_node *star;
+	struct trie_node *hash; // never has children of its own
+	int *fds; /* subscribers of the pattern ending here */
+	int num_fds;
+	int max_fds;
+};
+
+struct topic_trie {
+	struct trie_node root;
+	size_t size; // (pattern, fd) pairs
+};
+
+/* The segment starting at name, up to the next '.' or end */
+static size_t segment_len(const char *name, const char *end)
+{
+	const char *dot;
+
+	if((dot = memchr(name, '.', end - name)) == NULL)
+		return end - name;
+	return dot - name;
+}
+
+static int is_wildcard(const char *seg, size_t len)
+{
+	return len == 1 && (seg[0] == '*' || seg[0] == '#');
+}
+
+struct topic_trie *trie_create()
+{
+	return calloc(1, sizeof(struct topic_trie));
+}
+
+size_t trie_size(const struct topic_trie *trie)
+{
+	return trie->size;
+}
+
+int topic_is_pattern(const char *name, size_t len)
+{
+	const char *end = name + len;
+	size_t seg;
+
+	for(; name < end; name += seg + 1) {
+		seg = segment_len(name, end);
+		if(is_wildcard(name, seg))
+			return 1;
+	}
+	return 0;
+}
+
+/* Split pattern into its segments. Empty segments, a '#' anywhere but
+ * last and wildcards sharing a segment with anything else are refused.
+ */
+static int split_pattern(const char *pattern, size_t len, const char **segs, size_t *lens)
+{
+	const char *p = pattern, *end = pattern + len;
+	int depth = 0;
+
+	if(len == 0)
+		return -1;
+	while(1) {
+		if(depth == MAX_DEPTH)
+			return -1;
+		lens[depth] = segment_len(p, end);
+		segs[depth] = p;
+		if(lens[depth] == 0 ||
+		   (lens[depth] > 1 && (memchr(p, '*', lens[depth]) || memchr(p, '#', lens[depth]))))
+			return -1;
+		p += lens[depth++];
+		if(p == end)
+			break;
+		if(segs[depth - 1][0] == '#' && lens[depth - 1] == 1)
+			return -1;
+		if(++p == end)
+			return -1; // trailing '.'
+	}
+	return depth;
+}
+
+static struct trie_node *get_child(const struct trie_node *node, const char *seg, size_t len)
+{
+	if(is_wildcard(seg, len))
+		return seg[0] == '*' ? node->star : node->hash;
+	return node->children ? map_get_n(node->children, seg, len) : NULL;
+}
+
+static struct trie_node *add_child(struct trie_node *node, const char *seg, size_t len)
+{
+	struct trie_node *child;
+
+	if((child = calloc(1, sizeof(struct trie_node))) == NULL)
+		return NULL;
+	if(is_wildcard(seg, len)) {
+		if(seg[0] == '*')
+			node->star = child;
+		else
+			node->hash = child;
+	} else if((node->children == NULL && (node->children = initialize_map()) == NULL) ||
+		  map_put_n(node->children, seg, len, child) == -1) {
+		free(child);
+		return NULL;
+	}
+	node->num_children++;
+	return child;
+}
+
+static void drop_child(struct trie_node *node, const char *seg, size_t len)
+{
+	struct trie_node *child;
+
+	if(is_wildcard(seg, len)) {
+		if(seg[0] == '*') {
+			child = node->star;
+			node->star = NULL;
+		} else {
+			child = node->hash;
+			node->hash = NULL;
+		}
+	} else {
+		child = map_remove_n(node->children, seg, len);
+	}
+	free(child->fds);
+	free(child);
+	if(--node->num_children == 0 && node->children) {
+		map_destroy(node->children, NULL);
+		node->children = NULL;
+	}
+}
+
+/* Free the empty tail of the path to a pattern, deepest first */
+static void prune(struct trie_node **path, const char **segs, size_t *lens, int depth)
+{
+	while(depth > 0 && path[depth]->num_fds == 0 && path[depth]->num_children == 0) {
+		drop_child(path[depth - 1], segs[depth - 1], lens[depth - 1]);
+		depth--;
+	}
+}
+
+int trie_insert(struct topic_trie *trie, const char *pattern, size_t len, int fd)
+{
+	struct trie_node *path[MAX_DEPTH + 1], *node;
+	const char *segs[MAX_DEPTH];
+	size_t lens[MAX_DEPTH];
+	int depth, idx, *new_fds, new_max;
+
+	if((depth = split_pattern(pattern, len, segs, lens)) == -1)
+		return -1;
+
+	path[0] = node = &trie->root;
+	for(idx = 0; idx < depth; ++idx) {
+		if((node = get_child(path[idx], segs[idx], lens[idx])) == NULL &&
+		   (node = add_child(path[idx], segs[idx], lens[idx])) == NULL)
+			goto fail;
+		path[idx + 1] = node;
+	}
+
+	for(idx = 0; idx < node->num_fds; ++idx) {
+		if(node->fds[idx] == fd)
+			return 0;
+	}
+	if(node->num_fds == node->max_fds) {
+		new_max = node->max_fds ? 2 * node->max_fds : DEFAULT_MAX_FDS;
+		if((new_fds = realloc(node->fds, new_max * sizeof(int))) == NULL) {
+			idx = depth;
+			goto fail;
+		}
+		node->fds = new_fds;
+		node->max_fds = new_max;
+	}
+	node->fds[node->num_fds++] = fd;
+	trie->size++;
+	return 0;
+fail:
+	prune(path, segs, lens, idx);
+	return -1;
+}
+
+int trie_remove(struct topic_trie *trie, const char *pattern, size_t len, int fd)
+{
+	struct trie_node *path[MAX_DEPTH + 1], *node;
+	const char *segs[MAX_DEPTH];
+	size_t lens[MAX_DEPTH];
+	int depth, idx;
+
+	if((depth = split_pattern(pattern, len, segs, lens)) == -1)
+		return -1;
+
+	path[0] = &trie->root;
+	for(idx = 0; idx < depth; ++idx) {
+		if((path[idx + 1] = get_child(path[idx], segs[idx], lens[idx])) == NULL)
+			return -1;
+	}
+
+	node = path[depth];
+	for(idx = 0; idx < node->num_fds; ++idx) {
+		if(node->fds[idx] == fd)
+			break;
+	}
+	if(idx == node->num_fds)
+		return -1;
+	node->fds[idx] = node->fds[--node->num_fds];
+	trie->size--;
+	prune(path, segs, lens, depth);
+	return 0;
+}
+
+static void match_fds(const struct trie_node *node, trie_match_t fn, void *arg)
+{
+	int idx;
+
+	for(idx = 0; idx < node->num_fds; ++idx)
+		fn(node->fds[idx], arg);
+}
+
+/* name is what is left to match once node has been reached; done once
+ * every segment has been used up.
+ */
+static void match_node(const struct trie_node *node, const char *name, const char *end,
+	int done, trie_match_t fn, void *arg)
+{
+	const struct trie_node *child;
+	const char *next;
+	size_t seg;
+
+	// '#' takes the rest, even if that is nothing
+	if(node->hash)
+		match_fds(node->hash, fn, arg);
+	if(done) {
+		match_fds(node, fn, arg);
+		return;
+	}
+
+	seg = segment_len(name, end);
+	next = name + seg;
+	done = next == end;
+	if(!done)
+		next++;
+	if(node->children && (child = map_get_n(node->children, name, seg)) != NULL)
+		match_node(child, next, end, done, fn, arg);
+	if(node->star)
+		match_node(node->star, next, end, done, fn, arg);
+}
+
+void trie_match(const struct topic_trie *trie, const char *name, size_t len,
+	trie_match_t fn, void *arg)
+{
+	if(trie->root.num_children == 0 || len == 0)
+		return;
+	match_node(&trie->root, name, name + len, 0, fn, arg);
+}
@@ -0,0 +1,32 @@
+#ifndef _TOPIC_TRIE_H
+#define _TOPIC_TRIE_H
+/* Subscriptions to dotted group name patterns, e.g. "payments.*.eu" or
+ * "payments.#". A "*" segment matches exactly one segment of a name and
+ * a "#" segment, which has to come last, matches whatever is left of it
+ * (including nothing). Wildcards are whole segments only.
+ *
+ * Patterns are stored one segment per trie level, so finding every
+ * subscriber whose pattern matches a name walks at most the name's
+ * depth for each wildcard branch that applies, however many patterns
+ * there are. Nothing here locks.
+ */
+#include <stddef.h>
+
+struct topic_trie;
+
+typedef void (*trie_match_t)(int fd, void *arg);
+
+struct topic_trie *trie_create();
+// Subscriptions held, counting each fd of each pattern once
+size_t trie_size(const struct topic_trie *trie);
+// Whether name has a wildcard segment and so names a pattern
+int topic_is_pattern(const char *name, size_t len);
+// -1 for a malformed pattern or out of memory; subscribing twice is fine
+int trie_insert(struct topic_trie *trie, const char *pattern, size_t len, int fd);
+// -1 if fd was not subscribed to pattern
+int trie_remove(struct topic_trie *trie, const char *pattern, size_t len, int fd);
+// Calls fn for every fd of every pattern name matches
+void trie_match(const struct topic_trie *trie, const char *name, size_t len,
+	trie_match_t fn, void *arg);
+
+#endif /* _TOPIC_TRIE_H */